@@ -0,0 +1,343 @@
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include "replay.h"
+#include "obs-internal.h"
+
+/* The audio history of a filter is one float ring per channel, addressed
+ * by the absolute sample position, and a ring of packets that only holds
+ * the timestamp, position and length of every captured packet. A packet is
+ * never split over the end of the sample ring, the audio thread skips to
+ * the start of the ring instead, so every packet can point straight into
+ * the ring buffers.
+ *
+ * Packets are only taken out while a retrieve holds the audio lock. The
+ * audio thread does not take audio_mutex for a packet unless a retrieve
+ * holds it, audio_pushing and audio_locked are set with full barriers so
+ * either the retrieve waits for the push or the push sees the lock.
+ * Retrieving hands the buffers with all their packets over to the replay
+ * and gives the filter new buffers of the same size, allocated on the
+ * retrieving thread, so no samples are copied and the audio thread does
+ * not allocate. A snapshot or a partial retrieve copies the samples it
+ * needs instead, without holding the lock. */
+
+#define REPLAY_AUDIO_MIN_CAPACITY 4096
+
+static inline uint64_t audio_capacity(uint64_t samples)
+{
+	uint64_t capacity = REPLAY_AUDIO_MIN_CAPACITY;
+	while (capacity < samples)
+		capacity *= 2;
+	return capacity;
+}
+
+/* position of the oldest sample still in use */
+static uint64_t audio_front(struct replay_filter *filter)
+{
+	struct replay_audio_packet packet;
+	unsigned long index;
+
+	if (replay_ring_peek_front(&filter->audio_packets, &packet, &index))
+		return packet.offset;
+	return filter->audio_position;
+}
+
+static void audio_clear(struct replay_filter *filter)
+{
+	struct replay_audio_packet packet;
+
+	while (replay_ring_pop(&filter->audio_packets, &packet))
+		continue;
+}
+
+void replay_audio_lock(struct replay_filter *filter)
+{
+	pthread_mutex_lock(&filter->audio_mutex);
+	os_atomic_set_bool(&filter->audio_locked, true);
+	while (os_atomic_load_bool(&filter->audio_pushing))
+		os_sleep_ms(0);
+}
+
+void replay_audio_unlock(struct replay_filter *filter)
+{
+	os_atomic_set_bool(&filter->audio_locked, false);
+	pthread_mutex_unlock(&filter->audio_mutex);
+}
+
+/* Moves the samples still in use to larger buffers or starts new buffers
+ * for other channels, only needed when the duration or the channels
+ * change. Called by the push. */
+static void audio_grow(struct replay_filter *filter, size_t channels,
+		uint64_t samples)
+{
+	struct replay_audio_buffer *old = &filter->audio_buffer;
+	struct replay_audio_buffer buffer = {0};
+	buffer.mask = audio_capacity(samples) - 1;
+	buffer.channels = channels;
+	for (size_t ch = 0; ch < channels; ch++)
+		buffer.data[ch] = bmalloc((buffer.mask + 1) * sizeof(float));
+
+	if (old->channels != channels) {
+		/* the old samples can not be kept with other channels */
+		audio_clear(filter);
+	} else {
+		/* the new capacity is a multiple of the old one, so packets
+		 * stay in one piece */
+		const uint64_t end = filter->audio_position;
+		uint64_t position = audio_front(filter);
+		while (position < end) {
+			uint64_t count = end - position;
+			if (count > old->mask + 1 - (position & old->mask))
+				count = old->mask + 1 - (position & old->mask);
+			for (size_t ch = 0; ch < channels; ch++)
+				memcpy(buffer.data[ch] + (position & buffer.mask),
+						old->data[ch] + (position & old->mask),
+						count * sizeof(float));
+			position += count;
+		}
+	}
+
+	/* a copy may still read the old buffers, it frees them when done */
+	const bool retire = filter->audio_copying && !filter->audio_retired[0];
+	for (size_t ch = 0; ch < MAX_AV_PLANES; ch++) {
+		if (retire)
+			filter->audio_retired[ch] = old->data[ch];
+		else
+			bfree(old->data[ch]);
+	}
+	*old = buffer;
+}
+
+static bool audio_push(struct replay_filter *filter,
+		const struct obs_audio_data *audio, uint64_t timestamp,
+		size_t channels)
+{
+	struct replay_audio_packet packet;
+
+	/* room for the whole duration with some slack for timestamp jitter */
+	const uint64_t wanted = (filter->duration + 2 * MAX_TS_VAR) *
+			filter->oai.samples_per_sec / SEC_TO_NSEC + audio->frames * 2;
+
+	struct replay_audio_buffer *buffer = &filter->audio_buffer;
+	if (buffer->channels != channels || buffer->mask + 1 < wanted)
+		audio_grow(filter, channels, wanted);
+
+	uint64_t position = filter->audio_position;
+	const uint64_t start = position & buffer->mask;
+	if (start + audio->frames > buffer->mask + 1)
+		position += buffer->mask + 1 - start;
+
+	unsigned long index;
+	while (position + audio->frames - audio_front(filter) > buffer->mask + 1 &&
+			replay_ring_peek_front(&filter->audio_packets, &packet, &index))
+		replay_ring_take(&filter->audio_packets, index);
+
+	for (size_t ch = 0; ch < channels; ch++)
+		memcpy(buffer->data[ch] + (position & buffer->mask),
+				audio->data[ch], audio->frames * sizeof(float));
+
+	packet.timestamp = timestamp;
+	packet.offset = position;
+	packet.frames = audio->frames;
+	const bool pushed = replay_ring_push(&filter->audio_packets, &packet);
+	filter->audio_position = position + audio->frames;
+
+	while (replay_ring_count(&filter->audio_packets) > 1 &&
+			replay_ring_peek_front(&filter->audio_packets, &packet, &index) &&
+			timestamp - packet.timestamp >= filter->duration + MAX_TS_VAR)
+		replay_ring_take(&filter->audio_packets, index);
+	return pushed;
+}
+
+/* Stores a captured packet and drops the packets that are older than the
+ * duration or do not fit in the sample ring anymore. Only called from the
+ * audio thread. */
+bool replay_audio_push(struct replay_filter *filter,
+		const struct obs_audio_data *audio, uint64_t timestamp)
+{
+	size_t channels = 0;
+
+	while (channels < MAX_AV_PLANES && audio->data[channels])
+		channels++;
+	if (!channels || !audio->frames)
+		return false;
+
+	os_atomic_set_bool(&filter->audio_pushing, true);
+	if (!os_atomic_load_bool(&filter->audio_locked)) {
+		const bool pushed = audio_push(filter, audio, timestamp, channels);
+		os_atomic_set_bool(&filter->audio_pushing, false);
+		return pushed;
+	}
+	os_atomic_set_bool(&filter->audio_pushing, false);
+
+	pthread_mutex_lock(&filter->audio_mutex);
+	const bool pushed = audio_push(filter, audio, timestamp, channels);
+	pthread_mutex_unlock(&filter->audio_mutex);
+	return pushed;
+}
+
+/* Takes all buffered packets together with the sample buffers they point
+ * into, the caller owns data and frees it after the packets. Returns the
+ * number of packets. */
+size_t replay_audio_take(struct replay_filter *filter,
+		struct obs_audio_data **packets, float *data[MAX_AV_PLANES])
+{
+	struct replay_audio_packet packet;
+	unsigned long index;
+	size_t count = 0;
+
+	*packets = NULL;
+	memset(data, 0, sizeof(float*) * MAX_AV_PLANES);
+
+	/* the buffers the filter continues with are allocated here, the
+	 * size only changes with the duration or the channels */
+	struct replay_audio_buffer fresh = {0};
+	replay_audio_lock(filter);
+	fresh.mask = filter->audio_buffer.mask;
+	fresh.channels = filter->audio_buffer.channels;
+	replay_audio_unlock(filter);
+	for (size_t ch = 0; ch < fresh.channels; ch++)
+		fresh.data[ch] = bmalloc((fresh.mask + 1) * sizeof(float));
+
+	replay_audio_lock(filter);
+	struct replay_audio_buffer *buffer = &filter->audio_buffer;
+	if (replay_ring_peek_front(&filter->audio_packets, &packet, &index))
+		count = replay_ring_count(&filter->audio_packets);
+	if (count) {
+		struct obs_audio_data *audio = bzalloc(count * sizeof(struct obs_audio_data));
+		for (size_t i = 0; i < count; i++) {
+			replay_ring_peek(&filter->audio_packets,
+					index + (unsigned long)i, &packet);
+			audio[i].timestamp = packet.timestamp;
+			audio[i].frames = packet.frames;
+			for (size_t ch = 0; ch < buffer->channels; ch++)
+				audio[i].data[ch] = (uint8_t*)(buffer->data[ch] +
+						(packet.offset & buffer->mask));
+		}
+		replay_ring_take_range(&filter->audio_packets, index, count);
+
+		memcpy(data, buffer->data, sizeof(float*) * MAX_AV_PLANES);
+		if (fresh.channels == buffer->channels && fresh.mask == buffer->mask) {
+			*buffer = fresh;
+			memset(&fresh, 0, sizeof(struct replay_audio_buffer));
+		} else {
+			memset(buffer, 0, sizeof(struct replay_audio_buffer));
+		}
+		*packets = audio;
+	}
+	replay_audio_unlock(filter);
+
+	/* not needed when nothing was taken or the size changed meanwhile */
+	for (size_t ch = 0; ch < MAX_AV_PLANES; ch++)
+		bfree(fresh.data[ch]);
+	return count;
+}
+
+/* Copies the packets with a timestamp from from to to into one block of
+ * samples per channel, the packets point into the blocks. With take the
+ * packets up to the end of the window are taken out of the filter, older
+ * ones are dropped. Returns the number of packets.
+ *
+ * Only the packet range is looked up while the audio lock is held, the
+ * samples are copied after it is released while the audio thread keeps
+ * pushing. The push drops a packet before it reuses its samples, so the
+ * packets that are still in the ring after the copy were copied intact and
+ * the ones dropped meanwhile are left out. */
+size_t replay_audio_copy(struct replay_filter *filter, uint64_t from,
+		uint64_t to, bool take, struct obs_audio_data **packets,
+		float *data[MAX_AV_PLANES])
+{
+	struct replay_audio_packet first, packet;
+	const size_t key = offsetof(struct replay_audio_packet, timestamp);
+	unsigned long index;
+	size_t count = 0;
+
+	*packets = NULL;
+	memset(data, 0, sizeof(float*) * MAX_AV_PLANES);
+
+	replay_audio_lock(filter);
+	if (!replay_ring_peek_front(&filter->audio_packets, &first, &index)) {
+		replay_audio_unlock(filter);
+		return 0;
+	}
+	const unsigned long begin = replay_ring_lower_bound(&filter->audio_packets,
+			key, from);
+	const unsigned long end = to < UINT64_MAX ?
+			replay_ring_lower_bound(&filter->audio_packets, key, to + 1) :
+			index + (unsigned long)replay_ring_count(&filter->audio_packets);
+	count = (long)(end - begin) > 0 ? end - begin : 0;
+
+	/* the buffers stay allocated until the copy is done, a grow keeps
+	 * them in audio_retired */
+	const struct replay_audio_buffer buffer = filter->audio_buffer;
+	uint64_t samples = 0;
+	if (count) {
+		replay_ring_peek(&filter->audio_packets, begin, &first);
+		replay_ring_peek(&filter->audio_packets, end - 1, &packet);
+		samples = packet.offset + packet.frames - first.offset;
+		filter->audio_copying = true;
+	}
+	replay_audio_unlock(filter);
+
+	if (count) {
+		const uint64_t start = first.offset & buffer.mask;
+		const uint64_t part = buffer.mask + 1 - start < samples ?
+				buffer.mask + 1 - start : samples;
+		for (size_t ch = 0; ch < buffer.channels; ch++) {
+			data[ch] = bmalloc(samples * sizeof(float));
+			memcpy(data[ch], buffer.data[ch] + start, part * sizeof(float));
+			memcpy(data[ch] + part, buffer.data[ch],
+					(samples - part) * sizeof(float));
+		}
+	}
+
+	struct obs_audio_data *audio = count ?
+			bzalloc(count * sizeof(struct obs_audio_data)) : NULL;
+	size_t copied = 0;
+	replay_audio_lock(filter);
+	for (size_t i = 0; i < count; i++) {
+		/* packets the push dropped during the copy may be overwritten */
+		if (!replay_ring_peek(&filter->audio_packets,
+				begin + (unsigned long)i, &packet))
+			continue;
+		audio[copied].timestamp = packet.timestamp;
+		audio[copied].frames = packet.frames;
+		for (size_t ch = 0; ch < buffer.channels; ch++)
+			audio[copied].data[ch] = (uint8_t*)(data[ch] +
+					(packet.offset - first.offset));
+		copied++;
+	}
+	if (take && replay_ring_peek_front(&filter->audio_packets, &packet, &index) &&
+			(long)(end - index) > 0)
+		replay_ring_take_range(&filter->audio_packets, index,
+				(size_t)(end - index));
+	if (count) {
+		filter->audio_copying = false;
+		for (size_t ch = 0; ch < MAX_AV_PLANES; ch++) {
+			bfree(filter->audio_retired[ch]);
+			filter->audio_retired[ch] = NULL;
+		}
+	}
+	replay_audio_unlock(filter);
+
+	if (!copied) {
+		bfree(audio);
+		for (size_t ch = 0; ch < MAX_AV_PLANES; ch++) {
+			bfree(data[ch]);
+			data[ch] = NULL;
+		}
+		return 0;
+	}
+	*packets = audio;
+	return copied;
+}
+
+void replay_audio_free(struct replay_filter *filter)
+{
+	replay_ring_free(&filter->audio_packets);
+	for (size_t ch = 0; ch < MAX_AV_PLANES; ch++) {
+		bfree(filter->audio_buffer.data[ch]);
+		bfree(filter->audio_retired[ch]);
+	}
+	memset(&filter->audio_buffer, 0, sizeof(struct replay_audio_buffer));
+}
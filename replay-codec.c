@@ -0,0 +1,724 @@
+#include <obs-module.h>
+#include <util/threading.h>
+#include "replay.h"
+
+/* Intra-only planar codec for buffered frames. Every plane is predicted with
+ * the LOCO-I median predictor and the residuals are bit packed in blocks of
+ * CODEC_BLOCK samples that share one bit width, which keeps the cost per
+ * sample small and constant. With a near value above 0 the residuals are
+ * quantized like JPEG-LS near-lossless, every decoded sample is then within
+ * near of the original.
+ *
+ * Every plane is cut into CODEC_STRIPES horizontal stripes that are coded on
+ * their own, so a frame is compressed and decompressed on the copy pool.
+ * Rows of interleaved planes are split into one run per channel first, a
+ * constant alpha channel then costs only the block widths, and lossless RGB
+ * rows have green subtracted from red and blue. A block width takes half a
+ * byte and the payload of a block with a width of n bits is 2 * n bytes, so
+ * the residuals are written and read 8 at a time in a 64 bit word. */
+
+#define CODEC_MAGIC       0x33435052
+#define CODEC_PLANES      3
+#define CODEC_STRIPES     8
+#define CODEC_BLOCK       16
+/* the reader loads whole words past the last block it checked */
+#define CODEC_PADDING     64
+
+#define CODEC_FLAG_RCT    1
+
+struct codec_plane {
+	uint32_t width;
+	uint32_t lines;
+	uint32_t dist;
+};
+
+struct codec_header {
+	uint32_t magic;
+	uint32_t near;
+	uint32_t planes;
+	uint32_t flags;
+	uint32_t size[CODEC_PLANES][CODEC_STRIPES];
+};
+
+struct codec_job {
+	const struct obs_source_frame *src;
+	struct obs_source_frame *dst;
+	struct codec_plane planes[CODEC_PLANES];
+	uint32_t count;
+	uint32_t near;
+	uint32_t flags;
+	int16_t quant[511];
+
+	/* encoder output of every stripe, or the coded stripes to decode */
+	uint8_t *data[CODEC_PLANES][CODEC_STRIPES];
+	uint32_t size[CODEC_PLANES][CODEC_STRIPES];
+
+	/* rows and residuals of every stripe */
+	uint8_t *work;
+	size_t work_size;
+	volatile bool failed;
+};
+
+static uint32_t codec_planes(enum video_format format, uint32_t width,
+		uint32_t height, struct codec_plane *planes)
+{
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+		planes[0] = (struct codec_plane){width, height, 1};
+		planes[1] = (struct codec_plane){width / 2, height / 2, 1};
+		planes[2] = (struct codec_plane){width / 2, height / 2, 1};
+		return 3;
+
+	case VIDEO_FORMAT_NV12:
+		planes[0] = (struct codec_plane){width, height, 1};
+		planes[1] = (struct codec_plane){width, height / 2, 2};
+		return 2;
+
+	case VIDEO_FORMAT_I444:
+		planes[0] = (struct codec_plane){width, height, 1};
+		planes[1] = (struct codec_plane){width, height, 1};
+		planes[2] = (struct codec_plane){width, height, 1};
+		return 3;
+
+	case VIDEO_FORMAT_YVYU:
+	case VIDEO_FORMAT_YUY2:
+	case VIDEO_FORMAT_UYVY:
+		planes[0] = (struct codec_plane){width * 2, height, 4};
+		return 1;
+
+	case VIDEO_FORMAT_RGBA:
+	case VIDEO_FORMAT_BGRA:
+	case VIDEO_FORMAT_BGRX:
+		planes[0] = (struct codec_plane){width * 4, height, 4};
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static inline bool codec_is_rgb(enum video_format format)
+{
+	return format == VIDEO_FORMAT_RGBA || format == VIDEO_FORMAT_BGRA ||
+			format == VIDEO_FORMAT_BGRX;
+}
+
+static inline uint32_t codec_stripe_first(const struct codec_plane *plane,
+		size_t stripe)
+{
+	return (uint32_t)((uint64_t)plane->lines * stripe / CODEC_STRIPES);
+}
+
+static inline size_t codec_blocks(size_t samples)
+{
+	return (samples + CODEC_BLOCK - 1) / CODEC_BLOCK;
+}
+
+/* most bytes a row of the plane is coded in */
+static size_t codec_row_bound(const struct codec_plane *plane)
+{
+	const size_t blocks = codec_blocks(plane->width / plane->dist);
+	return plane->dist * (blocks * CODEC_BLOCK + (blocks + 1) / 2);
+}
+
+/* residuals of a run are padded to whole blocks */
+static inline size_t codec_run_stride(const struct codec_plane *plane)
+{
+	return codec_blocks(plane->width / plane->dist) * CODEC_BLOCK;
+}
+
+/* two rows of samples and two reconstructed rows, then the residuals */
+static size_t codec_work_size(const struct codec_plane *plane)
+{
+	return (size_t)plane->width * 4 + plane->dist * codec_run_stride(plane);
+}
+
+/* quantized residual for every prediction error -255..255 */
+static void codec_quant_table(int16_t *table, uint32_t near)
+{
+	const int step = 2 * (int)near + 1;
+	for (int e = -255; e <= 255; e++)
+		table[e + 255] = (int16_t)(e > 0 ? (e + (int)near) / step :
+				-(((int)near - e) / step));
+}
+
+static inline uint8_t codec_zigzag(int q)
+{
+	return (uint8_t)(((unsigned)q << 1) ^ (unsigned)(q >> 31));
+}
+
+static inline int codec_unzigzag(uint8_t u)
+{
+	return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+static inline int codec_predict(int a, int b, int c)
+{
+	const int mn = a < b ? a : b;
+	const int mx = a < b ? b : a;
+	const int p = a + b - c;
+	return p < mn ? mn : p > mx ? mx : p;
+}
+
+/* Splits an interleaved row into dist runs of width / dist samples, lossless
+ * RGB rows get green, the second byte of every pixel, subtracted from the
+ * first and the third. */
+static void codec_split_row(uint8_t *dst, const uint8_t *src, uint32_t width,
+		uint32_t dist, bool rct)
+{
+	const uint32_t count = width / dist;
+
+	if (dist == 4) {
+		uint8_t *c0 = dst, *c1 = dst + count, *c2 = c1 + count,
+				*c3 = c2 + count;
+		const uint8_t mask = rct ? 0xFF : 0;
+		for (uint32_t i = 0; i < count; i++, src += 4) {
+			const uint8_t g = src[1] & mask;
+			c0[i] = (uint8_t)(src[0] - g);
+			c1[i] = src[1];
+			c2[i] = (uint8_t)(src[2] - g);
+			c3[i] = src[3];
+		}
+	} else {
+		for (uint32_t i = 0; i < count; i++, src += dist)
+			for (uint32_t ch = 0; ch < dist; ch++)
+				dst[ch * count + i] = src[ch];
+	}
+}
+
+static void codec_merge_row(uint8_t *dst, const uint8_t *src, uint32_t width,
+		uint32_t dist)
+{
+	const uint32_t count = width / dist;
+
+	for (uint32_t i = 0; i < count; i++, dst += dist)
+		for (uint32_t ch = 0; ch < dist; ch++)
+			dst[ch] = src[ch * count + i];
+}
+
+/* adds green back to red and blue of count pixels */
+static void codec_undo_rct(uint8_t *dst, const uint8_t *src, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++, dst += 4, src += 4) {
+		dst[0] = (uint8_t)(src[0] + src[1]);
+		dst[1] = src[1];
+		dst[2] = (uint8_t)(src[2] + src[1]);
+		dst[3] = src[3];
+	}
+}
+
+/* lossless residuals of a run, prev is NULL on the first row of a stripe */
+static void codec_residuals(uint8_t *res, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	if (!prev) {
+		res[0] = codec_zigzag((int8_t)cur[0]);
+		for (size_t i = 1; i < count; i++)
+			res[i] = codec_zigzag((int8_t)(uint8_t)(cur[i] - cur[i - 1]));
+		return;
+	}
+	res[0] = codec_zigzag((int8_t)(uint8_t)(cur[0] - prev[0]));
+	if (count > 1)
+		replay_codec_residuals(res + 1, cur + 1, prev + 1, count - 1);
+}
+
+static inline int codec_clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Near-lossless residuals of dist runs of count samples in lockstep, which
+ * keeps that many chains of reconstructions in flight. rec gets the samples
+ * the decoder will reconstruct and is the prediction for the next row. */
+static inline void codec_residuals_near(uint8_t *res, size_t stride,
+		uint8_t *rec, const uint8_t *cur, const uint8_t *prev,
+		size_t count, const uint32_t dist, uint32_t near,
+		const int16_t *quant)
+{
+	const int step = 2 * (int)near + 1;
+
+	for (uint32_t ch = 0; ch < dist; ch++) {
+		const size_t o = ch * count;
+		const int p = prev ? prev[o] : 0;
+		const int q = quant[(int)cur[o] - p + 255];
+		rec[o] = (uint8_t)codec_clamp(p + q * step);
+		res[ch * stride] = codec_zigzag(q);
+	}
+	for (size_t i = 1; i < count; i++) {
+		for (uint32_t ch = 0; ch < dist; ch++) {
+			const size_t x = ch * count + i;
+			const int a = rec[x - 1];
+			const int p = prev ? codec_predict(a, prev[x],
+					prev[x - 1]) : a;
+			const int q = quant[(int)cur[x] - p + 255];
+			rec[x] = (uint8_t)codec_clamp(p + q * step);
+			res[ch * stride + i] = codec_zigzag(q);
+		}
+	}
+}
+
+static void codec_residuals_near_row(uint8_t *res, size_t stride,
+		uint8_t *rec, const uint8_t *cur, const uint8_t *prev,
+		size_t count, uint32_t dist, uint32_t near,
+		const int16_t *quant)
+{
+	switch (dist) {
+	case 1:
+		codec_residuals_near(res, stride, rec, cur, prev, count, 1,
+				near, quant);
+		break;
+	case 2:
+		codec_residuals_near(res, stride, rec, cur, prev, count, 2,
+				near, quant);
+		break;
+	case 4:
+		codec_residuals_near(res, stride, rec, cur, prev, count, 4,
+				near, quant);
+		break;
+	default:
+		codec_residuals_near(res, stride, rec, cur, prev, count, dist,
+				near, quant);
+	}
+}
+
+static inline uint32_t codec_block_bits(const uint8_t *res)
+{
+	uint64_t lo, hi;
+	memcpy(&lo, res, sizeof(lo));
+	memcpy(&hi, res + 8, sizeof(hi));
+	uint64_t all = lo | hi;
+	all |= all >> 32;
+	all |= all >> 16;
+	all |= all >> 8;
+	uint32_t value = (uint32_t)all & 0xFF;
+	uint32_t bits = 0;
+	while (value) {
+		bits++;
+		value >>= 1;
+	}
+	return bits;
+}
+
+/* writes the residuals of one run, which is padded with zeros to whole
+ * blocks, and returns the end; words are stored little endian like on
+ * every platform obs runs on */
+static uint8_t *codec_put_run(uint8_t *out, const uint8_t *res, size_t count)
+{
+	const size_t blocks = codec_blocks(count);
+	for (size_t i = 0; i < blocks; i += 2) {
+		uint8_t *widths = out++;
+		uint32_t pair = 0;
+		for (size_t j = i; j < i + 2 && j < blocks; j++) {
+			const uint8_t *block = res + j * CODEC_BLOCK;
+			const uint32_t bits = codec_block_bits(block);
+			pair |= bits << ((j - i) * 4);
+			for (size_t half = 0; bits && half < 2; half++) {
+				uint64_t word = 0;
+				for (uint32_t k = 0; k < 8; k++)
+					word |= (uint64_t)block[half * 8 + k] <<
+							(k * bits);
+				memcpy(out, &word, sizeof(word));
+				out += bits;
+			}
+		}
+		*widths = (uint8_t)pair;
+	}
+	return out;
+}
+
+/* reads the residuals of a run into res, NULL when the data ends */
+static const uint8_t *codec_get_run(const uint8_t *in, const uint8_t *end,
+		uint8_t *res, size_t count)
+{
+	const size_t blocks = codec_blocks(count);
+	for (size_t i = 0; i < blocks; i += 2) {
+		if (in >= end)
+			return NULL;
+		const uint32_t pair = *in++;
+		for (size_t j = i; j < i + 2 && j < blocks; j++) {
+			uint8_t *block = res + j * CODEC_BLOCK;
+			const uint32_t bits = (pair >> ((j - i) * 4)) & 0xF;
+			if (!bits) {
+				memset(block, 0, CODEC_BLOCK);
+				continue;
+			}
+			if (bits > 8)
+				return NULL;
+			const uint64_t mask = (1u << bits) - 1;
+			for (size_t half = 0; half < 2; half++) {
+				uint64_t word;
+				memcpy(&word, in, sizeof(word));
+				for (uint32_t k = 0; k < 8; k++)
+					block[half * 8 + k] = (uint8_t)(
+							(word >> (k * bits)) & mask);
+				in += bits;
+			}
+		}
+	}
+	return in;
+}
+
+/* next sample of a run from its left and upper neighbours, which move on */
+static inline uint8_t codec_rebuild(int *left, int *upper, int b, uint8_t r,
+		uint32_t near, int step)
+{
+	const int p = codec_predict(*left, b, *upper);
+	*left = near ? codec_clamp(p + codec_unzigzag(r) * step) :
+			(uint8_t)(p + codec_unzigzag(r));
+	*upper = b;
+	return (uint8_t)*left;
+}
+
+/* Reconstructs the dist runs of a row. Runs of interleaved planes are done
+ * in lockstep like the near-lossless encoder, which keeps that many chains
+ * of predictions in flight. The first row of a stripe is predicted from the
+ * left only. */
+static void codec_rebuild_row(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count, uint32_t dist,
+		uint32_t near)
+{
+	const int step = 2 * (int)near + 1;
+
+	if (!prev) {
+		for (uint32_t ch = 0; ch < dist; ch++) {
+			uint8_t *run = cur + ch * count;
+			const uint8_t *r = res + ch * stride;
+			int v = 0;
+			for (size_t i = 0; i < count; i++) {
+				v += codec_unzigzag(r[i]) * step;
+				v = near ? codec_clamp(v) : (uint8_t)v;
+				run[i] = (uint8_t)v;
+			}
+		}
+		return;
+	}
+
+	for (uint32_t ch = 0; ch < dist; ch++) {
+		const size_t o = ch * count;
+		const int v = prev[o] + codec_unzigzag(res[ch * stride]) * step;
+		cur[o] = (uint8_t)(near ? codec_clamp(v) : v);
+	}
+	if (dist == 4) {
+		int l0 = cur[0], l1 = cur[count], l2 = cur[count * 2],
+				l3 = cur[count * 3];
+		int u0 = prev[0], u1 = prev[count], u2 = prev[count * 2],
+				u3 = prev[count * 3];
+		const uint8_t *r0 = res, *r1 = res + stride,
+				*r2 = res + stride * 2, *r3 = res + stride * 3;
+		uint8_t *c0 = cur, *c1 = cur + count, *c2 = c1 + count,
+				*c3 = c2 + count;
+		const uint8_t *p0 = prev, *p1 = prev + count,
+				*p2 = p1 + count, *p3 = p2 + count;
+		for (size_t i = 1; i < count; i++) {
+			c0[i] = codec_rebuild(&l0, &u0, p0[i], r0[i], near, step);
+			c1[i] = codec_rebuild(&l1, &u1, p1[i], r1[i], near, step);
+			c2[i] = codec_rebuild(&l2, &u2, p2[i], r2[i], near, step);
+			c3[i] = codec_rebuild(&l3, &u3, p3[i], r3[i], near, step);
+		}
+	} else if (dist == 2) {
+		int l0 = cur[0], l1 = cur[count];
+		int u0 = prev[0], u1 = prev[count];
+		const uint8_t *r0 = res, *r1 = res + stride;
+		uint8_t *c0 = cur, *c1 = cur + count;
+		const uint8_t *p0 = prev, *p1 = prev + count;
+		for (size_t i = 1; i < count; i++) {
+			c0[i] = codec_rebuild(&l0, &u0, p0[i], r0[i], near, step);
+			c1[i] = codec_rebuild(&l1, &u1, p1[i], r1[i], near, step);
+		}
+	} else {
+		for (uint32_t ch = 0; ch < dist; ch++) {
+			uint8_t *c = cur + ch * count;
+			const uint8_t *p = prev + ch * count;
+			const uint8_t *r = res + ch * stride;
+			int l = c[0], u = p[0];
+			for (size_t i = 1; i < count; i++)
+				c[i] = codec_rebuild(&l, &u, p[i], r[i], near,
+						step);
+		}
+	}
+}
+
+static void codec_encode_stripe(void *param, size_t index)
+{
+	struct codec_job *job = param;
+	const size_t plane_index = index / CODEC_STRIPES;
+	const size_t stripe = index % CODEC_STRIPES;
+	const struct codec_plane *plane = job->planes + plane_index;
+	const uint32_t first = codec_stripe_first(plane, stripe);
+	const uint32_t last = codec_stripe_first(plane, stripe + 1);
+	const uint32_t dist = plane->dist;
+	const size_t count = plane->width / dist;
+	const bool rct = (job->flags & CODEC_FLAG_RCT) != 0;
+
+	const size_t stride = codec_run_stride(plane);
+	uint8_t *work = job->work + index * job->work_size;
+	uint8_t *rows[2] = {work, work + plane->width};
+	uint8_t *recs[2] = {work + plane->width * 2, work + plane->width * 3};
+	uint8_t *res = work + plane->width * 4;
+	uint8_t *out = job->data[plane_index][stripe];
+	const uint8_t *prev = NULL;
+
+	for (uint32_t y = first; y < last; y++) {
+		const uint8_t *line = job->src->data[plane_index] +
+				(size_t)y * job->src->linesize[plane_index];
+		const uint8_t *row = line;
+		if (dist > 1) {
+			codec_split_row(rows[y & 1], line, plane->width, dist, rct);
+			row = rows[y & 1];
+		}
+		uint8_t *rec = recs[y & 1];
+
+		if (job->near && dist == 4 && prev) {
+			/* the reconstructed rows stay interleaved */
+			replay_codec_quantize4(res, stride, rec, line, prev,
+					count, job->near);
+		} else if (job->near && dist == 4) {
+			uint8_t *split = rows[(y & 1) ^ 1];
+			codec_residuals_near_row(res, stride, split, row,
+					NULL, count, dist, job->near, job->quant);
+			codec_merge_row(rec, split, plane->width, dist);
+		} else if (job->near) {
+			codec_residuals_near_row(res, stride, rec, row, prev,
+					count, dist, job->near, job->quant);
+		}
+		for (uint32_t ch = 0; ch < dist; ch++) {
+			uint8_t *run = res + ch * stride;
+			if (!job->near)
+				codec_residuals(run, row + ch * count,
+						prev ? prev + ch * count : NULL,
+						count);
+			memset(run + count, 0, stride - count);
+			out = codec_put_run(out, run, count);
+		}
+		prev = job->near ? rec : row;
+	}
+	job->size[plane_index][stripe] = (uint32_t)(out -
+			job->data[plane_index][stripe]);
+}
+
+static void codec_decode_stripe(void *param, size_t index)
+{
+	struct codec_job *job = param;
+	const size_t plane_index = index / CODEC_STRIPES;
+	const size_t stripe = index % CODEC_STRIPES;
+	const struct codec_plane *plane = job->planes + plane_index;
+	const uint32_t first = codec_stripe_first(plane, stripe);
+	const uint32_t last = codec_stripe_first(plane, stripe + 1);
+	const uint32_t dist = plane->dist;
+	const size_t count = plane->width / dist;
+	const bool rct = (job->flags & CODEC_FLAG_RCT) != 0;
+
+	const size_t stride = codec_run_stride(plane);
+	uint8_t *work = job->work + index * job->work_size;
+	uint8_t *rows[2] = {work, work + plane->width};
+	uint8_t *split = work + plane->width * 2;
+	uint8_t *res = work + plane->width * 4;
+	const uint8_t *in = job->data[plane_index][stripe];
+	const uint8_t *end = in + job->size[plane_index][stripe];
+	const uint8_t *prev = NULL;
+
+	for (uint32_t y = first; y < last; y++) {
+		uint8_t *line = job->dst->data[plane_index] +
+				(size_t)y * job->dst->linesize[plane_index];
+
+		for (uint32_t ch = 0; ch < dist && in; ch++)
+			in = codec_get_run(in, end, res + ch * stride, count);
+		if (!in) {
+			os_atomic_set_bool(&job->failed, true);
+			return;
+		}
+
+		if (dist == 4) {
+			/* pixels are rebuilt whole, the colour transform is
+			 * undone after that */
+			uint8_t *row = rct ? rows[y & 1] : line;
+			if (prev) {
+				replay_codec_rebuild4(row, prev, res, stride,
+						count, job->near);
+			} else {
+				codec_rebuild_row(split, NULL, res, stride,
+						count, dist, job->near);
+				codec_merge_row(row, split, plane->width, dist);
+			}
+			if (rct)
+				codec_undo_rct(line, row, (uint32_t)count);
+			prev = row;
+		} else {
+			uint8_t *row = dist > 1 ? rows[y & 1] : line;
+			codec_rebuild_row(row, prev, res, stride, count, dist,
+					job->near);
+			if (dist > 1)
+				codec_merge_row(line, row, plane->width, dist);
+			prev = row;
+		}
+	}
+}
+
+/* every stripe on the copy pool, or on this thread when it is busy */
+static void codec_run(void (*task)(void *param, size_t index),
+		struct codec_job *job)
+{
+	const size_t count = (size_t)job->count * CODEC_STRIPES;
+	if (replay_copy_pool_stripes() > 1 &&
+			replay_copy_pool_run(task, job, count))
+		return;
+	for (size_t i = 0; i < count; i++)
+		task(job, i);
+}
+
+bool replay_frame_is_compressed(const struct obs_source_frame *frame)
+{
+	return frame->data[0] && !frame->linesize[0];
+}
+
+static void replay_frame_copy_info(struct obs_source_frame *dst,
+		const struct obs_source_frame *src)
+{
+	dst->format       = src->format;
+	dst->width        = src->width;
+	dst->height       = src->height;
+	dst->timestamp    = src->timestamp;
+	dst->flip         = src->flip;
+	dst->full_range   = src->full_range;
+	memcpy(dst->color_matrix, src->color_matrix, sizeof(float) * 16);
+	memcpy(dst->color_range_min, src->color_range_min, sizeof(float) * 3);
+	memcpy(dst->color_range_max, src->color_range_max, sizeof(float) * 3);
+}
+
+size_t replay_frame_compressed_size(const struct obs_source_frame *frame)
+{
+	struct codec_header header;
+	memcpy(&header, frame->data[0], sizeof(header));
+
+	size_t size = sizeof(header) + CODEC_PADDING;
+	for (uint32_t i = 0; i < header.planes && i < CODEC_PLANES; i++)
+		for (size_t j = 0; j < CODEC_STRIPES; j++)
+			size += header.size[i][j];
+	return size;
+}
+
+struct obs_source_frame *replay_frame_compress(
+		const struct obs_source_frame *frame, uint32_t near,
+		uint8_t **scratch, size_t *scratch_size, size_t *raw_size,
+		size_t *size)
+{
+	struct codec_job job = {0};
+	job.count = codec_planes(frame->format, frame->width, frame->height,
+			job.planes);
+	*raw_size = 0;
+	*size = 0;
+	if (!job.count || replay_frame_is_compressed(frame))
+		return NULL;
+
+	/* every stripe is written to its own part of scratch first */
+	size_t needed = 0;
+	for (uint32_t i = 0; i < job.count; i++) {
+		/* odd widths of subsampled formats are stored uncompressed */
+		if (job.planes[i].width % job.planes[i].dist)
+			return NULL;
+		const size_t samples = (size_t)job.planes[i].width *
+				job.planes[i].lines;
+		*raw_size += samples;
+		needed += (size_t)job.planes[i].lines *
+				codec_row_bound(job.planes + i) +
+				CODEC_STRIPES * CODEC_PADDING;
+		if (codec_work_size(job.planes + i) > job.work_size)
+			job.work_size = codec_work_size(job.planes + i);
+	}
+	needed += job.work_size * job.count * CODEC_STRIPES;
+	if (*scratch_size < needed) {
+		bfree(*scratch);
+		*scratch = bmalloc(needed);
+		*scratch_size = needed;
+	}
+
+	uint8_t *out = *scratch;
+	for (uint32_t i = 0; i < job.count; i++) {
+		const size_t row_bound = codec_row_bound(job.planes + i);
+		for (size_t j = 0; j < CODEC_STRIPES; j++) {
+			job.data[i][j] = out;
+			out += (size_t)(codec_stripe_first(job.planes + i, j + 1) -
+					codec_stripe_first(job.planes + i, j)) *
+					row_bound + CODEC_PADDING;
+		}
+	}
+	job.work = out;
+	job.src = frame;
+	job.near = near;
+	job.flags = !near && codec_is_rgb(frame->format) ? CODEC_FLAG_RCT : 0;
+	codec_quant_table(job.quant, near);
+	codec_run(codec_encode_stripe, &job);
+
+	struct codec_header header = {0};
+	header.magic = CODEC_MAGIC;
+	header.near = near;
+	header.planes = job.count;
+	header.flags = job.flags;
+	size_t total = sizeof(header);
+	for (uint32_t i = 0; i < job.count; i++) {
+		for (size_t j = 0; j < CODEC_STRIPES; j++) {
+			header.size[i][j] = job.size[i][j];
+			total += job.size[i][j];
+		}
+	}
+	if (total >= *raw_size)
+		return NULL;
+
+	uint8_t *data = bmalloc(total + CODEC_PADDING);
+	memcpy(data, &header, sizeof(header));
+	uint8_t *pos = data + sizeof(header);
+	for (uint32_t i = 0; i < job.count; i++) {
+		for (size_t j = 0; j < CODEC_STRIPES; j++) {
+			memcpy(pos, job.data[i][j], job.size[i][j]);
+			pos += job.size[i][j];
+		}
+	}
+	memset(pos, 0, CODEC_PADDING);
+
+	struct obs_source_frame *compressed = bzalloc(sizeof(struct obs_source_frame));
+	replay_frame_copy_info(compressed, frame);
+	compressed->data[0] = data;
+	compressed->refs = 1;
+	*size = total + CODEC_PADDING;
+	return compressed;
+}
+
+bool replay_frame_decompress(struct obs_source_frame *dst,
+		const struct obs_source_frame *src)
+{
+	struct codec_header header;
+	struct codec_job job = {0};
+
+	memcpy(&header, src->data[0], sizeof(header));
+	job.count = codec_planes(src->format, src->width, src->height,
+			job.planes);
+	if (header.magic != CODEC_MAGIC || header.planes != job.count ||
+			dst->format != src->format || dst->width != src->width ||
+			dst->height != src->height)
+		return false;
+
+	const uint8_t *data = src->data[0] + sizeof(header);
+	for (uint32_t i = 0; i < job.count; i++) {
+		if (job.planes[i].width % job.planes[i].dist)
+			return false;
+		if (codec_work_size(job.planes + i) > job.work_size)
+			job.work_size = codec_work_size(job.planes + i);
+		for (size_t j = 0; j < CODEC_STRIPES; j++) {
+			job.data[i][j] = (uint8_t*)data;
+			job.size[i][j] = header.size[i][j];
+			data += header.size[i][j];
+		}
+	}
+
+	job.work = bmalloc(job.work_size * job.count * CODEC_STRIPES);
+	job.dst = dst;
+	job.near = header.near;
+	job.flags = header.flags;
+	codec_run(codec_decode_stripe, &job);
+	bfree(job.work);
+	if (job.failed)
+		return false;
+
+	replay_frame_copy_info(dst, src);
+	return true;
+}
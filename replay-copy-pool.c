@@ -0,0 +1,150 @@
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include "replay.h"
+
+/* Small pool of threads shared by all filters that copy large frames in
+ * stripes. The threads are started when the first filter enables parallel
+ * copies and stopped when the last one disables it. Only one job runs at a
+ * time, a filter that finds the pool busy copies the frame itself. */
+
+#define REPLAY_COPY_THREADS_MAX 4
+
+struct replay_copy_job {
+	void (*task)(void *param, size_t index);
+	void *param;
+	size_t count;
+	volatile long next;
+	long users;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t run_mutex;
+	pthread_t threads[REPLAY_COPY_THREADS_MAX];
+	size_t thread_count;
+	struct replay_copy_job *job;
+	uint64_t generation;
+	long refs;
+	bool stop;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.run_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void replay_copy_job_work(struct replay_copy_job *job)
+{
+	for (;;) {
+		const size_t index = (size_t)os_atomic_inc_long(&job->next) - 1;
+		if (index >= job->count)
+			break;
+		job->task(job->param, index);
+	}
+}
+
+static void *replay_copy_pool_thread(void *data)
+{
+	uint64_t generation = 0;
+	UNUSED_PARAMETER(data);
+	os_set_thread_name("replay copy");
+
+	pthread_mutex_lock(&pool.mutex);
+	for (;;) {
+		while (!pool.stop && (!pool.job || pool.generation == generation))
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+		if (pool.stop)
+			break;
+
+		struct replay_copy_job *job = pool.job;
+		generation = pool.generation;
+		job->users++;
+		pthread_mutex_unlock(&pool.mutex);
+
+		replay_copy_job_work(job);
+
+		pthread_mutex_lock(&pool.mutex);
+		if (--job->users == 0)
+			pthread_cond_broadcast(&pool.cond);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+	return NULL;
+}
+
+void replay_copy_pool_acquire(void)
+{
+	pthread_mutex_lock(&pool.run_mutex);
+	if (pool.refs++ == 0) {
+		const int cores = os_get_logical_cores();
+		size_t count = cores > 2 ? (size_t)cores / 2 : 1;
+		if (count > REPLAY_COPY_THREADS_MAX)
+			count = REPLAY_COPY_THREADS_MAX;
+
+		pool.stop = false;
+		pool.thread_count = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (pthread_create(&pool.threads[i], NULL,
+					replay_copy_pool_thread, NULL) != 0)
+				break;
+			pool.thread_count++;
+		}
+	}
+	pthread_mutex_unlock(&pool.run_mutex);
+}
+
+void replay_copy_pool_release(void)
+{
+	pthread_mutex_lock(&pool.run_mutex);
+	if (--pool.refs == 0) {
+		pthread_mutex_lock(&pool.mutex);
+		pool.stop = true;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.mutex);
+
+		for (size_t i = 0; i < pool.thread_count; i++)
+			pthread_join(pool.threads[i], NULL);
+		pool.thread_count = 0;
+	}
+	pthread_mutex_unlock(&pool.run_mutex);
+}
+
+/* number of stripes worth splitting a job into, 1 if the pool is not running */
+size_t replay_copy_pool_stripes(void)
+{
+	return pool.thread_count + 1;
+}
+
+/* Runs task for every index below count on the pool threads and the
+ * calling thread and returns when all are done. Returns false without
+ * running anything when the pool is stopped or busy with another job. */
+bool replay_copy_pool_run(void (*task)(void *param, size_t index),
+		void *param, size_t count)
+{
+	struct replay_copy_job job = {task, param, count, 0, 0};
+
+	if (pthread_mutex_trylock(&pool.run_mutex) != 0)
+		return false;
+	if (!pool.thread_count) {
+		pthread_mutex_unlock(&pool.run_mutex);
+		return false;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.job = &job;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	replay_copy_job_work(&job);
+
+	/* a thread that picked the job up late may still be looking at it */
+	pthread_mutex_lock(&pool.mutex);
+	pool.job = NULL;
+	while (job.users)
+		pthread_cond_wait(&pool.cond, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+
+	pthread_mutex_unlock(&pool.run_mutex);
+	return true;
+}
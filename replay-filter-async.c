@@ -17,15 +17,32 @@ static void replay_filter_update(void *data, obs_data_t *settings)
 
 	const uint64_t new_duration = (uint64_t)obs_data_get_int(settings, SETTING_DURATION) * MSEC_TO_NSEC;
 
-	if (new_duration < filter->duration){
-		pthread_mutex_lock(&filter->mutex);
+	if (new_duration < filter->duration)
 		free_video_data(filter);
-		pthread_mutex_unlock(&filter->mutex);
-	}
 	filter->duration = new_duration;
+	obs_get_video_info(&filter->ovi);
+	replay_filter_set_capture(filter, (uint32_t)obs_data_get_int(settings, SETTING_CAPTURE_HEIGHT),
+			(uint32_t)obs_data_get_int(settings, SETTING_CAPTURE_FPS));
+	replay_filter_set_arena_slots(filter, replay_filter_arena_slot_count(filter,
+			obs_data_get_bool(settings, SETTING_PREALLOCATE),
+			(uint32_t)obs_data_get_int(settings, SETTING_REPLAYS)));
 	filter->internal_frames = obs_data_get_bool(settings, SETTING_INTERNAL_FRAMES);
+	filter->zero_copy = obs_data_get_bool(settings, SETTING_ZERO_COPY);
+	const bool parallel_copy = obs_data_get_bool(settings, SETTING_PARALLEL_COPY);
+	if (parallel_copy != filter->parallel_copy) {
+		if (parallel_copy)
+			replay_copy_pool_acquire();
+		else
+			replay_copy_pool_release();
+		filter->parallel_copy = parallel_copy;
+	}
+	replay_filter_set_compress(filter, obs_data_get_bool(settings, SETTING_COMPRESS),
+			(uint32_t)obs_data_get_int(settings, SETTING_COMPRESS_NEAR));
+	replay_filter_set_spill(filter, (uint64_t)obs_data_get_int(settings, SETTING_MEMORY_DURATION) * MSEC_TO_NSEC,
+			obs_data_get_string(settings, SETTING_SCRATCH_DIRECTORY));
 	const double db = obs_data_get_double(settings, SETTING_AUDIO_THRESHOLD);
 	filter->threshold = db_to_mul((float)db);
+	filter->threshold_rms = obs_data_get_int(settings, SETTING_AUDIO_THRESHOLD_TYPE) == THRESHOLD_RMS;
 }
 
 
@@ -35,10 +52,11 @@ static void *replay_filter_create(obs_data_t *settings, obs_source_t *source)
 
 	struct replay_filter *context = bzalloc(sizeof(struct replay_filter));
 	context->src = source;
-	pthread_mutex_init(&context->mutex, NULL);
+	replay_filter_init(context);
 	context->last_check = obs_get_video_frame_time();
 
 	replay_filter_update(context, settings);
+	replay_filter_start(context);
 
 	return context;
 }
@@ -47,13 +65,20 @@ static void replay_filter_destroy(void *data)
 {
 	struct replay_filter *filter = data;
 
-	pthread_mutex_lock(&filter->mutex);
+	replay_filter_stop(filter);
+	if (filter->parallel_copy)
+		replay_copy_pool_release();
 	free_video_data(filter);
 	free_audio_data(filter);
-	pthread_mutex_unlock(&filter->mutex);
-	circlebuf_free(&filter->video_frames);
-	circlebuf_free(&filter->audio_frames);
-	pthread_mutex_destroy(&filter->mutex);
+	replay_ring_free(&filter->video_frames);
+	replay_ring_free(&filter->spilled_frames);
+	replay_ring_free(&filter->worker_queue);
+	replay_audio_free(filter);
+	free_frame_pool(filter);
+	pthread_mutex_destroy(&filter->spill_mutex);
+	pthread_mutex_destroy(&filter->frame_pool_mutex);
+	pthread_mutex_destroy(&filter->audio_mutex);
+	bfree(filter->scale_scratch);
 	bfree(data);
 }
 
@@ -61,10 +86,8 @@ static void replay_filter_destroy(void *data)
 static void replay_filter_remove(void *data, obs_source_t *parent)
 {
 	struct replay_filter *filter = data;
-	pthread_mutex_lock(&filter->mutex);
 	free_video_data(filter);
 	free_audio_data(filter);
-	pthread_mutex_unlock(&filter->mutex);
 }
 
 static inline uint64_t uint64_diff(uint64_t ts1, uint64_t ts2)
@@ -72,97 +95,206 @@ static inline uint64_t uint64_diff(uint64_t ts1, uint64_t ts2)
 	return (ts1 < ts2) ?  (ts2 - ts1) : (ts1 - ts2);
 }
 
-static struct obs_source_frame *replay_filter_video(void *data,
-		struct obs_source_frame *frame)
+static uint64_t replay_filter_adjust_timestamp(struct replay_filter *filter,
+		uint64_t timestamp, uint64_t os_time)
 {
-	struct replay_filter *filter = data;
-	struct obs_source_frame *output;
+	uint64_t adjusted_time = timestamp + filter->timing_adjust;
+	if(filter->timing_adjust && uint64_diff(os_time, timestamp) < MAX_TS_VAR)
+	{
+		adjusted_time = timestamp;
+		filter->timing_adjust = 0;
+	} else if(uint64_diff(os_time, adjusted_time) > MAX_TS_VAR)
+	{
+		filter->timing_adjust = os_time - timestamp;
+		adjusted_time = os_time;
+	}
+	return adjusted_time;
+}
 
-	uint64_t last_timestamp = 0;
+/* true if frames of this size are stored scaled down, to width x height */
+static bool replay_filter_scales(struct replay_filter *filter,
+		const struct obs_source_frame *frame, uint32_t *width,
+		uint32_t *height)
+{
+	replay_filter_capture_size(filter, frame->width, frame->height,
+			width, height);
+	return (*width != frame->width || *height != frame->height) &&
+			replay_frame_can_scale(frame->format);
+}
 
-	obs_source_t* target = filter->internal_frames ? obs_filter_get_parent(filter->src) : NULL;
-	const uint64_t os_time = obs_get_video_frame_time();
-	struct obs_source_frame *new_frame = NULL;
+/* Copies the frame into a frame of the filter, scaled down to the capture
+ * size when one is set. Never called with async_mutex locked. */
+static struct obs_source_frame *replay_filter_copy_frame(
+		struct replay_filter *filter, const struct obs_source_frame *frame)
+{
+	struct obs_source_frame *copy;
+	uint32_t width, height;
 
-	pthread_mutex_lock(&filter->mutex);
-	if(filter->video_frames.size){
-		circlebuf_peek_back(&filter->video_frames, &output,sizeof(struct obs_source_frame*));
-		last_timestamp = output->timestamp;
+	if (replay_filter_scales(filter, frame, &width, &height)) {
+		copy = replay_filter_frame_create(filter, frame->format, width, height);
+		replay_frame_scale(copy, frame, &filter->scale_scratch,
+				&filter->scale_scratch_size);
+	} else {
+		copy = replay_filter_frame_create(filter, frame->format,
+				frame->width, frame->height);
+		copy_frame_data(copy, frame, filter->parallel_copy);
 	}
-	if(target){
-		pthread_mutex_lock(&target->async_mutex);
-		for(size_t i = 0; i< target->async_cache.num;i++){
-			struct obs_source_frame *extra_frame = target->async_cache.array[i].frame;
-			if(extra_frame->timestamp + filter->timing_adjust > last_timestamp)
-			{
-				new_frame = obs_source_frame_create(extra_frame->format, extra_frame->width, extra_frame->height);
-				new_frame->refs = 1;
-				obs_source_frame_copy(new_frame, extra_frame);
-				const uint64_t timestamp = extra_frame->timestamp;
-				uint64_t adjusted_time = timestamp + filter->timing_adjust;
-				if(filter->timing_adjust && uint64_diff(os_time, timestamp) < MAX_TS_VAR)
-				{
-					adjusted_time = timestamp;
-					filter->timing_adjust = 0;
-				} else if(uint64_diff(os_time, adjusted_time) > MAX_TS_VAR)
-				{
-					filter->timing_adjust = os_time - timestamp;
-					adjusted_time = os_time;
-				}
-				new_frame->timestamp = adjusted_time;
-				last_timestamp = adjusted_time;
-				circlebuf_push_back(&filter->video_frames, &new_frame,sizeof(struct obs_source_frame*));
-				
-			}
+	return copy;
+}
+
+/* Must be called with target->async_mutex locked. Takes the frame out of
+ * the async cache of the source, so the source can never recycle it, and
+ * gives the source a pooled frame to fill instead. The reference the cache
+ * held on the frame now belongs to the filter. Frames that are stored
+ * scaled are never taken, scales is decided before locking. */
+static bool replay_filter_take_cached_frame(struct replay_filter *filter,
+		obs_source_t *target, struct obs_source_frame *frame,
+		bool displayed, bool scales)
+{
+	if(target->deinterlace_mode != OBS_DEINTERLACE_MODE_DISABLE || scales)
+		return false;
+
+	for(size_t i = 0; i < target->async_cache.num; i++){
+		struct async_frame *af = &target->async_cache.array[i];
+		if(af->frame != frame)
+			continue;
+		if(af->used != displayed)
+			return false;
+
+		af->frame = replay_filter_pool_frame_create(filter, frame->format,
+				frame->width, frame->height);
+		af->used = false;
+		af->unused_count = 0;
+		return true;
+	}
+	return false;
+}
+
+/* Must be called with target->async_mutex locked. Marks the cached frame
+ * used and references it, so the source does not refill it while it is
+ * copied without the lock. obs_source_release_frame gives it back. */
+static void replay_filter_hold_cached_frame(obs_source_t *target,
+		struct obs_source_frame *frame)
+{
+	for(size_t i = 0; i < target->async_cache.num; i++){
+		struct async_frame *af = &target->async_cache.array[i];
+		if(af->frame != frame)
+			continue;
+		af->used = true;
+		af->unused_count = 0;
+		os_atomic_inc_long(&frame->refs);
+		return;
+	}
+}
+
+/* Captures the frames in the async cache of the source that are newer than
+ * the buffer but older than the displayed frame, the source skipped those.
+ * Frames newer than the displayed frame are still queued and will either
+ * be displayed or show up here later. Only the cache headers are looked at
+ * while async_mutex is held, new frames are taken out of the cache or held
+ * and copied or scaled after it is unlocked. */
+static uint64_t replay_filter_capture_internal(struct replay_filter *filter,
+		obs_source_t *target, struct obs_source_frame *frame,
+		uint64_t last_timestamp, uint64_t os_time)
+{
+	struct obs_source_frame *found[REPLAY_INTERNAL_FRAMES_MAX];
+	bool held[REPLAY_INTERNAL_FRAMES_MAX];
+	size_t count = 0;
+	uint32_t width, height;
+	const bool scales = replay_filter_scales(filter, frame, &width, &height);
+
+	pthread_mutex_lock(&target->async_mutex);
+	for(size_t i = 0; i < target->async_cache.num; i++){
+		struct async_frame *af = &target->async_cache.array[i];
+		struct obs_source_frame *extra_frame = af->frame;
+		if(af->used || extra_frame == frame ||
+				extra_frame->timestamp >= frame->timestamp ||
+				extra_frame->timestamp + filter->timing_adjust <= last_timestamp)
+			continue;
+
+		/* keep found ordered by timestamp, dropping the oldest */
+		size_t pos = count;
+		while(pos && found[pos - 1]->timestamp > extra_frame->timestamp)
+			pos--;
+		if(count == REPLAY_INTERNAL_FRAMES_MAX){
+			if(!pos)
+				continue;
+			memmove(found, found + 1, (pos - 1) * sizeof(found[0]));
+			pos--;
+		}else{
+			memmove(found + pos + 1, found + pos, (count - pos) * sizeof(found[0]));
+			count++;
 		}
-		pthread_mutex_unlock(&target->async_mutex);
+		found[pos] = extra_frame;
 	}
-	if(frame->timestamp + filter->timing_adjust > last_timestamp){
-		new_frame = obs_source_frame_create(frame->format, frame->width, frame->height);
-		new_frame->refs = 1;
-		obs_source_frame_copy(new_frame, frame);
-		const uint64_t timestamp = frame->timestamp;
-		uint64_t adjusted_time = timestamp + filter->timing_adjust;
-		if(filter->timing_adjust && uint64_diff(os_time, timestamp) < MAX_TS_VAR)
-		{
-			adjusted_time = timestamp;
-			filter->timing_adjust = 0;
-		} else if(uint64_diff(os_time, adjusted_time) > MAX_TS_VAR)
-		{
-			filter->timing_adjust = os_time - timestamp;
-			adjusted_time = os_time;
+	for(size_t i = 0; i < count; i++){
+		held[i] = false;
+		if(replay_filter_skip_frame(filter, found[i]->timestamp + filter->timing_adjust))
+			found[i] = NULL;
+		else if(found[i]->format != frame->format || found[i]->width != frame->width ||
+				found[i]->height != frame->height ||
+				!replay_filter_take_cached_frame(filter, target, found[i], false, scales)){
+			replay_filter_hold_cached_frame(target, found[i]);
+			held[i] = true;
 		}
-		new_frame->timestamp = adjusted_time;
-		last_timestamp = adjusted_time;
-		circlebuf_push_back(&filter->video_frames, &new_frame,sizeof(struct obs_source_frame*));
 	}
-	if(!last_timestamp){
-		pthread_mutex_unlock(&filter->mutex);
-		return frame;
+	pthread_mutex_unlock(&target->async_mutex);
+
+	for(size_t i = 0; i < count; i++){
+		if(!found[i])
+			continue;
+		if(held[i]){
+			struct obs_source_frame *cached = found[i];
+			found[i] = replay_filter_copy_frame(filter, cached);
+			obs_source_release_frame(target, cached);
+		}
+		found[i]->timestamp = replay_filter_adjust_timestamp(filter, found[i]->timestamp, os_time);
+		last_timestamp = found[i]->timestamp;
+		replay_filter_push_video(filter, found[i]);
 	}
-	circlebuf_peek_front(&filter->video_frames, &output,
-			sizeof(struct obs_source_frame*));
+	return last_timestamp;
+}
 
-	uint64_t cur_duration = last_timestamp - output->timestamp;
-	while (cur_duration > 0 && cur_duration > filter->duration){
+static struct obs_source_frame *replay_filter_video(void *data,
+		struct obs_source_frame *frame)
+{
+	struct replay_filter *filter = data;
 
-		circlebuf_pop_front(&filter->video_frames, NULL,
-			sizeof(struct obs_source_frame*));
+	uint64_t last_timestamp = filter->capture_timestamp;
 
-		if (os_atomic_dec_long(&output->refs) <= 0) {
-			obs_source_frame_destroy(output);
-			output = NULL;
-		}
-		if(filter->video_frames.size){
-			circlebuf_peek_front(&filter->video_frames, &output, sizeof(struct obs_source_frame*));
-			cur_duration = last_timestamp - output->timestamp;
+	const bool zero_copy = filter->zero_copy;
+	obs_source_t* target = filter->internal_frames || zero_copy ? obs_filter_get_parent(filter->src) : NULL;
+	const uint64_t os_time = obs_get_video_frame_time();
+	struct obs_source_frame *new_frame;
+
+	if(target && filter->internal_frames)
+		last_timestamp = replay_filter_capture_internal(filter, target, frame, last_timestamp, os_time);
+	if(frame->timestamp + filter->timing_adjust > last_timestamp){
+		const uint64_t timestamp = frame->timestamp;
+		const uint64_t adjusted_time = replay_filter_adjust_timestamp(filter, timestamp, os_time);
+		const bool skip = replay_filter_skip_frame(filter, adjusted_time);
+		new_frame = NULL;
+		uint32_t width, height;
+		if(!skip && target && zero_copy && adjusted_time == timestamp &&
+				!replay_filter_scales(filter, frame, &width, &height))
+		{
+			pthread_mutex_lock(&target->async_mutex);
+			if(replay_filter_take_cached_frame(filter, target, frame, true, false))
+				new_frame = frame;
+			pthread_mutex_unlock(&target->async_mutex);
 		}
-		else
+		if(!skip && !new_frame)
 		{
-			cur_duration = 0;
+			new_frame = replay_filter_copy_frame(filter, frame);
+			new_frame->timestamp = adjusted_time;
 		}
+		last_timestamp = adjusted_time;
+		if(new_frame)
+			replay_filter_push_video(filter, new_frame);
 	}
-	pthread_mutex_unlock(&filter->mutex);
+	filter->capture_timestamp = last_timestamp;
+	if(!last_timestamp)
+		return frame;
 	replay_filter_check(filter);
 	return frame;
 }
@@ -175,7 +307,20 @@ static obs_properties_t *replay_filter_properties(void *unused)
 	
 	obs_properties_add_int(props, SETTING_DURATION, TEXT_DURATION, SETTING_DURATION_MIN, SETTING_DURATION_MAX, 1000);
 	obs_properties_add_bool(props, SETTING_INTERNAL_FRAMES, "internal frames");
+	obs_properties_add_bool(props, SETTING_ZERO_COPY, TEXT_ZERO_COPY);
+	obs_properties_add_bool(props, SETTING_PARALLEL_COPY, TEXT_PARALLEL_COPY);
+	obs_properties_add_int(props, SETTING_CAPTURE_HEIGHT, TEXT_CAPTURE_HEIGHT, 0, 4320, 1);
+	obs_properties_add_int(props, SETTING_CAPTURE_FPS, TEXT_CAPTURE_FPS, 0, 240, 1);
+	obs_properties_add_bool(props, SETTING_PREALLOCATE, TEXT_PREALLOCATE);
+	obs_properties_add_bool(props, SETTING_COMPRESS, TEXT_COMPRESS);
+	obs_properties_add_int_slider(props, SETTING_COMPRESS_NEAR, TEXT_COMPRESS_NEAR, SETTING_COMPRESS_NEAR_MIN, SETTING_COMPRESS_NEAR_MAX, 1);
+	obs_properties_add_int(props, SETTING_MEMORY_DURATION, TEXT_MEMORY_DURATION, 0, SETTING_DURATION_MAX, 1000);
+	obs_properties_add_path(props, SETTING_SCRATCH_DIRECTORY, TEXT_SCRATCH_DIRECTORY, OBS_PATH_DIRECTORY, NULL, NULL);
 	obs_properties_add_float_slider(props, SETTING_AUDIO_THRESHOLD,"Threshold db", SETTING_AUDIO_THRESHOLD_MIN, SETTING_AUDIO_THRESHOLD_MAX,0.1);
+	obs_property_t *prop = obs_properties_add_list(props, SETTING_AUDIO_THRESHOLD_TYPE, TEXT_AUDIO_THRESHOLD_TYPE,
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "Peak", THRESHOLD_PEAK);
+	obs_property_list_add_int(prop, "RMS", THRESHOLD_RMS);
 
 	return props;
 }
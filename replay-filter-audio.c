@@ -28,6 +28,7 @@ static void replay_filter_update(void *data, obs_data_t *settings)
 	filter->duration = new_duration;
 	const double db = obs_data_get_double(settings, SETTING_AUDIO_THRESHOLD);
 	filter->threshold = db_to_mul((float)db);
+	filter->threshold_rms = obs_data_get_int(settings, SETTING_AUDIO_THRESHOLD_TYPE) == THRESHOLD_RMS;
 	
 }
 
@@ -38,7 +39,7 @@ static void *replay_filter_create(obs_data_t *settings, obs_source_t *source)
 
 	struct replay_filter *context = bzalloc(sizeof(struct replay_filter));
 	context->src = source;
-	pthread_mutex_init(&context->mutex, NULL);
+	replay_filter_init(context);
 	context->last_check = obs_get_video_frame_time();
 
 	replay_filter_update(context, settings);
@@ -50,13 +51,16 @@ static void replay_filter_destroy(void *data)
 {
 	struct replay_filter *filter = data;
 
-	pthread_mutex_lock(&filter->mutex);
 	free_video_data(filter);
 	free_audio_data(filter);
-	pthread_mutex_unlock(&filter->mutex);
-	circlebuf_free(&filter->video_frames);
-	circlebuf_free(&filter->audio_frames);
-	pthread_mutex_destroy(&filter->mutex);
+	replay_ring_free(&filter->video_frames);
+	replay_ring_free(&filter->spilled_frames);
+	replay_ring_free(&filter->worker_queue);
+	replay_audio_free(filter);
+	free_frame_pool(filter);
+	pthread_mutex_destroy(&filter->spill_mutex);
+	pthread_mutex_destroy(&filter->frame_pool_mutex);
+	pthread_mutex_destroy(&filter->audio_mutex);
 	
 	bfree(data);
 }
@@ -77,6 +81,10 @@ obs_properties_t *replay_filter_properties(void *unused)
 	
 	obs_properties_add_int(props, SETTING_DURATION, TEXT_DURATION, SETTING_DURATION_MIN, SETTING_DURATION_MAX, 1000);
 	obs_properties_add_float_slider(props, SETTING_AUDIO_THRESHOLD,"Threshold db",SETTING_AUDIO_THRESHOLD_MIN, SETTING_AUDIO_THRESHOLD_MAX,0.1);
+	obs_property_t *prop = obs_properties_add_list(props, SETTING_AUDIO_THRESHOLD_TYPE, TEXT_AUDIO_THRESHOLD_TYPE,
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "Peak", THRESHOLD_PEAK);
+	obs_property_list_add_int(prop, "RMS", THRESHOLD_RMS);
 
 	return props;
 }
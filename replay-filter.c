@@ -3,6 +3,7 @@
 #include <util/threading.h>
 #include <media-io/video-io.h>
 #include <media-io/video-frame.h>
+#include <media-io/audio-math.h>
 #include <media-io/audio-resampler.h>
 #include <util/circlebuf.h>
 #include "replay.h"
@@ -18,68 +19,6 @@ static const char *replay_filter_get_name(void *unused)
 	return TEXT_FILTER_NAME;
 }
 
-static inline void copy_frame_data_line(struct obs_source_frame *dst,
-		const struct video_data*src, uint32_t plane, uint32_t y)
-{
-	const uint32_t pos_src = y * src->linesize[plane];
-	const uint32_t pos_dst = y * dst->linesize[plane];
-	const uint32_t bytes = dst->linesize[plane] < src->linesize[plane] ?
-		dst->linesize[plane] : src->linesize[plane];
-
-	memcpy(dst->data[plane] + pos_dst, src->data[plane] + pos_src, bytes);
-}
-
-void replay_filter_raw_video(void* data, struct video_data* frame)
-{
-	struct replay_filter *filter = data;
-
-	if (!frame || !frame->data[0])
-		return;
-
-	struct obs_source_frame *output;
-
-	struct obs_source_frame *new_frame = obs_source_frame_create(VIDEO_FORMAT_BGRA, filter->known_width, filter->known_height);
-	new_frame->refs = 1;
-	new_frame->timestamp = frame->timestamp;
-
-	if (new_frame->linesize[0] != frame->linesize[0])
-		for (uint32_t y = 0; y < filter->known_height; y++)
-			copy_frame_data_line(new_frame, frame, 0, y);
-	else
-		memcpy(new_frame->data[0], frame->data[0],
-				new_frame->linesize[0] * filter->known_height);
-
-	pthread_mutex_lock(&filter->mutex);
-
-	circlebuf_push_back(&filter->video_frames, &new_frame,
-			sizeof(struct obs_source_frame*));
-
-	
-	circlebuf_peek_front(&filter->video_frames, &output,
-			sizeof(struct obs_source_frame*));
-
-	uint64_t cur_duration = frame->timestamp - output->timestamp;
-	while (cur_duration > 0 && cur_duration > filter->duration){
-
-		circlebuf_pop_front(&filter->video_frames, NULL,
-			sizeof(struct obs_source_frame*));
-
-		if (os_atomic_dec_long(&output->refs) <= 0) {
-			obs_source_frame_destroy(output);
-			output = NULL;
-		}
-		if(filter->video_frames.size){
-			circlebuf_peek_front(&filter->video_frames, &output, sizeof(struct obs_source_frame*));
-			cur_duration = frame->timestamp - output->timestamp;
-		}
-		else
-		{
-			cur_duration = 0;
-		}
-	}
-	pthread_mutex_unlock(&filter->mutex);
-}
-
 void replay_filter_offscreen_render(void* data, uint32_t cx, uint32_t cy)
 {
 	struct replay_filter *filter = data;
@@ -89,8 +28,22 @@ void replay_filter_offscreen_render(void* data, uint32_t cx, uint32_t cy)
 		return;
 	}
 
-	const uint32_t width = obs_source_get_base_width(target);
-	const uint32_t height = obs_source_get_base_height(target);
+	const uint32_t source_width = obs_source_get_base_width(target);
+	const uint32_t source_height = obs_source_get_base_height(target);
+	if (!source_width || !source_height ||
+		replay_filter_skip_frame(filter, obs_get_video_frame_time()))
+		return;
+
+	/* the gpu scales to the capture size while rendering */
+	uint32_t width, height;
+	replay_filter_capture_size(filter, source_width, source_height,
+			&width, &height);
+	/* chroma is subsampled 2x2, an odd size would leave its last column
+	 * and row unconverted */
+	if (filter->capture_format != VIDEO_FORMAT_BGRA) {
+		width = (width + 1) & ~1u;
+		height = (height + 1) & ~1u;
+	}
 
 	gs_texrender_reset(filter->texrender);
 
@@ -99,7 +52,7 @@ void replay_filter_offscreen_render(void* data, uint32_t cx, uint32_t cy)
 		vec4_zero(&background);
 
 		gs_clear(GS_CLEAR_COLOR, &background, 0.0f, 0);
-		gs_ortho(0.0f, (float)width, 0.0f, (float)height, -100.0f, 100.0f);
+		gs_ortho(0.0f, (float)source_width, 0.0f, (float)source_height, -100.0f, 100.0f);
 
 		gs_blend_state_push();
 		gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
@@ -111,53 +64,53 @@ void replay_filter_offscreen_render(void* data, uint32_t cx, uint32_t cy)
 
 		if (filter->known_width != width || filter->known_height != height) {
 
-			gs_stagesurface_destroy(filter->stagesurface);
-			filter->stagesurface =
-				gs_stagesurface_create(width, height, TEXFORMAT);
-
-			struct video_output_info vi = {0};
-			vi.format = VIDEO_FORMAT_BGRA;
-			vi.width = width;
-			vi.height = height;
-			vi.fps_den = filter->ovi.fps_den;
-			vi.fps_num = filter->ovi.fps_num;
-			vi.cache_size = 16;
-			vi.colorspace = VIDEO_CS_DEFAULT;
-			vi.range = VIDEO_RANGE_DEFAULT;
-			vi.name = obs_source_get_name(filter->src);
-
-			video_output_close(filter->video_output);
-			video_output_open(&filter->video_output, &vi);
-			video_output_connect(filter->video_output, NULL, replay_filter_raw_video, filter);
+			for (size_t i = 0; i < REPLAY_STAGE_SURFACES; i++) {
+				gs_stagesurface_destroy(filter->stagesurfaces[i]);
+				filter->stagesurfaces[i] =
+					gs_stagesurface_create(width, height, TEXFORMAT);
+				filter->stage_timestamps[i] = 0;
+			}
 
 			filter->known_width = width;
 			filter->known_height = height;
 		}
 
-		struct video_frame output_frame;
-		if (filter->video_output && video_output_lock_frame(filter->video_output,
-			&output_frame, 1, obs_get_video_frame_time()))
-		{
-			if (filter->video_data) {
-				gs_stagesurface_unmap(filter->stagesurface);
-				filter->video_data = NULL;
-			}
-
-			gs_stage_texture(filter->stagesurface,
-							 gs_texrender_get_texture(filter->texrender));
-			gs_stagesurface_map(filter->stagesurface,
-								&filter->video_data, &filter->video_linesize);
-
-			const uint32_t linesize = output_frame.linesize[0];
-			for (uint32_t i = 0; i < filter->known_height; ++i) {
-				const uint32_t dst_offset = linesize * i;
-				const uint32_t src_offset = filter->video_linesize * i;
-				memcpy(output_frame.data[0] + dst_offset,
-					filter->video_data + src_offset,
-					linesize);
-			}
-
-			video_output_unlock_frame(filter->video_output);
+		/* Stage this frame and map the one staged REPLAY_STAGE_SURFACES - 1
+		 * frames ago, the gpu has finished that copy by now so the map does
+		 * not stall the render thread. The frame keeps the time it was
+		 * rendered at. */
+		const size_t stage = filter->stage_index;
+		const size_t read = (stage + 1) % REPLAY_STAGE_SURFACES;
+		filter->stage_index = read;
+
+		gs_stage_texture(filter->stagesurfaces[stage],
+						 gs_texrender_get_texture(filter->texrender));
+		filter->stage_timestamps[stage] = obs_get_video_frame_time();
+
+		const uint64_t timestamp = filter->stage_timestamps[read];
+		filter->stage_timestamps[read] = 0;
+
+		/* copy the mapped data straight into a frame of the filter */
+		uint8_t *video_data;
+		uint32_t video_linesize;
+		if (timestamp && gs_stagesurface_map(filter->stagesurfaces[read],
+				&video_data, &video_linesize)) {
+			const enum video_format format = filter->capture_format;
+			struct obs_source_frame *new_frame = replay_filter_frame_create(
+					filter, format,
+					filter->known_width, filter->known_height);
+			if (format == VIDEO_FORMAT_BGRA)
+				replay_copy_plane(new_frame->data[0],
+						new_frame->linesize[0], video_data,
+						video_linesize, filter->known_height);
+			else
+				replay_convert_bgra(new_frame, video_data,
+						video_linesize, filter->ovi.colorspace,
+						filter->ovi.range);
+			gs_stagesurface_unmap(filter->stagesurfaces[read]);
+
+			new_frame->timestamp = timestamp;
+			replay_filter_push_video(filter, new_frame);
 		}
 	}
 }
@@ -170,13 +123,25 @@ static void replay_filter_update(void *data, obs_data_t *settings)
 	
 	uint64_t new_duration = (uint64_t)obs_data_get_int(settings, SETTING_DURATION) * MSEC_TO_NSEC;
 
-	if (new_duration < filter->duration){
-		pthread_mutex_lock(&filter->mutex);
+	if (new_duration < filter->duration)
 		free_video_data(filter);
-		pthread_mutex_unlock(&filter->mutex);
-	}
 
 	filter->duration = new_duration;
+	replay_filter_set_capture(filter, (uint32_t)obs_data_get_int(settings, SETTING_CAPTURE_HEIGHT),
+			(uint32_t)obs_data_get_int(settings, SETTING_CAPTURE_FPS));
+	const enum video_format capture_format = (enum video_format)obs_data_get_int(settings, SETTING_CAPTURE_FORMAT);
+	filter->capture_format = capture_format == VIDEO_FORMAT_NV12 || capture_format == VIDEO_FORMAT_I420 ?
+			capture_format : VIDEO_FORMAT_BGRA;
+	replay_filter_set_arena_slots(filter, replay_filter_arena_slot_count(filter,
+			obs_data_get_bool(settings, SETTING_PREALLOCATE),
+			(uint32_t)obs_data_get_int(settings, SETTING_REPLAYS)));
+	replay_filter_set_compress(filter, obs_data_get_bool(settings, SETTING_COMPRESS),
+			(uint32_t)obs_data_get_int(settings, SETTING_COMPRESS_NEAR));
+	replay_filter_set_spill(filter, (uint64_t)obs_data_get_int(settings, SETTING_MEMORY_DURATION) * MSEC_TO_NSEC,
+			obs_data_get_string(settings, SETTING_SCRATCH_DIRECTORY));
+	const double db = obs_data_get_double(settings, SETTING_AUDIO_THRESHOLD);
+	filter->threshold = db_to_mul((float)db);
+	filter->threshold_rms = obs_data_get_int(settings, SETTING_AUDIO_THRESHOLD_TYPE) == THRESHOLD_RMS;
 
 	obs_add_main_render_callback(replay_filter_offscreen_render, filter);
 
@@ -204,16 +169,17 @@ static void *replay_filter_create(obs_data_t *settings, obs_source_t *source)
 
 	struct replay_filter *context = bzalloc(sizeof(struct replay_filter));
 	context->src = source;
-	pthread_mutex_init(&context->mutex, NULL);
+	replay_filter_init(context);
 
+	obs_enter_graphics();
 	context->texrender = gs_texrender_create(TEXFORMAT, GS_ZS_NONE);
-	context->video_data = NULL;
+	obs_leave_graphics();
 	obs_get_video_info(&context->ovi);
-	obs_get_audio_info(&context->oai);
 	context->last_check = obs_get_video_frame_time();
 
 
 	replay_filter_update(context, settings);
+	replay_filter_start(context);
 
 	return context;
 }
@@ -223,20 +189,24 @@ static void replay_filter_destroy(void *data)
 	struct replay_filter *filter = data;
 
 	obs_remove_main_render_callback(replay_filter_offscreen_render, filter);
-	pthread_mutex_lock(&filter->mutex);
-	video_output_close(filter->video_output);
-	filter->video_output = NULL;
+	replay_filter_stop(filter);
 
-	gs_stagesurface_unmap(filter->stagesurface);
-	gs_stagesurface_destroy(filter->stagesurface);
+	obs_enter_graphics();
+	for (size_t i = 0; i < REPLAY_STAGE_SURFACES; i++)
+		gs_stagesurface_destroy(filter->stagesurfaces[i]);
 	gs_texrender_destroy(filter->texrender);
+	obs_leave_graphics();
 
 	free_video_data(filter);
-	free_video_data(filter);
-	pthread_mutex_unlock(&filter->mutex);
-	circlebuf_free(&filter->video_frames);
-	circlebuf_free(&filter->audio_frames);
-	pthread_mutex_destroy(&filter->mutex);
+	free_audio_data(filter);
+	replay_ring_free(&filter->video_frames);
+	replay_ring_free(&filter->spilled_frames);
+	replay_ring_free(&filter->worker_queue);
+	replay_audio_free(filter);
+	free_frame_pool(filter);
+	pthread_mutex_destroy(&filter->spill_mutex);
+	pthread_mutex_destroy(&filter->frame_pool_mutex);
+	pthread_mutex_destroy(&filter->audio_mutex);
 	bfree(data);
 }
 
@@ -247,6 +217,18 @@ static obs_properties_t *replay_filter_properties(void *unused)
 	obs_properties_t *props = obs_properties_create();
 	
 	obs_properties_add_int(props, SETTING_DURATION, TEXT_DURATION, SETTING_DURATION_MIN, SETTING_DURATION_MAX, 1000);
+	obs_properties_add_bool(props, SETTING_PREALLOCATE, TEXT_PREALLOCATE);
+	obs_property_t *prop = obs_properties_add_list(props, SETTING_CAPTURE_FORMAT, TEXT_CAPTURE_FORMAT,
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "BGRA", VIDEO_FORMAT_BGRA);
+	obs_property_list_add_int(prop, "NV12", VIDEO_FORMAT_NV12);
+	obs_property_list_add_int(prop, "I420", VIDEO_FORMAT_I420);
+	obs_properties_add_int(props, SETTING_CAPTURE_HEIGHT, TEXT_CAPTURE_HEIGHT, 0, 4320, 1);
+	obs_properties_add_int(props, SETTING_CAPTURE_FPS, TEXT_CAPTURE_FPS, 0, 240, 1);
+	obs_properties_add_bool(props, SETTING_COMPRESS, TEXT_COMPRESS);
+	obs_properties_add_int_slider(props, SETTING_COMPRESS_NEAR, TEXT_COMPRESS_NEAR, SETTING_COMPRESS_NEAR_MIN, SETTING_COMPRESS_NEAR_MAX, 1);
+	obs_properties_add_int(props, SETTING_MEMORY_DURATION, TEXT_MEMORY_DURATION, 0, SETTING_DURATION_MAX, 1000);
+	obs_properties_add_path(props, SETTING_SCRATCH_DIRECTORY, TEXT_SCRATCH_DIRECTORY, OBS_PATH_DIRECTORY, NULL, NULL);
 
 	return props;
 }
@@ -256,10 +238,8 @@ static void replay_filter_remove(void *data, obs_source_t *parent)
 	struct replay_filter *filter = data;
 
 	obs_remove_main_render_callback(replay_filter_offscreen_render, filter);
-	pthread_mutex_lock(&filter->mutex);
 	free_video_data(filter);
 	free_audio_data(filter);
-	pthread_mutex_unlock(&filter->mutex);
 }
 
 void replay_filter_tick(void* data, float seconds)
@@ -0,0 +1,172 @@
+#include <obs-module.h>
+#include <util/threading.h>
+#include "replay.h"
+
+/* Ring with a single producer and any number of consumers. head and tail
+ * count elements since the start and only ever increase, the element at
+ * index i lives at i & mask of the current buffer. Consumers claim the front
+ * element by moving head forward with a compare and swap, a consumer that
+ * read an element which was overwritten in the meantime always loses that
+ * race because the producer only reuses a slot after head moved past it.
+ *
+ * When the ring is full the producer copies the elements to a buffer twice
+ * the size and publishes it before it publishes any new element, a consumer
+ * that still reads from the old buffer only reads elements that were copied.
+ * Old buffers are kept until the ring is freed. */
+
+#define REPLAY_RING_MIN_CAPACITY 64
+
+static inline uint8_t *ring_slot(struct replay_ring *ring,
+		const struct replay_ring_buffer *buffer, unsigned long index)
+{
+	return buffer->data + (size_t)(index & buffer->mask) * ring->element_size;
+}
+
+void replay_ring_init(struct replay_ring *ring, size_t element_size)
+{
+	memset(ring, 0, sizeof(struct replay_ring));
+	ring->element_size = element_size;
+	ring->buffers[0].data = bmalloc(REPLAY_RING_MIN_CAPACITY * element_size);
+	ring->buffers[0].mask = REPLAY_RING_MIN_CAPACITY - 1;
+}
+
+void replay_ring_free(struct replay_ring *ring)
+{
+	for (size_t i = 0; i < REPLAY_RING_BUFFERS; i++)
+		bfree(ring->buffers[i].data);
+	memset(ring, 0, sizeof(struct replay_ring));
+}
+
+size_t replay_ring_count(struct replay_ring *ring)
+{
+	const unsigned long head = (unsigned long)os_atomic_load_long(&ring->head);
+	const unsigned long tail = (unsigned long)os_atomic_load_long(&ring->tail);
+	return (size_t)(tail - head);
+}
+
+static bool replay_ring_grow(struct replay_ring *ring, unsigned long head,
+		unsigned long tail)
+{
+	const long current = os_atomic_load_long(&ring->buffer);
+	if (current + 1 >= REPLAY_RING_BUFFERS)
+		return false;
+
+	struct replay_ring_buffer *old = &ring->buffers[current];
+	struct replay_ring_buffer *buffer = &ring->buffers[current + 1];
+	buffer->mask = old->mask * 2 + 1;
+	buffer->data = bmalloc((size_t)(buffer->mask + 1) * ring->element_size);
+	for (unsigned long i = head; i != tail; i++)
+		memcpy(ring_slot(ring, buffer, i), ring_slot(ring, old, i),
+				ring->element_size);
+
+	os_atomic_set_long(&ring->buffer, current + 1);
+	return true;
+}
+
+bool replay_ring_push(struct replay_ring *ring, const void *element)
+{
+	const unsigned long tail = (unsigned long)ring->tail;
+	const unsigned long head = (unsigned long)os_atomic_load_long(&ring->head);
+
+	if (tail - head > ring->buffers[ring->buffer].mask &&
+			!replay_ring_grow(ring, head, tail))
+		return false;
+
+	memcpy(ring_slot(ring, &ring->buffers[ring->buffer], tail), element,
+			ring->element_size);
+	os_atomic_set_long(&ring->tail, (long)(tail + 1));
+	return true;
+}
+
+bool replay_ring_peek_front(struct replay_ring *ring, void *element,
+		unsigned long *index)
+{
+	for (;;) {
+		const unsigned long head = (unsigned long)os_atomic_load_long(&ring->head);
+		const unsigned long tail = (unsigned long)os_atomic_load_long(&ring->tail);
+		if (head == tail)
+			return false;
+
+		const long buffer = os_atomic_load_long(&ring->buffer);
+		memcpy(element, ring_slot(ring, &ring->buffers[buffer], head),
+				ring->element_size);
+		if ((unsigned long)os_atomic_load_long(&ring->head) == head) {
+			*index = head;
+			return true;
+		}
+	}
+}
+
+/* element at an absolute index, false once it was taken or not pushed yet */
+bool replay_ring_peek(struct replay_ring *ring, unsigned long index,
+		void *element)
+{
+	const unsigned long head = (unsigned long)os_atomic_load_long(&ring->head);
+	const unsigned long tail = (unsigned long)os_atomic_load_long(&ring->tail);
+	if (index - head >= tail - head)
+		return false;
+
+	const long buffer = os_atomic_load_long(&ring->buffer);
+	memcpy(element, ring_slot(ring, &ring->buffers[buffer], index),
+			ring->element_size);
+	return index - (unsigned long)os_atomic_load_long(&ring->head) <
+			tail - head;
+}
+
+/* Index of the first element whose uint64_t at key_offset is not below
+ * key, or the tail when there is none. The elements must be sorted by that
+ * key and the caller must keep other consumers from taking elements. */
+unsigned long replay_ring_lower_bound(struct replay_ring *ring,
+		size_t key_offset, uint64_t key)
+{
+	unsigned long low = (unsigned long)os_atomic_load_long(&ring->head);
+	unsigned long high = (unsigned long)os_atomic_load_long(&ring->tail);
+	const long buffer = os_atomic_load_long(&ring->buffer);
+
+	while (low != high) {
+		const unsigned long middle = low + (high - low) / 2;
+		uint64_t value;
+		memcpy(&value, ring_slot(ring, &ring->buffers[buffer], middle) +
+				key_offset, sizeof(uint64_t));
+		if (value < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+bool replay_ring_peek_back(struct replay_ring *ring, void *element)
+{
+	const unsigned long tail = (unsigned long)ring->tail;
+	if ((unsigned long)os_atomic_load_long(&ring->head) == tail)
+		return false;
+
+	memcpy(element, ring_slot(ring, &ring->buffers[ring->buffer], tail - 1),
+			ring->element_size);
+	return true;
+}
+
+bool replay_ring_take(struct replay_ring *ring, unsigned long index)
+{
+	return os_atomic_compare_swap_long(&ring->head, (long)index,
+			(long)(index + 1));
+}
+
+/* takes count elements starting at the front element index */
+bool replay_ring_take_range(struct replay_ring *ring, unsigned long index,
+		size_t count)
+{
+	return os_atomic_compare_swap_long(&ring->head, (long)index,
+			(long)(index + count));
+}
+
+bool replay_ring_pop(struct replay_ring *ring, void *element)
+{
+	unsigned long index;
+
+	while (replay_ring_peek_front(ring, element, &index))
+		if (replay_ring_take(ring, index))
+			return true;
+	return false;
+}
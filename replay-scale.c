@@ -0,0 +1,132 @@
+#include <obs-module.h>
+#include "replay.h"
+
+/* Bilinear downscaler for the capture resolution of the async filter. Every
+ * output line is interpolated from two source lines with the vector kernel
+ * first and then horizontally, so only the source lines that are needed are
+ * read. */
+
+struct scale_plane {
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+};
+
+static uint32_t scale_planes(enum video_format format, uint32_t width,
+		uint32_t height, struct scale_plane *planes)
+{
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+		planes[0] = (struct scale_plane){width, height, 1};
+		planes[1] = (struct scale_plane){width / 2, height / 2, 1};
+		planes[2] = (struct scale_plane){width / 2, height / 2, 1};
+		return 3;
+
+	case VIDEO_FORMAT_NV12:
+		planes[0] = (struct scale_plane){width, height, 1};
+		planes[1] = (struct scale_plane){width / 2, height / 2, 2};
+		return 2;
+
+	case VIDEO_FORMAT_I444:
+		planes[0] = (struct scale_plane){width, height, 1};
+		planes[1] = (struct scale_plane){width, height, 1};
+		planes[2] = (struct scale_plane){width, height, 1};
+		return 3;
+
+	case VIDEO_FORMAT_Y800:
+		planes[0] = (struct scale_plane){width, height, 1};
+		return 1;
+
+	case VIDEO_FORMAT_RGBA:
+	case VIDEO_FORMAT_BGRA:
+	case VIDEO_FORMAT_BGRX:
+		planes[0] = (struct scale_plane){width, height, 4};
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+bool replay_frame_can_scale(enum video_format format)
+{
+	struct scale_plane planes[MAX_AV_PLANES];
+	return scale_planes(format, 2, 2, planes) != 0;
+}
+
+/* source position of the center of output pixel i in 16.16 fixed point */
+static inline int64_t scale_position(uint32_t i, uint32_t src, uint32_t dst)
+{
+	return (((int64_t)i * 2 + 1) * src * 65536) / ((int64_t)dst * 2) - 32768;
+}
+
+static void scale_plane(uint8_t *dst, uint32_t dst_linesize,
+		const struct scale_plane *d, const uint8_t *src,
+		uint32_t src_linesize, const struct scale_plane *s, uint8_t *row)
+{
+	const uint32_t channels = s->channels;
+
+	for (uint32_t y = 0; y < d->height; y++) {
+		int64_t pos = scale_position(y, s->height, d->height);
+		if (pos < 0)
+			pos = 0;
+		uint32_t y0 = (uint32_t)(pos >> 16);
+		uint32_t weight = (uint32_t)(pos & 0xFFFF) >> 9;
+		if (y0 >= s->height - 1) {
+			y0 = s->height - 1;
+			weight = 0;
+		}
+		const uint8_t *line = src + (size_t)y0 * src_linesize;
+		if (weight) {
+			replay_lerp_row(row, line, line + src_linesize,
+					(size_t)s->width * channels, weight);
+			line = row;
+		}
+
+		uint8_t *out = dst + (size_t)y * dst_linesize;
+		for (uint32_t x = 0; x < d->width; x++) {
+			int64_t xpos = scale_position(x, s->width, d->width);
+			if (xpos < 0)
+				xpos = 0;
+			const uint32_t x0 = (uint32_t)(xpos >> 16);
+			const int w = (int)((uint32_t)(xpos & 0xFFFF) >> 9);
+			const uint8_t *a = line + (size_t)x0 * channels;
+			const uint8_t *b = x0 + 1 < s->width ? a + channels : a;
+			for (uint32_t c = 0; c < channels; c++)
+				*(out++) = (uint8_t)(a[c] + (((b[c] - a[c]) * w + 64) >> 7));
+		}
+	}
+}
+
+/* Scales src into dst, which has the same format and the capture size. The
+ * scratch line is kept by the caller between frames. */
+void replay_frame_scale(struct obs_source_frame *dst,
+		const struct obs_source_frame *src, uint8_t **scratch,
+		size_t *scratch_size)
+{
+	struct scale_plane s[MAX_AV_PLANES];
+	struct scale_plane d[MAX_AV_PLANES];
+	const uint32_t count = scale_planes(src->format, src->width,
+			src->height, s);
+	scale_planes(dst->format, dst->width, dst->height, d);
+
+	const size_t needed = (size_t)src->width * 4;
+	if (*scratch_size < needed) {
+		bfree(*scratch);
+		*scratch = bmalloc(needed);
+		*scratch_size = needed;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		if (s[i].width && s[i].height && d[i].width && d[i].height)
+			scale_plane(dst->data[i], dst->linesize[i], d + i,
+					src->data[i], src->linesize[i], s + i,
+					*scratch);
+
+	dst->timestamp    = src->timestamp;
+	dst->flip         = src->flip;
+	dst->full_range   = src->full_range;
+	memcpy(dst->color_matrix, src->color_matrix, sizeof(float) * 16);
+	memcpy(dst->color_range_min, src->color_range_min, sizeof(float) * 3);
+	memcpy(dst->color_range_max, src->color_range_max, sizeof(float) * 3);
+}
@@ -0,0 +1,1167 @@
+#include <obs-module.h>
+#include <media-io/video-io.h>
+#include <math.h>
+#include "replay.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define REPLAY_SIMD_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define REPLAY_TARGET_AVX2
+#else
+#define REPLAY_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define REPLAY_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* Kernels for copying captured frames into the replay buffer. A buffered
+ * frame is not read again until a replay is retrieved, so large planes are
+ * written with non temporal stores on x86 which keeps them out of the cache
+ * and saves reading the destination lines in first. The non async filter
+ * can also store its BGRA frames as NV12 or I420. The kernels are picked
+ * once in replay_simd_init from what the cpu supports. */
+
+#define REPLAY_STREAM_MIN (256 * 1024)
+
+/* samples per channel between the early exit checks of the sound trigger */
+#define REPLAY_LEVEL_BLOCK 256
+
+static void expand_y800_c(uint32_t *dst, const uint8_t *src, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		uint32_t val = src[i];
+		val |= (val << 8);
+		val |= (val << 16);
+		dst[i] = val;
+	}
+}
+
+static void copy_line_c(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+	memcpy(dst, src, bytes);
+}
+
+/* BGRA to YUV in 1.15 fixed point, coefficients in b, g, r order */
+struct yuv_coefs {
+	int16_t y[8];
+	int16_t u[8];
+	int16_t v[8];
+	int32_t y_offset;
+};
+
+static void yuv_coefs_init(struct yuv_coefs *c, enum video_colorspace colorspace,
+		enum video_range_type range)
+{
+	const bool full = range == VIDEO_RANGE_FULL;
+	const double kr = colorspace == VIDEO_CS_709 ? 0.2126 : 0.299;
+	const double kb = colorspace == VIDEO_CS_709 ? 0.0722 : 0.114;
+	const double kg = 1.0 - kr - kb;
+	const double ys = (full ? 255.0 : 219.0) / 255.0 * 32768.0;
+	const double cs = (full ? 255.0 : 224.0) / 255.0 * 32768.0;
+	const double y[3] = {kb * ys, kg * ys, kr * ys};
+	const double u[3] = {0.5 * cs, -kg / (2.0 * (1.0 - kb)) * cs,
+			-kr / (2.0 * (1.0 - kb)) * cs};
+	const double v[3] = {-kb / (2.0 * (1.0 - kr)) * cs,
+			-kg / (2.0 * (1.0 - kr)) * cs, 0.5 * cs};
+
+	memset(c, 0, sizeof(struct yuv_coefs));
+	for (size_t i = 0; i < 3; i++) {
+		c->y[i] = c->y[i + 4] = (int16_t)floor(y[i] + 0.5);
+		c->u[i] = c->u[i + 4] = (int16_t)floor(u[i] + 0.5);
+		c->v[i] = c->v[i + 4] = (int16_t)floor(v[i] + 0.5);
+	}
+	c->y_offset = full ? 0 : 16;
+}
+
+static inline uint8_t yuv_clamp(int32_t val)
+{
+	return (uint8_t)(val < 0 ? 0 : val > 255 ? 255 : val);
+}
+
+static void bgra_y_row_c(uint8_t *dst, const uint8_t *src, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const int32_t offset = (c->y_offset << 15) + (1 << 14);
+	for (uint32_t x = 0; x < width; x++, src += 4)
+		dst[x] = yuv_clamp((c->y[0] * src[0] + c->y[1] * src[1] +
+				c->y[2] * src[2] + offset) >> 15);
+}
+
+/* one chroma sample from every 2x2 block of the two rows, written every
+ * step bytes so u and v can share a plane for nv12 */
+static void bgra_uv_row_c(uint8_t *u, uint8_t *v, size_t step,
+		const uint8_t *src0, const uint8_t *src1, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const int32_t offset = (128 << 15) + (1 << 14);
+	for (uint32_t x = 0; x < width; x++, src0 += 8, src1 += 8) {
+		const int32_t b = (src0[0] + src0[4] + src1[0] + src1[4] + 2) >> 2;
+		const int32_t g = (src0[1] + src0[5] + src1[1] + src1[5] + 2) >> 2;
+		const int32_t r = (src0[2] + src0[6] + src1[2] + src1[6] + 2) >> 2;
+		u[x * step] = yuv_clamp((c->u[0] * b + c->u[1] * g +
+				c->u[2] * r + offset) >> 15);
+		v[x * step] = yuv_clamp((c->v[0] * b + c->v[1] * g +
+				c->v[2] * r + offset) >> 15);
+	}
+}
+
+/* dst = a + (b - a) * weight / 128, weight 0..128 */
+static void lerp_row_c(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		size_t count, uint32_t weight)
+{
+	for (size_t i = 0; i < count; i++)
+		dst[i] = (uint8_t)(a[i] + (((b[i] - a[i]) * (int)weight + 64) >> 7));
+}
+
+static float audio_peak_c(const float *src, size_t count)
+{
+	float peak = 0.0f;
+	for (size_t i = 0; i < count; i++) {
+		const float val = fabsf(src[i]);
+		if (val > peak)
+			peak = val;
+	}
+	return peak;
+}
+
+static float audio_energy_c(const float *src, size_t count)
+{
+	float energy = 0.0f;
+	for (size_t i = 0; i < count; i++)
+		energy += src[i] * src[i];
+	return energy;
+}
+
+static float audio_dot_c(const float *a, const float *b, size_t count)
+{
+	float dot = 0.0f;
+	for (size_t i = 0; i < count; i++)
+		dot += a[i] * b[i];
+	return dot;
+}
+
+/* Zigzag residuals of the median predictor of the codec for count samples,
+ * the left neighbour of cur[i] is cur[i - 1] and the upper ones prev[i] and
+ * prev[i - 1], so cur[-1] and prev[-1] have to be readable. */
+static void codec_residuals_c(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		const int a = cur[i - 1];
+		const int b = prev[i];
+		const int c = prev[i - 1];
+		const int mn = a < b ? a : b;
+		const int mx = a < b ? b : a;
+		int p = a + b - c;
+		p = p < mn ? mn : p > mx ? mx : p;
+		const int8_t r = (int8_t)(uint8_t)(cur[i] - p);
+		dst[i] = (uint8_t)((r << 1) ^ (r >> 7));
+	}
+}
+
+/* Reconstructs count pixels of 4 bytes for the codec, every byte from the
+ * median prediction of the same byte in the pixel to the left and in the
+ * reconstructed row above. The zigzag residuals of every byte are in 4 runs
+ * stride apart, padded to whole blocks of 16. */
+static void codec_rebuild4_c(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count, uint32_t near)
+{
+	const int step = 2 * (int)near + 1;
+	for (size_t ch = 0; ch < 4; ch++) {
+		int a = prev[ch];
+		int c = prev[ch];
+		for (size_t i = 0; i < count; i++) {
+			const int b = prev[i * 4 + ch];
+			const int mn = a < b ? a : b;
+			const int mx = a < b ? b : a;
+			int p = a + b - c;
+			p = p < mn ? mn : p > mx ? mx : p;
+			const uint8_t u = res[ch * stride + i];
+			const int v = p + ((int)(u >> 1) ^ -(int)(u & 1)) * step;
+			a = near ? (v < 0 ? 0 : v > 255 ? 255 : v) : (uint8_t)v;
+			cur[i * 4 + ch] = (uint8_t)a;
+			c = b;
+		}
+	}
+}
+
+/* Near-lossless residuals of count pixels of 4 bytes for the codec, the
+ * counterpart of codec_rebuild4. rec gets the reconstructed pixels. */
+static void codec_quantize4_c(uint8_t *res, size_t stride, uint8_t *rec,
+		const uint8_t *cur, const uint8_t *prev, size_t count,
+		uint32_t near)
+{
+	const int step = 2 * (int)near + 1;
+	for (size_t ch = 0; ch < 4; ch++) {
+		int a = prev[ch];
+		int c = prev[ch];
+		for (size_t i = 0; i < count; i++) {
+			const int b = prev[i * 4 + ch];
+			const int mn = a < b ? a : b;
+			const int mx = a < b ? b : a;
+			int p = a + b - c;
+			p = p < mn ? mn : p > mx ? mx : p;
+			const int e = cur[i * 4 + ch] - p;
+			const int q = e > 0 ? (e + (int)near) / step :
+					-(((int)near - e) / step);
+			const int v = p + q * step;
+			a = v < 0 ? 0 : v > 255 ? 255 : v;
+			rec[i * 4 + ch] = (uint8_t)a;
+			res[ch * stride + i] = (uint8_t)(((unsigned)q << 1) ^
+					(unsigned)(q >> 31));
+			c = b;
+		}
+	}
+}
+
+#ifdef REPLAY_SIMD_X86
+static void expand_y800_sse2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		const __m128i lo = _mm_unpacklo_epi8(v, v);
+		const __m128i hi = _mm_unpackhi_epi8(v, v);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(lo, lo));
+		_mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(lo, lo));
+		_mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(hi, hi));
+		_mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(hi, hi));
+	}
+	expand_y800_c(dst + i, src + i, count - i);
+}
+
+static void copy_line_sse2(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+	const size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+	if (bytes < head + 64) {
+		memcpy(dst, src, bytes);
+		return;
+	}
+	memcpy(dst, src, head);
+	size_t i = head;
+	for (; i + 64 <= bytes; i += 64) {
+		const __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+		const __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+		const __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+		_mm_stream_si128((__m128i*)(dst + i), a);
+		_mm_stream_si128((__m128i*)(dst + i + 16), b);
+		_mm_stream_si128((__m128i*)(dst + i + 32), c);
+		_mm_stream_si128((__m128i*)(dst + i + 48), d);
+	}
+	memcpy(dst + i, src + i, bytes - i);
+}
+
+/* dot products of the coefficients with two pixels of 16 bit channels in
+ * lo and two in hi, returns the four sums shifted back to integers */
+static inline __m128i sse2_dot(__m128i lo, __m128i hi, __m128i coef,
+		__m128i offset)
+{
+	const __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, coef));
+	const __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, coef));
+	const __m128i sum = _mm_add_epi32(
+			_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+			_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+	return _mm_srai_epi32(_mm_add_epi32(sum, offset), 15);
+}
+
+static inline __m128i sse2_dot4(__m128i px, __m128i coef, __m128i offset)
+{
+	const __m128i zero = _mm_setzero_si128();
+	return sse2_dot(_mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero),
+			coef, offset);
+}
+
+/* average of the 2x2 blocks of four pixels in two rows, as two pixels of
+ * 16 bit channels */
+static inline __m128i sse2_chroma2(const uint8_t *src0, const uint8_t *src1)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i px = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)src0),
+			_mm_loadu_si128((const __m128i*)src1));
+	__m128i lo = _mm_unpacklo_epi8(px, zero);
+	__m128i hi = _mm_unpackhi_epi8(px, zero);
+	lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+	return _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+			_mm_set1_epi16(1)), 1);
+}
+
+static void bgra_y_row_sse2(uint8_t *dst, const uint8_t *src, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const __m128i coef = _mm_loadu_si128((const __m128i*)c->y);
+	const __m128i offset = _mm_set1_epi32((c->y_offset << 15) + (1 << 14));
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		const uint8_t *p = src + (size_t)x * 4;
+		const __m128i a = sse2_dot4(_mm_loadu_si128((const __m128i*)p), coef, offset);
+		const __m128i b = sse2_dot4(_mm_loadu_si128((const __m128i*)(p + 16)), coef, offset);
+		const __m128i d = sse2_dot4(_mm_loadu_si128((const __m128i*)(p + 32)), coef, offset);
+		const __m128i e = sse2_dot4(_mm_loadu_si128((const __m128i*)(p + 48)), coef, offset);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(
+				_mm_packs_epi32(a, b), _mm_packs_epi32(d, e)));
+	}
+	bgra_y_row_c(dst + x, src + (size_t)x * 4, width - x, c);
+}
+
+static void bgra_uv_row_sse2(uint8_t *u, uint8_t *v, size_t step,
+		const uint8_t *src0, const uint8_t *src1, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const __m128i ucoef = _mm_loadu_si128((const __m128i*)c->u);
+	const __m128i vcoef = _mm_loadu_si128((const __m128i*)c->v);
+	const __m128i offset = _mm_set1_epi32((128 << 15) + (1 << 14));
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const size_t pos = (size_t)x * 8;
+		const __m128i c0 = sse2_chroma2(src0 + pos, src1 + pos);
+		const __m128i c1 = sse2_chroma2(src0 + pos + 16, src1 + pos + 16);
+		const __m128i c2 = sse2_chroma2(src0 + pos + 32, src1 + pos + 32);
+		const __m128i c3 = sse2_chroma2(src0 + pos + 48, src1 + pos + 48);
+		__m128i us = _mm_packs_epi32(sse2_dot(c0, c1, ucoef, offset),
+				sse2_dot(c2, c3, ucoef, offset));
+		__m128i vs = _mm_packs_epi32(sse2_dot(c0, c1, vcoef, offset),
+				sse2_dot(c2, c3, vcoef, offset));
+		us = _mm_packus_epi16(us, us);
+		vs = _mm_packus_epi16(vs, vs);
+		if (step == 2) {
+			_mm_storeu_si128((__m128i*)(u + (size_t)x * 2),
+					_mm_unpacklo_epi8(us, vs));
+		} else {
+			_mm_storel_epi64((__m128i*)(u + x), us);
+			_mm_storel_epi64((__m128i*)(v + x), vs);
+		}
+	}
+	bgra_uv_row_c(u + x * step, v + x * step, step, src0 + (size_t)x * 8,
+			src1 + (size_t)x * 8, width - x, c);
+}
+
+static void lerp_row_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		size_t count, uint32_t weight)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16((short)weight);
+	const __m128i round = _mm_set1_epi16(64);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		const __m128i alo = _mm_unpacklo_epi8(va, zero);
+		const __m128i ahi = _mm_unpackhi_epi8(va, zero);
+		const __m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(vb, zero), alo);
+		const __m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(vb, zero), ahi);
+		const __m128i lo = _mm_add_epi16(alo, _mm_srai_epi16(_mm_add_epi16(
+				_mm_mullo_epi16(dlo, w), round), 7));
+		const __m128i hi = _mm_add_epi16(ahi, _mm_srai_epi16(_mm_add_epi16(
+				_mm_mullo_epi16(dhi, w), round), 7));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	lerp_row_c(dst + i, a + i, b + i, count - i, weight);
+}
+
+/* the prediction is a + b - c clamped between a and b, which is the lower
+ * of both when c is above them and the higher when c is below, so it can
+ * be done in bytes */
+static void codec_residuals_sse2(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i*)(cur + i));
+		const __m128i a = _mm_loadu_si128((const __m128i*)(cur + i - 1));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		const __m128i c = _mm_loadu_si128((const __m128i*)(prev + i - 1));
+		const __m128i mn = _mm_min_epu8(a, b);
+		const __m128i mx = _mm_max_epu8(a, b);
+		const __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(c, mx), c);
+		const __m128i below = _mm_cmpeq_epi8(_mm_min_epu8(c, mn), c);
+		__m128i p = _mm_sub_epi8(_mm_add_epi8(a, b), c);
+		p = _mm_or_si128(_mm_and_si128(below, mx), _mm_andnot_si128(below, p));
+		p = _mm_or_si128(_mm_and_si128(above, mn), _mm_andnot_si128(above, p));
+		const __m128i r = _mm_sub_epi8(x, p);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(
+				_mm_add_epi8(r, r), _mm_cmpgt_epi8(zero, r)));
+	}
+	codec_residuals_c(dst + i, cur + i, prev + i, count - i);
+}
+
+/* the 4 bytes of a pixel are predicted in one register, the residuals of
+ * 16 pixels are interleaved first */
+static void codec_rebuild4_sse2(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count, uint32_t near)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i byte = _mm_set1_epi16(255);
+	const __m128i step = _mm_set1_epi16((short)(2 * near + 1));
+	uint8_t q[64];
+	uint32_t pixel;
+
+	memcpy(&pixel, prev, sizeof(pixel));
+	__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)pixel), zero);
+	__m128i c = a;
+	for (size_t i = 0; i < count; i += 16) {
+		const __m128i r0 = _mm_loadu_si128((const __m128i*)(res + i));
+		const __m128i r1 = _mm_loadu_si128((const __m128i*)(res + stride + i));
+		const __m128i r2 = _mm_loadu_si128((const __m128i*)(res + stride * 2 + i));
+		const __m128i r3 = _mm_loadu_si128((const __m128i*)(res + stride * 3 + i));
+		const __m128i t0 = _mm_unpacklo_epi8(r0, r1);
+		const __m128i t1 = _mm_unpackhi_epi8(r0, r1);
+		const __m128i t2 = _mm_unpacklo_epi8(r2, r3);
+		const __m128i t3 = _mm_unpackhi_epi8(r2, r3);
+		_mm_storeu_si128((__m128i*)q, _mm_unpacklo_epi16(t0, t2));
+		_mm_storeu_si128((__m128i*)(q + 16), _mm_unpackhi_epi16(t0, t2));
+		_mm_storeu_si128((__m128i*)(q + 32), _mm_unpacklo_epi16(t1, t3));
+		_mm_storeu_si128((__m128i*)(q + 48), _mm_unpackhi_epi16(t1, t3));
+
+		const size_t n = count - i < 16 ? count - i : 16;
+		for (size_t j = 0; j < n; j++) {
+			uint32_t residual;
+			memcpy(&pixel, prev + (i + j) * 4, sizeof(pixel));
+			memcpy(&residual, q + j * 4, sizeof(residual));
+			const __m128i b = _mm_unpacklo_epi8(
+					_mm_cvtsi32_si128((int)pixel), zero);
+			const __m128i u = _mm_unpacklo_epi8(
+					_mm_cvtsi32_si128((int)residual), zero);
+			const __m128i d = _mm_xor_si128(_mm_srli_epi16(u, 1),
+					_mm_sub_epi16(zero, _mm_and_si128(u, one)));
+			__m128i p = _mm_sub_epi16(_mm_add_epi16(a, b), c);
+			p = _mm_max_epi16(_mm_min_epi16(a, b),
+					_mm_min_epi16(_mm_max_epi16(a, b), p));
+			if (near)
+				a = _mm_max_epi16(zero, _mm_min_epi16(byte,
+						_mm_add_epi16(p, _mm_mullo_epi16(d,
+						step))));
+			else
+				a = _mm_and_si128(_mm_add_epi16(p, d), byte);
+			pixel = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(a, a));
+			memcpy(cur + (i + j) * 4, &pixel, sizeof(pixel));
+			c = b;
+		}
+	}
+}
+
+/* |e| + near is below 2^16 / step, so the division is a multiply by the
+ * rounded up reciprocal */
+static void codec_quantize4_sse2(uint8_t *res, size_t stride, uint8_t *rec,
+		const uint8_t *cur, const uint8_t *prev, size_t count,
+		uint32_t near)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i byte = _mm_set1_epi16(255);
+	const __m128i bias = _mm_set1_epi16((short)near);
+	const __m128i step = _mm_set1_epi16((short)(2 * near + 1));
+	const __m128i reciprocal = _mm_set1_epi16((short)(
+			(65536 + 2 * near) / (2 * near + 1)));
+	uint32_t pixel;
+
+	memcpy(&pixel, prev, sizeof(pixel));
+	__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)pixel), zero);
+	__m128i c = a;
+	for (size_t i = 0; i < count; i++) {
+		memcpy(&pixel, prev + i * 4, sizeof(pixel));
+		const __m128i b = _mm_unpacklo_epi8(
+				_mm_cvtsi32_si128((int)pixel), zero);
+		memcpy(&pixel, cur + i * 4, sizeof(pixel));
+		const __m128i x = _mm_unpacklo_epi8(
+				_mm_cvtsi32_si128((int)pixel), zero);
+		__m128i p = _mm_sub_epi16(_mm_add_epi16(a, b), c);
+		p = _mm_max_epi16(_mm_min_epi16(a, b),
+				_mm_min_epi16(_mm_max_epi16(a, b), p));
+		const __m128i e = _mm_sub_epi16(x, p);
+		const __m128i sign = _mm_srai_epi16(e, 15);
+		const __m128i magnitude = _mm_max_epi16(e, _mm_sub_epi16(zero, e));
+		const __m128i qa = _mm_mulhi_epu16(_mm_add_epi16(magnitude,
+				bias), reciprocal);
+		const __m128i q = _mm_sub_epi16(_mm_xor_si128(qa, sign), sign);
+		a = _mm_max_epi16(zero, _mm_min_epi16(byte, _mm_add_epi16(p,
+				_mm_mullo_epi16(q, step))));
+		const __m128i zigzag = _mm_xor_si128(_mm_add_epi16(q, q), sign);
+		pixel = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(a, a));
+		memcpy(rec + i * 4, &pixel, sizeof(pixel));
+		pixel = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(zigzag,
+				zigzag));
+		res[i] = (uint8_t)pixel;
+		res[stride + i] = (uint8_t)(pixel >> 8);
+		res[stride * 2 + i] = (uint8_t)(pixel >> 16);
+		res[stride * 3 + i] = (uint8_t)(pixel >> 24);
+		c = b;
+	}
+}
+
+static float audio_peak_sse2(const float *src, size_t count)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 max0 = _mm_setzero_ps();
+	__m128 max1 = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		max0 = _mm_max_ps(max0, _mm_and_ps(_mm_loadu_ps(src + i), abs_mask));
+		max1 = _mm_max_ps(max1, _mm_and_ps(_mm_loadu_ps(src + i + 4), abs_mask));
+	}
+	max0 = _mm_max_ps(max0, max1);
+	max0 = _mm_max_ps(max0, _mm_movehl_ps(max0, max0));
+	max0 = _mm_max_ss(max0, _mm_shuffle_ps(max0, max0, 1));
+	const float peak = _mm_cvtss_f32(max0);
+	const float tail = audio_peak_c(src + i, count - i);
+	return tail > peak ? tail : peak;
+}
+
+static float audio_energy_sse2(const float *src, size_t count)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m128 a = _mm_loadu_ps(src + i);
+		const __m128 b = _mm_loadu_ps(src + i + 4);
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(a, a));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(b, b));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0) + audio_energy_c(src + i, count - i);
+}
+
+static float audio_dot_sse2(const float *a, const float *b, size_t count)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i),
+				_mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+				_mm_loadu_ps(b + i + 4)));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0) + audio_dot_c(a + i, b + i, count - i);
+}
+
+REPLAY_TARGET_AVX2
+static void expand_y800_avx2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+	const __m256i lo_mask = _mm256_setr_epi8(
+			0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+			4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+	const __m256i hi_mask = _mm256_setr_epi8(
+			8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11,
+			12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m256i v = _mm256_broadcastsi128_si256(
+				_mm_loadu_si128((const __m128i*)(src + i)));
+		_mm256_storeu_si256((__m256i*)(dst + i),
+				_mm256_shuffle_epi8(v, lo_mask));
+		_mm256_storeu_si256((__m256i*)(dst + i + 8),
+				_mm256_shuffle_epi8(v, hi_mask));
+	}
+	expand_y800_c(dst + i, src + i, count - i);
+}
+
+REPLAY_TARGET_AVX2
+static void copy_line_avx2(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+	const size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+	if (bytes < head + 128) {
+		memcpy(dst, src, bytes);
+		return;
+	}
+	memcpy(dst, src, head);
+	size_t i = head;
+	for (; i + 128 <= bytes; i += 128) {
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+		const __m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 64));
+		const __m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 96));
+		_mm256_stream_si256((__m256i*)(dst + i), a);
+		_mm256_stream_si256((__m256i*)(dst + i + 32), b);
+		_mm256_stream_si256((__m256i*)(dst + i + 64), c);
+		_mm256_stream_si256((__m256i*)(dst + i + 96), d);
+	}
+	memcpy(dst + i, src + i, bytes - i);
+}
+
+REPLAY_TARGET_AVX2
+static float audio_peak_avx2(const float *src, size_t count)
+{
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	__m256 max0 = _mm256_setzero_ps();
+	__m256 max1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		max0 = _mm256_max_ps(max0, _mm256_and_ps(_mm256_loadu_ps(src + i), abs_mask));
+		max1 = _mm256_max_ps(max1, _mm256_and_ps(_mm256_loadu_ps(src + i + 8), abs_mask));
+	}
+	max0 = _mm256_max_ps(max0, max1);
+	__m128 max = _mm_max_ps(_mm256_castps256_ps128(max0),
+			_mm256_extractf128_ps(max0, 1));
+	max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+	max = _mm_max_ss(max, _mm_shuffle_ps(max, max, 1));
+	const float peak = _mm_cvtss_f32(max);
+	const float tail = audio_peak_c(src + i, count - i);
+	return tail > peak ? tail : peak;
+}
+
+REPLAY_TARGET_AVX2
+static float audio_energy_avx2(const float *src, size_t count)
+{
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m256 a = _mm256_loadu_ps(src + i);
+		const __m256 b = _mm256_loadu_ps(src + i + 8);
+		sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(a, a));
+		sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(b, b));
+	}
+	sum0 = _mm256_add_ps(sum0, sum1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0),
+			_mm256_extractf128_ps(sum0, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum) + audio_energy_c(src + i, count - i);
+}
+
+REPLAY_TARGET_AVX2
+static float audio_dot_avx2(const float *a, const float *b, size_t count)
+{
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+				_mm256_loadu_ps(b + i)));
+		sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8),
+				_mm256_loadu_ps(b + i + 8)));
+	}
+	sum0 = _mm256_add_ps(sum0, sum1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0),
+			_mm256_extractf128_ps(sum0, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum) + audio_dot_c(a + i, b + i, count - i);
+}
+
+REPLAY_TARGET_AVX2
+static void codec_residuals_avx2(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i*)(cur + i));
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(cur + i - 1));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
+		const __m256i c = _mm256_loadu_si256((const __m256i*)(prev + i - 1));
+		const __m256i mn = _mm256_min_epu8(a, b);
+		const __m256i mx = _mm256_max_epu8(a, b);
+		const __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(c, mx), c);
+		const __m256i below = _mm256_cmpeq_epi8(_mm256_min_epu8(c, mn), c);
+		__m256i p = _mm256_sub_epi8(_mm256_add_epi8(a, b), c);
+		p = _mm256_blendv_epi8(p, mx, below);
+		p = _mm256_blendv_epi8(p, mn, above);
+		const __m256i r = _mm256_sub_epi8(x, p);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(
+				_mm256_add_epi8(r, r), _mm256_cmpgt_epi8(zero, r)));
+	}
+	codec_residuals_c(dst + i, cur + i, prev + i, count - i);
+}
+
+static bool cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	/* osxsave and avx, then ask the os if it saves the ymm registers */
+	if ((info[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28))
+		return false;
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef REPLAY_SIMD_NEON
+static void expand_y800_neon(uint32_t *dst, const uint8_t *src, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		uint8x16x4_t v;
+		v.val[0] = v.val[1] = v.val[2] = v.val[3] = vld1q_u8(src + i);
+		vst4q_u8((uint8_t*)(dst + i), v);
+	}
+	expand_y800_c(dst + i, src + i, count - i);
+}
+
+static inline uint8x8_t neon_dot(uint8x8_t b, uint8x8_t g, uint8x8_t r,
+		const int16_t *c, int32x4_t offset)
+{
+	const int16x8_t b16 = vreinterpretq_s16_u16(vmovl_u8(b));
+	const int16x8_t g16 = vreinterpretq_s16_u16(vmovl_u8(g));
+	const int16x8_t r16 = vreinterpretq_s16_u16(vmovl_u8(r));
+	int32x4_t lo = vmlal_n_s16(offset, vget_low_s16(b16), c[0]);
+	int32x4_t hi = vmlal_n_s16(offset, vget_high_s16(b16), c[0]);
+	lo = vmlal_n_s16(lo, vget_low_s16(g16), c[1]);
+	hi = vmlal_n_s16(hi, vget_high_s16(g16), c[1]);
+	lo = vmlal_n_s16(lo, vget_low_s16(r16), c[2]);
+	hi = vmlal_n_s16(hi, vget_high_s16(r16), c[2]);
+	return vqmovun_s16(vcombine_s16(vshrn_n_s32(lo, 15), vshrn_n_s32(hi, 15)));
+}
+
+static void bgra_y_row_neon(uint8_t *dst, const uint8_t *src, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const int32x4_t offset = vdupq_n_s32((c->y_offset << 15) + (1 << 14));
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		const uint8x16x4_t p = vld4q_u8(src + (size_t)x * 4);
+		vst1q_u8(dst + x, vcombine_u8(
+				neon_dot(vget_low_u8(p.val[0]), vget_low_u8(p.val[1]),
+					vget_low_u8(p.val[2]), c->y, offset),
+				neon_dot(vget_high_u8(p.val[0]), vget_high_u8(p.val[1]),
+					vget_high_u8(p.val[2]), c->y, offset)));
+	}
+	bgra_y_row_c(dst + x, src + (size_t)x * 4, width - x, c);
+}
+
+static inline uint8x8_t neon_chroma(uint8x16_t row0, uint8x16_t row1)
+{
+	return vmovn_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(row0),
+			vpaddlq_u8(row1)), 2));
+}
+
+static void bgra_uv_row_neon(uint8_t *u, uint8_t *v, size_t step,
+		const uint8_t *src0, const uint8_t *src1, uint32_t width,
+		const struct yuv_coefs *c)
+{
+	const int32x4_t offset = vdupq_n_s32((128 << 15) + (1 << 14));
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const uint8x16x4_t p0 = vld4q_u8(src0 + (size_t)x * 8);
+		const uint8x16x4_t p1 = vld4q_u8(src1 + (size_t)x * 8);
+		const uint8x8_t b = neon_chroma(p0.val[0], p1.val[0]);
+		const uint8x8_t g = neon_chroma(p0.val[1], p1.val[1]);
+		const uint8x8_t r = neon_chroma(p0.val[2], p1.val[2]);
+		uint8x8x2_t uv;
+		uv.val[0] = neon_dot(b, g, r, c->u, offset);
+		uv.val[1] = neon_dot(b, g, r, c->v, offset);
+		if (step == 2) {
+			vst2_u8(u + (size_t)x * 2, uv);
+		} else {
+			vst1_u8(u + x, uv.val[0]);
+			vst1_u8(v + x, uv.val[1]);
+		}
+	}
+	bgra_uv_row_c(u + x * step, v + x * step, step, src0 + (size_t)x * 8,
+			src1 + (size_t)x * 8, width - x, c);
+}
+
+static void lerp_row_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		size_t count, uint32_t weight)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const uint8x16_t va = vld1q_u8(a + i);
+		const uint8x16_t vb = vld1q_u8(b + i);
+		const int16x8_t dlo = vreinterpretq_s16_u16(vsubl_u8(
+				vget_low_u8(vb), vget_low_u8(va)));
+		const int16x8_t dhi = vreinterpretq_s16_u16(vsubl_u8(
+				vget_high_u8(vb), vget_high_u8(va)));
+		const int16x8_t lo = vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(
+				vget_low_u8(va))), vrshrq_n_s16(vmulq_n_s16(dlo,
+				(int16_t)weight), 7));
+		const int16x8_t hi = vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(
+				vget_high_u8(va))), vrshrq_n_s16(vmulq_n_s16(dhi,
+				(int16_t)weight), 7));
+		vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+	}
+	lerp_row_c(dst + i, a + i, b + i, count - i, weight);
+}
+
+static void codec_residuals_neon(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const uint8x16_t x = vld1q_u8(cur + i);
+		const uint8x16_t a = vld1q_u8(cur + i - 1);
+		const uint8x16_t b = vld1q_u8(prev + i);
+		const uint8x16_t c = vld1q_u8(prev + i - 1);
+		const uint8x16_t mn = vminq_u8(a, b);
+		const uint8x16_t mx = vmaxq_u8(a, b);
+		uint8x16_t p = vsubq_u8(vaddq_u8(a, b), c);
+		p = vbslq_u8(vcleq_u8(c, mn), mx, p);
+		p = vbslq_u8(vcgeq_u8(c, mx), mn, p);
+		const int8x16_t r = vreinterpretq_s8_u8(vsubq_u8(x, p));
+		vst1q_u8(dst + i, vreinterpretq_u8_s8(veorq_s8(vaddq_s8(r, r),
+				vshrq_n_s8(r, 7))));
+	}
+	codec_residuals_c(dst + i, cur + i, prev + i, count - i);
+}
+
+static void codec_rebuild4_neon(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count, uint32_t near)
+{
+	const int16x4_t zero = vdup_n_s16(0);
+	const int16x4_t byte = vdup_n_s16(255);
+	const int16x4_t step = vdup_n_s16((int16_t)(2 * near + 1));
+	uint8_t q[64];
+	uint32_t pixel;
+
+	memcpy(&pixel, prev, sizeof(pixel));
+	int16x4_t a = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(
+			vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+	int16x4_t c = a;
+	for (size_t i = 0; i < count; i += 16) {
+		uint8x16x4_t runs;
+		runs.val[0] = vld1q_u8(res + i);
+		runs.val[1] = vld1q_u8(res + stride + i);
+		runs.val[2] = vld1q_u8(res + stride * 2 + i);
+		runs.val[3] = vld1q_u8(res + stride * 3 + i);
+		vst4q_u8(q, runs);
+
+		const size_t n = count - i < 16 ? count - i : 16;
+		for (size_t j = 0; j < n; j++) {
+			uint32_t residual;
+			memcpy(&pixel, prev + (i + j) * 4, sizeof(pixel));
+			memcpy(&residual, q + j * 4, sizeof(residual));
+			const int16x4_t b = vget_low_s16(vreinterpretq_s16_u16(
+					vmovl_u8(vreinterpret_u8_u32(
+					vdup_n_u32(pixel)))));
+			const int16x4_t u = vget_low_s16(vreinterpretq_s16_u16(
+					vmovl_u8(vreinterpret_u8_u32(
+					vdup_n_u32(residual)))));
+			const int16x4_t d = veor_s16(vshr_n_s16(u, 1),
+					vneg_s16(vand_s16(u, vdup_n_s16(1))));
+			int16x4_t p = vsub_s16(vadd_s16(a, b), c);
+			p = vmax_s16(vmin_s16(a, b), vmin_s16(vmax_s16(a, b), p));
+			if (near)
+				a = vmax_s16(zero, vmin_s16(byte, vmla_s16(p, d,
+						step)));
+			else
+				a = vand_s16(vadd_s16(p, d), byte);
+			pixel = vget_lane_u32(vreinterpret_u32_u8(vqmovun_s16(
+					vcombine_s16(a, a))), 0);
+			memcpy(cur + (i + j) * 4, &pixel, sizeof(pixel));
+			c = b;
+		}
+	}
+}
+
+static void codec_quantize4_neon(uint8_t *res, size_t stride, uint8_t *rec,
+		const uint8_t *cur, const uint8_t *prev, size_t count,
+		uint32_t near)
+{
+	const int16x4_t zero = vdup_n_s16(0);
+	const int16x4_t byte = vdup_n_s16(255);
+	const int16x4_t bias = vdup_n_s16((int16_t)near);
+	const int16x4_t step = vdup_n_s16((int16_t)(2 * near + 1));
+	const uint16x4_t reciprocal = vdup_n_u16((uint16_t)(
+			(65536 + 2 * near) / (2 * near + 1)));
+	uint32_t pixel;
+
+	memcpy(&pixel, prev, sizeof(pixel));
+	int16x4_t a = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(
+			vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+	int16x4_t c = a;
+	for (size_t i = 0; i < count; i++) {
+		memcpy(&pixel, prev + i * 4, sizeof(pixel));
+		const int16x4_t b = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(
+				vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+		memcpy(&pixel, cur + i * 4, sizeof(pixel));
+		const int16x4_t x = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(
+				vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+		int16x4_t p = vsub_s16(vadd_s16(a, b), c);
+		p = vmax_s16(vmin_s16(a, b), vmin_s16(vmax_s16(a, b), p));
+		const int16x4_t e = vsub_s16(x, p);
+		const int16x4_t sign = vshr_n_s16(e, 15);
+		const uint16x4_t magnitude = vreinterpret_u16_s16(vadd_s16(
+				vabs_s16(e), bias));
+		const int16x4_t qa = vreinterpret_s16_u16(vshrn_n_u32(vmull_u16(
+				magnitude, reciprocal), 16));
+		const int16x4_t q = vsub_s16(veor_s16(qa, sign), sign);
+		a = vmax_s16(zero, vmin_s16(byte, vmla_s16(p, q, step)));
+		const int16x4_t zigzag = veor_s16(vadd_s16(q, q), sign);
+		pixel = vget_lane_u32(vreinterpret_u32_u8(vqmovun_s16(
+				vcombine_s16(a, a))), 0);
+		memcpy(rec + i * 4, &pixel, sizeof(pixel));
+		pixel = vget_lane_u32(vreinterpret_u32_u8(vqmovun_s16(
+				vcombine_s16(zigzag, zigzag))), 0);
+		res[i] = (uint8_t)pixel;
+		res[stride + i] = (uint8_t)(pixel >> 8);
+		res[stride * 2 + i] = (uint8_t)(pixel >> 16);
+		res[stride * 3 + i] = (uint8_t)(pixel >> 24);
+		c = b;
+	}
+}
+
+static float audio_peak_neon(const float *src, size_t count)
+{
+	float32x4_t max0 = vdupq_n_f32(0.0f);
+	float32x4_t max1 = vdupq_n_f32(0.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		max0 = vmaxq_f32(max0, vabsq_f32(vld1q_f32(src + i)));
+		max1 = vmaxq_f32(max1, vabsq_f32(vld1q_f32(src + i + 4)));
+	}
+	max0 = vmaxq_f32(max0, max1);
+	float32x2_t max = vmax_f32(vget_low_f32(max0), vget_high_f32(max0));
+	max = vpmax_f32(max, max);
+	const float peak = vget_lane_f32(max, 0);
+	const float tail = audio_peak_c(src + i, count - i);
+	return tail > peak ? tail : peak;
+}
+
+static float audio_energy_neon(const float *src, size_t count)
+{
+	float32x4_t sum0 = vdupq_n_f32(0.0f);
+	float32x4_t sum1 = vdupq_n_f32(0.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const float32x4_t a = vld1q_f32(src + i);
+		const float32x4_t b = vld1q_f32(src + i + 4);
+		sum0 = vmlaq_f32(sum0, a, a);
+		sum1 = vmlaq_f32(sum1, b, b);
+	}
+	sum0 = vaddq_f32(sum0, sum1);
+	float32x2_t sum = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
+	sum = vpadd_f32(sum, sum);
+	return vget_lane_f32(sum, 0) + audio_energy_c(src + i, count - i);
+}
+
+static float audio_dot_neon(const float *a, const float *b, size_t count)
+{
+	float32x4_t sum0 = vdupq_n_f32(0.0f);
+	float32x4_t sum1 = vdupq_n_f32(0.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+		sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+	}
+	sum0 = vaddq_f32(sum0, sum1);
+	float32x2_t sum = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
+	sum = vpadd_f32(sum, sum);
+	return vget_lane_f32(sum, 0) + audio_dot_c(a + i, b + i, count - i);
+}
+#endif
+
+static void (*bgra_y_row)(uint8_t *dst, const uint8_t *src, uint32_t width,
+		const struct yuv_coefs *c) = bgra_y_row_c;
+static void (*bgra_uv_row)(uint8_t *u, uint8_t *v, size_t step,
+		const uint8_t *src0, const uint8_t *src1, uint32_t width,
+		const struct yuv_coefs *c) = bgra_uv_row_c;
+static void (*lerp_row)(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		size_t count, uint32_t weight) = lerp_row_c;
+static void (*expand_y800)(uint32_t *dst, const uint8_t *src, size_t count) =
+		expand_y800_c;
+static void (*copy_line_stream)(uint8_t *dst, const uint8_t *src, size_t bytes) =
+		copy_line_c;
+static void (*codec_residuals)(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count) = codec_residuals_c;
+static void (*codec_rebuild4)(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count,
+		uint32_t near) = codec_rebuild4_c;
+static void (*codec_quantize4)(uint8_t *res, size_t stride, uint8_t *rec,
+		const uint8_t *cur, const uint8_t *prev, size_t count,
+		uint32_t near) = codec_quantize4_c;
+static float (*audio_peak)(const float *src, size_t count) = audio_peak_c;
+static float (*audio_energy)(const float *src, size_t count) = audio_energy_c;
+static float (*audio_dot)(const float *a, const float *b, size_t count) =
+		audio_dot_c;
+
+void replay_simd_init(void)
+{
+	const char *kernels = "c";
+#if defined(REPLAY_SIMD_X86)
+	expand_y800 = expand_y800_sse2;
+	copy_line_stream = copy_line_sse2;
+	bgra_y_row = bgra_y_row_sse2;
+	bgra_uv_row = bgra_uv_row_sse2;
+	lerp_row = lerp_row_sse2;
+	codec_residuals = codec_residuals_sse2;
+	codec_rebuild4 = codec_rebuild4_sse2;
+	codec_quantize4 = codec_quantize4_sse2;
+	audio_peak = audio_peak_sse2;
+	audio_energy = audio_energy_sse2;
+	audio_dot = audio_dot_sse2;
+	kernels = "sse2";
+	if (cpu_has_avx2()) {
+		expand_y800 = expand_y800_avx2;
+		copy_line_stream = copy_line_avx2;
+		codec_residuals = codec_residuals_avx2;
+		audio_peak = audio_peak_avx2;
+		audio_energy = audio_energy_avx2;
+		audio_dot = audio_dot_avx2;
+		kernels = "avx2";
+	}
+#elif defined(REPLAY_SIMD_NEON)
+	/* there is no non temporal store intrinsic, memcpy is already the
+	 * fastest plane copy there */
+	expand_y800 = expand_y800_neon;
+	bgra_y_row = bgra_y_row_neon;
+	bgra_uv_row = bgra_uv_row_neon;
+	lerp_row = lerp_row_neon;
+	codec_residuals = codec_residuals_neon;
+	codec_rebuild4 = codec_rebuild4_neon;
+	codec_quantize4 = codec_quantize4_neon;
+	audio_peak = audio_peak_neon;
+	audio_energy = audio_energy_neon;
+	audio_dot = audio_dot_neon;
+	kernels = "neon";
+#endif
+	blog(LOG_INFO, "[replay_source] using %s frame copy kernels", kernels);
+}
+
+void replay_lerp_row(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		size_t count, uint32_t weight)
+{
+	lerp_row(dst, a, b, count, weight);
+}
+
+/* Peak or RMS level of a packet over all its channels. The channels are
+ * checked in blocks and the level is returned as soon as it is known to be
+ * above limit, in that case it is only a lower bound of the real level. */
+float replay_audio_level(const struct obs_audio_data *audio, bool rms,
+		float limit)
+{
+	size_t channels = 0;
+	while (channels < MAX_AV_PLANES && audio->data[channels])
+		channels++;
+	if (!channels || !audio->frames)
+		return 0.0f;
+
+	/* the rms is above limit once the sum of squares is above this */
+	const float samples = (float)(channels * audio->frames);
+	const float energy_limit = limit * limit * samples;
+	float level = 0.0f;
+	for (size_t ch = 0; ch < channels; ch++) {
+		const float *src = (const float*)audio->data[ch];
+		for (size_t i = 0; i < audio->frames; i += REPLAY_LEVEL_BLOCK) {
+			const size_t count = audio->frames - i < REPLAY_LEVEL_BLOCK ?
+					audio->frames - i : REPLAY_LEVEL_BLOCK;
+			if (rms) {
+				level += audio_energy(src + i, count);
+				if (level > energy_limit)
+					return sqrtf(level / samples);
+			} else {
+				const float peak = audio_peak(src + i, count);
+				if (peak > level)
+					level = peak;
+				if (level > limit)
+					return level;
+			}
+		}
+	}
+	return rms ? sqrtf(level / samples) : level;
+}
+
+void replay_codec_residuals(uint8_t *dst, const uint8_t *cur,
+		const uint8_t *prev, size_t count)
+{
+	codec_residuals(dst, cur, prev, count);
+}
+
+void replay_codec_rebuild4(uint8_t *cur, const uint8_t *prev,
+		const uint8_t *res, size_t stride, size_t count, uint32_t near)
+{
+	codec_rebuild4(cur, prev, res, stride, count, near);
+}
+
+void replay_codec_quantize4(uint8_t *res, size_t stride, uint8_t *rec,
+		const uint8_t *cur, const uint8_t *prev, size_t count,
+		uint32_t near)
+{
+	codec_quantize4(res, stride, rec, cur, prev, count, near);
+}
+
+float replay_audio_dot(const float *a, const float *b, size_t count)
+{
+	return audio_dot(a, b, count);
+}
+
+float replay_audio_energy(const float *src, size_t count)
+{
+	return audio_energy(src, count);
+}
+
+void replay_expand_y800(uint32_t *dst, const uint8_t *src, size_t count)
+{
+	expand_y800(dst, src, count);
+}
+
+void replay_copy_plane(uint8_t *dst, uint32_t dst_linesize, const uint8_t *src,
+		uint32_t src_linesize, uint32_t lines)
+{
+	const uint32_t bytes = dst_linesize < src_linesize ?
+			dst_linesize : src_linesize;
+	const size_t size = (size_t)bytes * lines;
+
+	if (size < REPLAY_STREAM_MIN) {
+		if (dst_linesize == src_linesize) {
+			memcpy(dst, src, size);
+			return;
+		}
+		for (uint32_t y = 0; y < lines; y++)
+			memcpy(dst + (size_t)y * dst_linesize,
+					src + (size_t)y * src_linesize, bytes);
+		return;
+	}
+
+	if (dst_linesize == src_linesize) {
+		copy_line_stream(dst, src, size);
+	} else {
+		for (uint32_t y = 0; y < lines; y++)
+			copy_line_stream(dst + (size_t)y * dst_linesize,
+					src + (size_t)y * src_linesize, bytes);
+	}
+#ifdef REPLAY_SIMD_X86
+	_mm_sfence();
+#endif
+}
+
+/* Converts a BGRA image to the NV12 or I420 frame dst, with the color
+ * parameters of the given colorspace and range. Chroma is the average of
+ * every 2x2 block. */
+void replay_convert_bgra(struct obs_source_frame *dst, const uint8_t *src,
+		uint32_t linesize, enum video_colorspace colorspace,
+		enum video_range_type range)
+{
+	struct yuv_coefs c;
+	yuv_coefs_init(&c, colorspace, range);
+
+	for (uint32_t y = 0; y < dst->height; y++)
+		bgra_y_row(dst->data[0] + (size_t)y * dst->linesize[0],
+				src + (size_t)y * linesize, dst->width, &c);
+
+	const bool nv12 = dst->format == VIDEO_FORMAT_NV12;
+	for (uint32_t y = 0; y < dst->height / 2; y++) {
+		const uint8_t *src0 = src + (size_t)y * 2 * linesize;
+		uint8_t *u = dst->data[1] + (size_t)y * dst->linesize[1];
+		uint8_t *v = nv12 ? u + 1 :
+				dst->data[2] + (size_t)y * dst->linesize[2];
+		bgra_uv_row(u, v, nv12 ? 2 : 1, src0, src0 + linesize,
+				dst->width / 2, &c);
+	}
+
+	dst->full_range = range == VIDEO_RANGE_FULL;
+	video_format_get_parameters(colorspace, range, dst->color_matrix,
+			dst->color_range_min, dst->color_range_max);
+}
@@ -50,6 +50,11 @@ struct replay
 	uint64_t                       video_frame_count;
 	struct obs_audio_data*         audio_frames;
 	uint64_t                       audio_frame_count;
+	float*                         audio_data[MAX_AV_PLANES];
+	/* timestamps of the video and audio frames in one block each, seeking
+	 * only touches these instead of every frame */
+	uint64_t*                      video_timestamps;
+	uint64_t*                      audio_timestamps;
 	uint64_t                       first_frame_timestamp;
 	uint64_t                       last_frame_timestamp;
 	uint64_t                       duration;
@@ -57,6 +62,108 @@ struct replay
 	int64_t                        trim_end;
 };
 
+/* compressed frames that play next are decompressed this far ahead */
+#define REPLAY_DECODE_AHEAD 3
+
+struct replay_decoded
+{
+	/* referenced until the slot is taken or reused */
+	struct obs_source_frame        *source;
+	struct obs_source_frame        *frame;
+	size_t                         order;
+	bool                           ready;
+	bool                           busy;
+	bool                           wanted;
+};
+
+/* decompressed copy of the last compressed frame that was used, the play
+ * cache also has a thread that decompresses the next frames */
+struct replay_frame_cache
+{
+	struct obs_source_frame        *frame;
+	const struct obs_source_frame  *source;
+	uint64_t                       count;
+	uint64_t                       time;
+
+	pthread_mutex_t                mutex;
+	pthread_cond_t                 cond;
+	pthread_t                      thread;
+	bool                           thread_active;
+	bool                           stop;
+	struct replay_decoded          ahead[REPLAY_DECODE_AHEAD];
+	uint64_t                       ahead_hits;
+};
+
+enum replay_text_field
+{
+	REPLAY_TEXT_LITERAL,
+	REPLAY_TEXT_SPEED,
+	REPLAY_TEXT_PROGRESS,
+	REPLAY_TEXT_COUNT,
+	REPLAY_TEXT_INDEX,
+	REPLAY_TEXT_DURATION,
+	REPLAY_TEXT_TIME,
+	REPLAY_TEXT_FPS
+};
+
+/* part of the compiled text format, a literal is len chars of text_format
+ * from offset */
+struct replay_text_token
+{
+	enum replay_text_field         field;
+	size_t                         offset;
+	size_t                         len;
+};
+
+/* how late frames are output against the replay timeline, in buckets of
+ * below 0.25, 0.5, 1, 2, 4, 8 and 16 ms and the rest */
+#define REPLAY_JITTER_BUCKETS 8
+struct replay_jitter
+{
+	uint64_t                       buckets[REPLAY_JITTER_BUCKETS];
+	uint64_t                       count;
+	uint64_t                       max;
+};
+
+/* scene items that show the progress crop source, built again when a scene
+ * item was added or removed anywhere since. The items are referenced, so
+ * an item removed after the generation was checked stays valid. */
+struct replay_progress_index
+{
+	obs_weak_source_t              *source;
+	obs_sceneitem_t                **items;
+	size_t                         item_count;
+	size_t                         item_capacity;
+	/* scenes and groups the item signals are connected to */
+	obs_weak_source_t              **scenes;
+	size_t                         scene_count;
+	size_t                         scene_capacity;
+	volatile long                  generation;
+	long                           indexed;
+	bool                           valid;
+	uint32_t                       crop;
+	bool                           crop_set;
+};
+
+/* the audio of a replay reversed for backward playback, built on first use
+ * and kept until that replay is freed */
+struct replay_audio_reverse
+{
+	const struct obs_audio_data    *source;
+	struct obs_audio_data          *frames;
+	uint64_t                       frame_count;
+	float                          *data[MAX_AV_PLANES];
+};
+
+/* window of frame timestamps to retrieve, done is called from the retrieve
+ * thread with whether a replay was loaded */
+struct replay_retrieve_request {
+	uint64_t from;
+	uint64_t to;
+	void (*done)(void *param, bool loaded);
+	void *param;
+};
+
 struct replay_source {
 	obs_source_t  *source;
 	obs_source_t  *source_filter;
@@ -64,6 +171,7 @@ struct replay_source {
 	char          *source_name;
 	char          *source_audio_name;
 	float         speed_percent;
+	bool          preserve_pitch;
 	bool          backward;
 	bool          backward_start;
 	int           visibility_action;
@@ -71,6 +179,7 @@ struct replay_source {
 	char          *next_scene_name;
 	bool          next_scene_disabled;
 	obs_hotkey_id replay_hotkey;
+	obs_hotkey_id range_hotkey;
 	obs_hotkey_id next_hotkey;
 	obs_hotkey_id previous_hotkey;
 	obs_hotkey_id first_hotkey;
@@ -106,6 +215,17 @@ struct replay_source {
 	int64_t       retrieve_delay;
 	uint64_t      retrieve_timestamp;
 	uint64_t      threshold_timestamp;
+	uint64_t      range_start;
+	uint64_t      range_end;
+	/* contains struct replay_retrieve_request, served by retrieve_thread */
+	struct circlebuf retrieve_requests;
+	/* contains struct replay loaded by retrieve_thread, the tick adds them */
+	struct circlebuf retrieved_replays;
+	pthread_mutex_t retrieve_mutex;
+	os_sem_t      *retrieve_sem;
+	pthread_t     retrieve_thread;
+	bool          retrieve_active;
+	volatile bool retrieve_stop;
 	struct obs_source_audio audio;
 
 	bool          disabled;
@@ -126,7 +246,13 @@ struct replay_source {
 
 	/* stores the audio data */
 	uint64_t                       audio_frame_position;
+	/* audio_frame_position counts in audio_reverse, audio_seek finds it
+	 * from the playback position on the next tick */
+	bool                           audio_backward;
+	bool                           audio_seek;
+	struct replay_audio_reverse    audio_reverse;
 	struct obs_audio_data          audio_output;
+	struct replay_stretch          *stretch;
 
 	pthread_mutex_t    video_mutex;
 	pthread_mutex_t    audio_mutex;
@@ -134,6 +260,7 @@ struct replay_source {
 
 	uint32_t known_width;
 	uint32_t known_height;
+	enum video_format known_format;
 
 	video_t* video_output;
 	obs_output_t* fileOutput;
@@ -146,92 +273,126 @@ struct replay_source {
 	uint64_t start_save_timestamp;
 	obs_encoder_t* aac;
 	char *progress_source_name;
+	struct replay_progress_index progress;
+	pthread_mutex_t progress_mutex;
 	char *text_source_name;
 	char *text_format;
+	/* text_format compiled in update, the text is rendered into text_buffer
+	 * and only sent when it differs from text_shown */
+	struct replay_text_token *text_tokens;
+	size_t text_token_count;
+	obs_weak_source_t *text_source;
+	struct dstr text_buffer;
+	struct dstr text_shown;
+	uint64_t text_update_timestamp;
+	uint64_t text_lookup_timestamp;
+	bool text_pending;
+	pthread_mutex_t text_mutex;
 	bool sound_trigger;
+	bool snapshot;
 	bool filter_loaded;
 	bool free_after_save;
+	struct replay_frame_cache play_cache;
+	struct replay_frame_cache save_cache;
+	/* plays instead of the tick when enabled, the end action, the scene
+	 * switch and the text and progress updates it needs are left to the
+	 * tick, progress_timestamp is guarded by video_mutex */
+	pthread_t     playback_thread;
+	bool          playback_active;
+	volatile bool playback_stop;
+	volatile bool end_pending;
+	volatile bool next_scene_pending;
+	volatile bool progress_pending;
+	uint64_t      progress_timestamp;
+	struct replay_jitter jitter;
 };
 
-static void replace_text(struct dstr *str, size_t pos, size_t len,
-		const char *new_text)
-{
-	struct dstr front = {0};
-	struct dstr back = {0};
-
-	dstr_left(&front, str, pos);
-	dstr_right(&back, str, pos + len);
-	dstr_copy_dstr(str, &front);
-	dstr_cat(str, new_text);
-	dstr_cat_dstr(str, &back);
-	dstr_free(&front);
-	dstr_free(&back);
-}
+/* the text source is updated at most this often, a change in between is
+ * sent by the next update after it */
+#define REPLAY_TEXT_MIN_INTERVAL 33000000ULL
+
+static const struct
+{
+	const char *name;
+	size_t len;
+	enum replay_text_field field;
+} replay_text_fields[] = {
+	{"%SPEED%", 7, REPLAY_TEXT_SPEED},
+	{"%PROGRESS%", 10, REPLAY_TEXT_PROGRESS},
+	{"%COUNT%", 7, REPLAY_TEXT_COUNT},
+	{"%INDEX%", 7, REPLAY_TEXT_INDEX},
+	{"%DURATION%", 10, REPLAY_TEXT_DURATION},
+	{"%TIME%", 6, REPLAY_TEXT_TIME},
+	{"%FPS%", 5, REPLAY_TEXT_FPS},
+};
 
-static void replay_update_text(struct replay_source* c)
+/* splits text_format into literals and fields, called with text_mutex held */
+static void replay_compile_text(struct replay_source *c)
 {
-	if(!c->text_source_name || !c->text_format)
-		return;
-	obs_source_t *s = obs_get_source_by_name(c->text_source_name);
-	if(!s)
+	bfree(c->text_tokens);
+	c->text_tokens = NULL;
+	c->text_token_count = 0;
+	if(!c->text_format)
 		return;
 
-	struct dstr sf;
+	const size_t len = strlen(c->text_format);
+	c->text_tokens = bmalloc((len + 1) * sizeof(struct replay_text_token));
 	size_t pos = 0;
-	char convert[128] = {0};
-	struct dstr buffer;
-	dstr_init(&buffer);
-	dstr_init_copy(&sf, c->text_format);
-	while (pos < sf.len)
-	{
-		//duration, speed, index, count
-		const char *cmp = sf.array + pos;
-		if(astrcmp_n(cmp,"%SPEED%", 7)==0)
+	size_t literal = 0;
+	while(pos < len)
+	{
+		size_t i = 0;
+		const size_t count = sizeof(replay_text_fields) / sizeof(replay_text_fields[0]);
+		while(i < count && astrcmp_n(c->text_format + pos, replay_text_fields[i].name, replay_text_fields[i].len) != 0)
+			i++;
+		if(i == count)
 		{
-			dstr_printf(&buffer, "%.1f", c->speed_percent*(c->backward?-1:1));
-			dstr_cat_ch(&buffer, '%');
-			replace_text(&sf, pos, 7, buffer.array);
-			pos += buffer.len;
+			pos++;
+			continue;
 		}
-		else if(astrcmp_n(cmp,"%PROGRESS%", 10)==0)
-		{
-			if(c->current_replay.video_frame_count && c->video_frame_position < c->current_replay.video_frame_count){
-				dstr_printf(&buffer, "%.1f", c->video_frame_position*100.0/c->current_replay.video_frame_count);
-				dstr_cat_ch(&buffer, '%');
-			}
-			else
-			{
-				dstr_copy(&buffer,"");
-			}
-			replace_text(&sf, pos, 10, buffer.array);
-			pos += buffer.len;
-		}else if(astrcmp_n(cmp,"%COUNT%", 7)==0)
-		{
-			dstr_printf(&buffer, "%d", c->replays.size / sizeof c->current_replay);
-			replace_text(&sf, pos, 7, buffer.array);
-			pos += buffer.len;
-		}else if(astrcmp_n(cmp,"%INDEX%", 7)==0)
-		{
-			if(c->replays.size){
-				dstr_printf(&buffer, "%d", c->replay_position+1);
-			}else
-			{
-				dstr_copy(&buffer,"0");
-			}
-			replace_text(&sf, pos, 7, buffer.array);
-			pos += buffer.len;
-		}else if(astrcmp_n(cmp,"%DURATION%", 10)==0)
-		{
-			if(c->replays.size){
-				dstr_printf(&buffer, "%.2f", (double)c->current_replay.duration/ (double)1000000000.0);
-			}else
-			{
-				dstr_copy(&buffer,"");
-			}
-			replace_text(&sf, pos, 10, buffer.array);
-			pos += buffer.len;
-		}else if(astrcmp_n(cmp,"%TIME%", 6)==0)
+		if(pos > literal)
+			c->text_tokens[c->text_token_count++] = (struct replay_text_token){REPLAY_TEXT_LITERAL, literal, pos - literal};
+		c->text_tokens[c->text_token_count++] = (struct replay_text_token){replay_text_fields[i].field, pos, replay_text_fields[i].len};
+		pos += replay_text_fields[i].len;
+		literal = pos;
+	}
+	if(len > literal)
+		c->text_tokens[c->text_token_count++] = (struct replay_text_token){REPLAY_TEXT_LITERAL, literal, len - literal};
+}
+
+static void replay_render_text(struct replay_source *c, struct dstr *text)
+{
+	if(text->array)
+	{
+		text->array[0] = 0;
+		text->len = 0;
+	}
+	for(size_t i = 0; i < c->text_token_count; i++)
+	{
+		const struct replay_text_token *token = &c->text_tokens[i];
+		switch(token->field)
 		{
+		case REPLAY_TEXT_LITERAL:
+			dstr_ncat(text, c->text_format + token->offset, token->len);
+			break;
+		case REPLAY_TEXT_SPEED:
+			dstr_catf(text, "%.1f%%", c->speed_percent*(c->backward?-1:1));
+			break;
+		case REPLAY_TEXT_PROGRESS:
+			if(c->current_replay.video_frame_count && c->video_frame_position < c->current_replay.video_frame_count)
+				dstr_catf(text, "%.1f%%", c->video_frame_position*100.0/c->current_replay.video_frame_count);
+			break;
+		case REPLAY_TEXT_COUNT:
+			dstr_catf(text, "%d", (int)(c->replays.size / sizeof c->current_replay));
+			break;
+		case REPLAY_TEXT_INDEX:
+			dstr_catf(text, "%d", c->replays.size ? c->replay_position+1 : 0);
+			break;
+		case REPLAY_TEXT_DURATION:
+			if(c->replays.size)
+				dstr_catf(text, "%.2f", (double)c->current_replay.duration/ (double)1000000000.0);
+			break;
+		case REPLAY_TEXT_TIME:
 			if(c->replays.size && c->start_timestamp){
 				uint64_t time = 0;
 				if(c->pause_timestamp > c->start_timestamp)
@@ -245,90 +406,258 @@ static void replay_update_text(struct replay_source* c)
 				{
 					time = time * c->speed_percent / 100.0;
 				}
-				dstr_printf(&buffer, "%.2f", (double)time/ (double)1000000000.0);
-			}else
-			{
-				dstr_copy(&buffer,"");
-			}
-			replace_text(&sf, pos, 6, buffer.array);
-			pos += buffer.len;
-		}else if(astrcmp_n(cmp,"%FPS%", 5)==0)
-		{
-			if(c->current_replay.video_frame_count && c->current_replay.duration){
-				dstr_printf(&buffer, "%d", c->current_replay.video_frame_count * 1000000000U/c->current_replay.duration);
+				dstr_catf(text, "%.2f", (double)time/ (double)1000000000.0);
 			}
+			break;
+		case REPLAY_TEXT_FPS:
+			if(c->current_replay.video_frame_count && c->current_replay.duration)
+				dstr_catf(text, "%d", (int)(c->current_replay.video_frame_count * 1000000000U/c->current_replay.duration));
 			else
-			{
-				dstr_copy(&buffer,"0");
-			}
-			replace_text(&sf, pos, 5, buffer.array);
-			pos += buffer.len;
-		}
-		else
-		{
-			pos++;
+				dstr_cat(text, "0");
+			break;
 		}
 	}
+}
+
+/* the text source from the cached weak reference, looked up by name at
+ * most every REPLAY_TEXT_MIN_INTERVAL while it does not exist */
+static obs_source_t *replay_get_text_source(struct replay_source *c, uint64_t now)
+{
+	obs_source_t *s = c->text_source ? obs_weak_source_get_source(c->text_source) : NULL;
+	if(s)
+		return s;
+	if(c->text_lookup_timestamp && now - c->text_lookup_timestamp < REPLAY_TEXT_MIN_INTERVAL)
+		return NULL;
+	c->text_lookup_timestamp = now;
+	obs_weak_source_release(c->text_source);
+	c->text_source = NULL;
+	s = obs_get_source_by_name(c->text_source_name);
+	if(s)
+		c->text_source = obs_source_get_weak_source(s);
+	return s;
+}
+
+static void replay_update_text(struct replay_source* c)
+{
+	pthread_mutex_lock(&c->text_mutex);
+	if(!c->text_source_name || !*c->text_source_name || !c->text_format)
+	{
+		c->text_pending = false;
+		pthread_mutex_unlock(&c->text_mutex);
+		return;
+	}
+	const uint64_t now = os_gettime_ns();
+	replay_render_text(c, &c->text_buffer);
+	const char *text = c->text_buffer.array ? c->text_buffer.array : "";
+	const char *shown = c->text_shown.array ? c->text_shown.array : "";
+	if(c->text_update_timestamp && strcmp(text, shown) == 0)
+	{
+		c->text_pending = false;
+		pthread_mutex_unlock(&c->text_mutex);
+		return;
+	}
+	if(c->text_update_timestamp && now - c->text_update_timestamp < REPLAY_TEXT_MIN_INTERVAL)
+	{
+		c->text_pending = true;
+		pthread_mutex_unlock(&c->text_mutex);
+		return;
+	}
+	obs_source_t *s = replay_get_text_source(c, now);
+	if(!s)
+	{
+		c->text_pending = false;
+		pthread_mutex_unlock(&c->text_mutex);
+		return;
+	}
 	obs_data_t* settings = obs_data_create();
-	obs_data_set_string(settings,"text", sf.array);
+	obs_data_set_string(settings,"text", text);
 	obs_source_update(s, settings);
 	obs_data_release(settings);
-	dstr_free(&sf);
-	dstr_free(&buffer);
 	obs_source_release(s);
+
+	struct dstr swap = c->text_shown;
+	c->text_shown = c->text_buffer;
+	c->text_buffer = swap;
+	c->text_update_timestamp = now;
+	c->text_pending = false;
+	pthread_mutex_unlock(&c->text_mutex);
+}
+
+static void replay_progress_invalidate(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	struct replay_source *context = data;
+	os_atomic_inc_long(&context->progress.generation);
+}
+
+/* only a scene that is created or removed can add or drop items showing the
+ * progress source */
+static void replay_progress_scene_changed(void *data, calldata_t *cd)
+{
+	obs_source_t *source = calldata_ptr(cd, "source");
+	if(source && obs_source_get_type(source) == OBS_SOURCE_TYPE_SCENE)
+		replay_progress_invalidate(data, cd);
+}
+
+/* drops the items and disconnects from the scenes, called with
+ * progress_mutex held */
+static void replay_progress_clear(struct replay_source *context)
+{
+	struct replay_progress_index *index = &context->progress;
+	for(size_t i = 0; i < index->item_count; i++)
+		obs_sceneitem_release(index->items[i]);
+	index->item_count = 0;
+	for(size_t i = 0; i < index->scene_count; i++)
+	{
+		obs_source_t *scene = obs_weak_source_get_source(index->scenes[i]);
+		if(scene)
+		{
+			signal_handler_t *sh = obs_source_get_signal_handler(scene);
+			signal_handler_disconnect(sh, "item_add", replay_progress_invalidate, context);
+			signal_handler_disconnect(sh, "item_remove", replay_progress_invalidate, context);
+			obs_source_release(scene);
+		}
+		obs_weak_source_release(index->scenes[i]);
+	}
+	index->scene_count = 0;
+	index->valid = false;
+	index->crop_set = false;
+}
+
+static void replay_progress_free(struct replay_source *context)
+{
+	struct replay_progress_index *index = &context->progress;
+	replay_progress_clear(context);
+	obs_weak_source_release(index->source);
+	index->source = NULL;
+	bfree(index->items);
+	bfree(index->scenes);
+	index->items = NULL;
+	index->scenes = NULL;
+	index->item_capacity = 0;
+	index->scene_capacity = 0;
 }
 
-struct siu
+struct replay_progress_scan
 {
-	uint32_t crop_width;
+	struct replay_source *context;
 	obs_source_t *source;
 };
+
+static void replay_progress_add_scene(struct replay_progress_scan *scan, obs_scene_t *scene);
+
 static bool EnumSceneItem(obs_scene_t *scene,obs_sceneitem_t *item, void *data)
 {
-	struct siu* siu = data;
-	if(item->source == siu->source)
+	struct replay_progress_scan *scan = data;
+	struct replay_progress_index *index = &scan->context->progress;
+	if(item->source == scan->source)
 	{
-		struct obs_sceneitem_crop crop;
-		obs_sceneitem_get_crop(item,&crop);
-		crop.left = 0;
-		crop.right = siu->crop_width;
-		obs_sceneitem_set_crop(item, &crop);
+		if(index->item_count == index->item_capacity)
+		{
+			index->item_capacity = index->item_capacity ? index->item_capacity * 2 : 4;
+			index->items = brealloc(index->items, index->item_capacity * sizeof(obs_sceneitem_t*));
+		}
+		obs_sceneitem_addref(item);
+		index->items[index->item_count++] = item;
 	}else if(obs_sceneitem_is_group(item)){
-		obs_scene_enum_items(obs_sceneitem_group_get_scene(item),EnumSceneItem,data);
+		replay_progress_add_scene(scan, obs_sceneitem_group_get_scene(item));
 	}
 	return true;
 }
 
+/* connects to the item signals of scene and indexes its items */
+static void replay_progress_add_scene(struct replay_progress_scan *scan, obs_scene_t *scene)
+{
+	struct replay_progress_index *index = &scan->context->progress;
+	obs_source_t *source = obs_scene_get_source(scene);
+	if(!source)
+		return;
+	if(index->scene_count == index->scene_capacity)
+	{
+		index->scene_capacity = index->scene_capacity ? index->scene_capacity * 2 : 16;
+		index->scenes = brealloc(index->scenes, index->scene_capacity * sizeof(obs_weak_source_t*));
+	}
+	index->scenes[index->scene_count++] = obs_source_get_weak_source(source);
+	signal_handler_t *sh = obs_source_get_signal_handler(source);
+	signal_handler_connect(sh, "item_add", replay_progress_invalidate, scan->context);
+	signal_handler_connect(sh, "item_remove", replay_progress_invalidate, scan->context);
+	obs_scene_enum_items(scene, EnumSceneItem, scan);
+}
+
 static bool EnumScenesItems(void *data, obs_source_t *source)
 {
-	obs_scene_t *scene = obs_scene_from_source(source);
-	obs_scene_enum_items(scene, EnumSceneItem, data);
+	replay_progress_add_scene(data, obs_scene_from_source(source));
 	return true;
 }
 
+/* Crops the progress source to the position t of the current replay. The
+ * scene items that show it are only searched again after items were added
+ * or removed, and their crop is only set when it changes. */
 static void replay_update_progress_crop(struct replay_source* context, uint64_t t)
 {
-	if(context->progress_source_name)
+	pthread_mutex_lock(&context->progress_mutex);
+	if(!context->progress_source_name || !*context->progress_source_name)
 	{
-		obs_source_t *s = obs_get_source_by_name(context->progress_source_name);
-		if(s)
+		pthread_mutex_unlock(&context->progress_mutex);
+		return;
+	}
+	struct replay_progress_index *index = &context->progress;
+	obs_source_t *s = index->source ? obs_weak_source_get_source(index->source) : NULL;
+	if(!s)
+	{
+		s = obs_get_source_by_name(context->progress_source_name);
+		if(!s)
+		{
+			pthread_mutex_unlock(&context->progress_mutex);
+			return;
+		}
+		replay_progress_clear(context);
+		obs_weak_source_release(index->source);
+		index->source = obs_source_get_weak_source(s);
+	}
+
+	/* the signals can not take progress_mutex, they only bump the
+	 * generation, scan once more when it moved during the scan */
+	for(int tries = 0; tries < 2; tries++)
+	{
+		const long generation = os_atomic_load_long(&index->generation);
+		if(index->valid && index->indexed == generation)
+			break;
+		replay_progress_clear(context);
+		struct replay_progress_scan scan = {context, s};
+		obs_enum_scenes(EnumScenesItems, &scan);
+		index->indexed = generation;
+		index->valid = true;
+		index->crop_set = false;
+	}
+
+	const uint32_t width = obs_source_get_base_width(s);
+	if(width)
+	{
+		uint32_t crop_width = width;
+		if(t && context->current_replay.last_frame_timestamp && context->current_replay.duration){
+			crop_width = (context->current_replay.last_frame_timestamp - t) * width / context->current_replay.duration;
+		}
+		if(!index->crop_set || index->crop != crop_width)
 		{
-			const uint32_t width = obs_source_get_base_width(s);
-			if(width)
+			for(size_t i = 0; i < index->item_count; i++)
 			{
-				struct siu siu;
-				siu.source = s;
-				if(t && context->current_replay.last_frame_timestamp && context->current_replay.duration){
-					siu.crop_width = (context->current_replay.last_frame_timestamp - t) * width / context->current_replay.duration;
-				}else
-				{
-					siu.crop_width = width;
-				}
-				obs_enum_scenes(EnumScenesItems,&siu);
+				/* the index holds a reference, a removed item is
+				 * still valid but no longer cropped */
+				if(os_atomic_load_bool(&index->items[i]->removed))
+					continue;
+				struct obs_sceneitem_crop crop;
+				obs_sceneitem_get_crop(index->items[i],&crop);
+				crop.left = 0;
+				crop.right = crop_width;
+				obs_sceneitem_set_crop(index->items[i], &crop);
 			}
-			obs_source_release(s);
+			index->crop = crop_width;
+			index->crop_set = true;
 		}
 	}
+	obs_source_release(s);
+	pthread_mutex_unlock(&context->progress_mutex);
 }
 
 static const char *replay_source_get_name(void *unused)
@@ -367,6 +696,42 @@ static void EnumAudioVideoFilter(obs_source_t *source, obs_source_t *filter, voi
 		c->source_audio_filter = filter;
 }
 
+/* replay filter looked up without touching the context, the match is
+ * referenced. Audio accepts the video filters too, like EnumAudioVideoFilter. */
+struct replay_filter_search
+{
+	const char *name;
+	bool audio;
+	obs_source_t *filter;
+};
+
+static void EnumReplayFilter(obs_source_t *source, obs_source_t *filter, void *data)
+{
+	struct replay_filter_search *search = data;
+	const char *id = obs_source_get_id(filter);
+	if (search->filter || strcmp(obs_source_get_name(filter), search->name) != 0)
+		return;
+	if ((search->audio && strcmp(REPLAY_FILTER_AUDIO_ID, id) == 0) ||
+			strcmp(REPLAY_FILTER_ASYNC_ID, id) == 0 || strcmp(REPLAY_FILTER_ID, id) == 0)
+	{
+		obs_source_addref(filter);
+		search->filter = filter;
+	}
+}
+
+/* the replay filter of the source with the name, released by the caller */
+static obs_source_t *replay_find_filter(struct replay_source *c, const char *source_name,
+		bool audio)
+{
+	struct replay_filter_search search = {obs_source_get_name(c->source), audio, NULL};
+	obs_source_t *s = source_name ? obs_get_source_by_name(source_name) : NULL;
+	if(!s)
+		return NULL;
+	obs_source_enum_filters(s, EnumReplayFilter, &search);
+	obs_source_release(s);
+	return search.filter;
+}
+
 static void replay_reverse_hotkey(void *data, obs_hotkey_id id,
 		obs_hotkey_t *hotkey, bool pressed)
 {
@@ -505,6 +870,8 @@ static void replay_update_position(struct replay_source *c, bool lock){
 	memcpy(&c->current_replay, circlebuf_data(&c->replays, c->replay_position*sizeof c->current_replay), sizeof c->current_replay);
 	c->video_frame_position = 0;
 	c->audio_frame_position = 0;
+	c->audio_backward = false;
+	c->audio_seek = false;
 	c->start_timestamp = obs_get_video_frame_time();
 	c->backward = c->backward_start;
 	if(!c->backward && c->current_replay.trim_front != 0){
@@ -540,6 +907,279 @@ static void replay_update_position(struct replay_source *c, bool lock){
 	replay_update_text(c);
 }
 
+/* decompresses frame into dst, which is created when it does not fit */
+static bool replay_frame_cache_decode(struct obs_source_frame **dst,
+		const struct obs_source_frame *frame, uint64_t *time)
+{
+	if(*dst && ((*dst)->format != frame->format ||
+			(*dst)->width != frame->width ||
+			(*dst)->height != frame->height))
+	{
+		obs_source_frame_destroy(*dst);
+		*dst = NULL;
+	}
+	if(!*dst)
+		*dst = obs_source_frame_create(frame->format, frame->width, frame->height);
+
+	const uint64_t start = os_gettime_ns();
+	const bool ok = replay_frame_decompress(*dst, frame);
+	*time = os_gettime_ns() - start;
+	return ok;
+}
+
+/* the slot that is needed first of the ones still to decompress */
+static struct replay_decoded *replay_frame_cache_next(struct replay_frame_cache *cache)
+{
+	struct replay_decoded *next = NULL;
+	for(size_t i = 0; i < REPLAY_DECODE_AHEAD; i++)
+	{
+		struct replay_decoded *slot = cache->ahead + i;
+		if(slot->source && !slot->ready && !slot->busy &&
+				(!next || slot->order < next->order))
+			next = slot;
+	}
+	return next;
+}
+
+static void *replay_frame_cache_thread(void *data)
+{
+	struct replay_frame_cache *cache = data;
+	os_set_thread_name("replay_source: decode");
+
+	pthread_mutex_lock(&cache->mutex);
+	for(;;)
+	{
+		struct replay_decoded *slot = NULL;
+		while(!cache->stop && !(slot = replay_frame_cache_next(cache)))
+			pthread_cond_wait(&cache->cond, &cache->mutex);
+		if(cache->stop)
+			break;
+
+		slot->busy = true;
+		struct obs_source_frame *frame = slot->frame;
+		pthread_mutex_unlock(&cache->mutex);
+
+		uint64_t time;
+		const bool ok = replay_frame_cache_decode(&frame, slot->source, &time);
+
+		pthread_mutex_lock(&cache->mutex);
+		if(ok)
+		{
+			cache->count++;
+			cache->time += time;
+		}
+		slot->frame = frame;
+		slot->busy = false;
+		slot->ready = ok;
+		if(!ok)
+		{
+			replay_frame_release(slot->source);
+			slot->source = NULL;
+		}
+		pthread_cond_broadcast(&cache->cond);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return NULL;
+}
+
+/* Has the thread of the cache decompress frames, in the order they are
+ * needed. Slots of frames that are no longer wanted are reused. */
+static void replay_frame_cache_prefetch(struct replay_frame_cache *cache,
+		struct obs_source_frame **frames, size_t count)
+{
+	if(!count || !replay_frame_is_compressed(frames[0]))
+		return;
+	if(!cache->thread_active)
+	{
+		cache->stop = false;
+		if(pthread_create(&cache->thread, NULL, replay_frame_cache_thread, cache) != 0)
+			return;
+		cache->thread_active = true;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	for(size_t i = 0; i < REPLAY_DECODE_AHEAD; i++)
+	{
+		struct replay_decoded *slot = cache->ahead + i;
+		slot->wanted = false;
+		for(size_t j = 0; j < count && slot->source; j++)
+		{
+			if(slot->source == frames[j])
+			{
+				slot->wanted = true;
+				slot->order = j;
+			}
+		}
+	}
+	for(size_t j = 0; j < count; j++)
+	{
+		if(frames[j] == cache->source || !replay_frame_is_compressed(frames[j]))
+			continue;
+		struct replay_decoded *free_slot = NULL;
+		bool found = false;
+		for(size_t i = 0; i < REPLAY_DECODE_AHEAD && !found; i++)
+		{
+			struct replay_decoded *slot = cache->ahead + i;
+			found = slot->source == frames[j];
+			if(!slot->wanted && !slot->busy && !free_slot)
+				free_slot = slot;
+		}
+		if(found || !free_slot)
+			continue;
+		if(free_slot->source)
+			replay_frame_release(free_slot->source);
+		os_atomic_inc_long(&frames[j]->refs);
+		free_slot->source = frames[j];
+		free_slot->ready = false;
+		free_slot->wanted = true;
+		free_slot->order = j;
+	}
+	pthread_cond_signal(&cache->cond);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/* releases the frames that were decompressed ahead, busy ones stay */
+static void replay_frame_cache_clear(struct replay_frame_cache *cache)
+{
+	if(!cache->thread_active)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	for(size_t i = 0; i < REPLAY_DECODE_AHEAD; i++)
+	{
+		struct replay_decoded *slot = cache->ahead + i;
+		if(slot->source && !slot->busy)
+		{
+			replay_frame_release(slot->source);
+			slot->source = NULL;
+			slot->ready = false;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static struct obs_source_frame *replay_frame_cache_get(struct replay_frame_cache *cache,
+		struct obs_source_frame *frame)
+{
+	if(!replay_frame_is_compressed(frame))
+		return frame;
+	if(cache->source == frame)
+		return cache->frame;
+
+	if(cache->thread_active)
+	{
+		bool taken = false;
+		pthread_mutex_lock(&cache->mutex);
+		for(size_t i = 0; i < REPLAY_DECODE_AHEAD && !taken; i++)
+		{
+			struct replay_decoded *slot = cache->ahead + i;
+			if(slot->source != frame)
+				continue;
+			while(slot->busy)
+				pthread_cond_wait(&cache->cond, &cache->mutex);
+			if(slot->ready && slot->source == frame)
+			{
+				/* swap the buffers, the slot gets the old one */
+				struct obs_source_frame *decoded = slot->frame;
+				slot->frame = cache->frame;
+				cache->frame = decoded;
+				replay_frame_release(slot->source);
+				slot->source = NULL;
+				slot->ready = false;
+				cache->ahead_hits++;
+				taken = true;
+			}
+		}
+		pthread_mutex_unlock(&cache->mutex);
+		if(taken)
+		{
+			cache->source = frame;
+			return cache->frame;
+		}
+	}
+
+	uint64_t time;
+	if(replay_frame_cache_decode(&cache->frame, frame, &time))
+	{
+		cache->source = frame;
+		pthread_mutex_lock(&cache->mutex);
+		cache->count++;
+		cache->time += time;
+		pthread_mutex_unlock(&cache->mutex);
+	}
+	return cache->frame;
+}
+
+static void replay_frame_cache_free(struct replay_frame_cache *cache,
+		struct replay_source *context)
+{
+	if(cache->thread_active)
+	{
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_broadcast(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+		pthread_join(cache->thread, NULL);
+		cache->thread_active = false;
+	}
+	for(size_t i = 0; i < REPLAY_DECODE_AHEAD; i++)
+	{
+		struct replay_decoded *slot = cache->ahead + i;
+		if(slot->source)
+			replay_frame_release(slot->source);
+		if(slot->frame)
+			obs_source_frame_destroy(slot->frame);
+		memset(slot, 0, sizeof(struct replay_decoded));
+	}
+
+	if(cache->count)
+		blog(LOG_INFO, "[replay_source: '%s'] decompressed %llu frames in %.2f ms per frame, %llu ahead of playback",
+				obs_source_get_name(context->source),
+				(unsigned long long)cache->count,
+				cache->time / 1000000.0 / cache->count,
+				(unsigned long long)cache->ahead_hits);
+	if(cache->frame)
+		obs_source_frame_destroy(cache->frame);
+	cache->frame = NULL;
+	cache->source = NULL;
+}
+
+static void replay_jitter_add(struct replay_jitter *jitter, uint64_t timestamp, uint64_t due)
+{
+	const uint64_t late = timestamp > due ? timestamp - due : 0;
+	size_t bucket = 0;
+	while(bucket + 1 < REPLAY_JITTER_BUCKETS && late >= (250000ULL << bucket))
+		bucket++;
+	jitter->buckets[bucket]++;
+	jitter->count++;
+	if(late > jitter->max)
+		jitter->max = late;
+}
+
+static void replay_jitter_log(struct replay_jitter *jitter, struct replay_source *context, const char *mode)
+{
+	if(jitter->count){
+		struct dstr buckets = {0};
+		for(size_t i = 0; i < REPLAY_JITTER_BUCKETS; i++)
+			dstr_catf(&buckets, " %s%.2f ms: %.1f%%", i + 1 < REPLAY_JITTER_BUCKETS ? "<" : ">=",
+					(250000ULL << (i + 1 < REPLAY_JITTER_BUCKETS ? i : i - 1)) / 1000000.0,
+					jitter->buckets[i] * 100.0 / jitter->count);
+		blog(LOG_INFO, "[replay_source: '%s'] %s frame lateness over %llu frames, max %.2f ms,%s",
+				obs_source_get_name(context->source), mode,
+				(unsigned long long)jitter->count, jitter->max / 1000000.0,
+				buckets.array);
+		dstr_free(&buckets);
+	}
+	memset(jitter, 0, sizeof(struct replay_jitter));
+}
+
+static void replay_audio_reverse_free(struct replay_audio_reverse *reverse)
+{
+	for(size_t i = 0; i < MAX_AV_PLANES; i++)
+		bfree(reverse->data[i]);
+	bfree(reverse->frames);
+	memset(reverse, 0, sizeof(struct replay_audio_reverse));
+}
+
 static void replay_free_replay(struct replay* replay, struct replay_source *context)
 {
 	if(replay == &context->saving_replay)
@@ -551,13 +1191,18 @@ static void replay_free_replay(struct replay* replay, struct replay_source *cont
 		context->free_after_save = true;
 		return;
 	}
+	context->play_cache.source = NULL;
+	context->save_cache.source = NULL;
+	replay_frame_cache_clear(&context->play_cache);
+	if(replay->audio_frames){
+		pthread_mutex_lock(&context->audio_mutex);
+		if(context->audio_reverse.source == replay->audio_frames)
+			replay_audio_reverse_free(&context->audio_reverse);
+		pthread_mutex_unlock(&context->audio_mutex);
+	}
 	for(uint64_t i = 0; i < replay->video_frame_count; i++)
 	{
-		struct obs_source_frame* frame = replay->video_frames[i];
-		if (frame && os_atomic_dec_long(&frame->refs) <= 0) {
-			obs_source_frame_destroy(frame);
-			frame = NULL;
-		}
+		replay_frame_release(replay->video_frames[i]);
 	}
 	replay->video_frame_count = 0;
 	if(replay->video_frames){
@@ -565,15 +1210,39 @@ static void replay_free_replay(struct replay* replay, struct replay_source *cont
 		replay->video_frames = NULL;
 	}
 
-	for(uint64_t i = 0; i < replay->audio_frame_count; i++)
+	/* the packets point into one block of samples per channel */
+	for(size_t i = 0; i < MAX_AV_PLANES; i++)
 	{
-		free_audio_packet(&replay->audio_frames[i]);
+		bfree(replay->audio_data[i]);
+		replay->audio_data[i] = NULL;
 	}
 	replay->audio_frame_count = 0;
 	if(replay->audio_frames){
 		bfree(replay->audio_frames);
 		replay->audio_frames = NULL;
 	}
+	bfree(replay->video_timestamps);
+	replay->video_timestamps = NULL;
+	bfree(replay->audio_timestamps);
+	replay->audio_timestamps = NULL;
+}
+
+/* first index with a timestamp not before timestamp, count if there is none */
+static uint64_t replay_lower_bound(const uint64_t *timestamps, uint64_t count, uint64_t timestamp)
+{
+	uint64_t low = 0;
+	while(count)
+	{
+		const uint64_t half = count / 2;
+		if(timestamps[low + half] < timestamp)
+		{
+			low += half + 1;
+			count -= half + 1;
+		}else{
+			count = half;
+		}
+	}
+	return low;
 }
 static void replay_purge_replays(struct replay_source *context)
 {
@@ -594,7 +1263,18 @@ static void replay_purge_replays(struct replay_source *context)
 		pthread_mutex_unlock(&context->replay_mutex);
 	}
 }
-void replay_retrieve(struct replay_source *c);
+static void replay_queue_retrieve(struct replay_source *c, uint64_t from,
+		uint64_t to, void (*done)(void *param, bool loaded), void *param);
+static void replay_start_playback_thread(struct replay_source *context);
+static void replay_stop_playback_thread(struct replay_source *context);
+
+/* a trigger that found nothing to load should not block the next one */
+static void replay_threshold_retrieved(void *data, bool loaded)
+{
+	struct replay_source *context = data;
+	if(!loaded)
+		context->threshold_timestamp = 0;
+}
 
 void replay_trigger_threshold(void *data)
 {
@@ -612,7 +1292,7 @@ void replay_trigger_threshold(void *data)
 	{
 		context->retrieve_timestamp = obs_get_video_frame_time() + context->retrieve_delay;
 	}else{
-		replay_retrieve(context);
+		replay_queue_retrieve(context, 0, UINT64_MAX, replay_threshold_retrieved, context);
 	}
 }
 
@@ -635,12 +1315,16 @@ static void replay_source_update(void *data, obs_data_t *settings)
 				obs_source_release(s);
 			}
 			if(strcmp(context->source_name, source_name) != 0){
+				pthread_mutex_lock(&context->video_mutex);
 				bfree(context->source_name);
 				context->source_name = bstrdup(source_name);
+				pthread_mutex_unlock(&context->video_mutex);
 			}
 		}
 	}else{
+		pthread_mutex_lock(&context->video_mutex);
 		context->source_name = bstrdup(source_name);
+		pthread_mutex_unlock(&context->video_mutex);
 	}
 	const char *source_audio_name = obs_data_get_string(settings, SETTING_SOURCE_AUDIO);
 	if (context->source_audio_name){
@@ -658,12 +1342,16 @@ static void replay_source_update(void *data, obs_data_t *settings)
 				obs_source_release(s);
 			}
 			if(strcmp(context->source_audio_name, source_audio_name) != 0){
+				pthread_mutex_lock(&context->video_mutex);
 				bfree(context->source_audio_name);
 				context->source_audio_name = bstrdup(source_audio_name);
+				pthread_mutex_unlock(&context->video_mutex);
 			}
 		}
 	}else{
+		pthread_mutex_lock(&context->video_mutex);
 		context->source_audio_name = bstrdup(source_audio_name);
+		pthread_mutex_unlock(&context->video_mutex);
 	}
 	const char *next_scene_name = obs_data_get_string(settings, "next_scene");
 	if (context->next_scene_name){
@@ -679,6 +1367,9 @@ static void replay_source_update(void *data, obs_data_t *settings)
 	context->end_action = (int)obs_data_get_int(settings, SETTING_END_ACTION);
 	context->start_delay = obs_data_get_int(settings,SETTING_START_DELAY)*1000000;
 	context->retrieve_delay = obs_data_get_int(settings,SETTING_RETRIEVE_DELAY)*1000000;
+	context->snapshot = obs_data_get_bool(settings, SETTING_SNAPSHOT);
+	context->range_start = (uint64_t)obs_data_get_int(settings, SETTING_RANGE_START) * MSEC_TO_NSEC;
+	context->range_end = (uint64_t)obs_data_get_int(settings, SETTING_RANGE_END) * MSEC_TO_NSEC;
 
 	context->replay_max = (int)obs_data_get_int(settings, SETTING_REPLAYS);
 	replay_purge_replays(context);
@@ -686,6 +1377,7 @@ static void replay_source_update(void *data, obs_data_t *settings)
 	context->speed_percent = obs_data_get_double(settings, SETTING_SPEED);
 	if (context->speed_percent < SETTING_SPEED_MIN  || context->speed_percent > SETTING_SPEED_MAX)
 		context->speed_percent = 100.0f;
+	context->preserve_pitch = obs_data_get_bool(settings, SETTING_PRESERVE_PITCH);
 
 	context->backward_start = obs_data_get_bool(settings, SETTING_BACKWARD);
 	if(context->backward != context->backward_start)
@@ -693,6 +1385,11 @@ static void replay_source_update(void *data, obs_data_t *settings)
 		replay_reverse_hotkey(context, 0, NULL, true);
 	}
 	context->sound_trigger = obs_data_get_bool(settings, SETTING_SOUND_TRIGGER);
+	const bool playback_thread = obs_data_get_bool(settings, SETTING_PLAYBACK_THREAD);
+	if(playback_thread && !context->playback_active)
+		replay_start_playback_thread(context);
+	else if(!playback_thread && context->playback_active)
+		replay_stop_playback_thread(context);
 	if(!context->disabled){
 		
 		obs_source_t *s = obs_get_source_by_name(context->source_name);
@@ -716,8 +1413,11 @@ static void replay_source_update(void *data, obs_data_t *settings)
 				obs_source_update(context->source_filter, settings);
 			}
 
-			((struct replay_filter*)context->source_filter->context.data)->threshold_data = data;
-			((struct replay_filter*)context->source_filter->context.data)->trigger_threshold = context->sound_trigger?replay_trigger_threshold:NULL;
+			if(context->source_filter){
+				struct replay_filter *filter = context->source_filter->context.data;
+				filter->threshold_data = data;
+				filter->trigger_threshold = context->sound_trigger?replay_trigger_threshold:NULL;
+			}
 			context->filter_loaded = true;
 			obs_source_release(s);
 		}
@@ -737,8 +1437,11 @@ static void replay_source_update(void *data, obs_data_t *settings)
 			}else{
 				obs_source_update(context->source_audio_filter, settings);
 			}
-			((struct replay_filter*)context->source_audio_filter->context.data)->threshold_data = data;
-			((struct replay_filter*)context->source_audio_filter->context.data)->trigger_threshold = context->sound_trigger?replay_trigger_threshold:NULL;
+			if(context->source_audio_filter){
+				struct replay_filter *filter = context->source_audio_filter->context.data;
+				filter->threshold_data = data;
+				filter->trigger_threshold = context->sound_trigger?replay_trigger_threshold:NULL;
+			}
 			context->filter_loaded = true;
 			obs_source_release(s);
 		}
@@ -754,6 +1457,7 @@ static void replay_source_update(void *data, obs_data_t *settings)
 	}else{
 		context->file_format = bstrdup(file_format);
 	}
+	pthread_mutex_lock(&context->progress_mutex);
 	const char *progress_source = obs_data_get_string(settings, SETTING_PROGRESS_SOURCE);
 	if(context->progress_source_name)
 	{
@@ -761,11 +1465,14 @@ static void replay_source_update(void *data, obs_data_t *settings)
 		{
 			bfree(context->progress_source_name);
 			context->progress_source_name = bstrdup(progress_source);
+			replay_progress_free(context);
 		}
 	}else{
 		context->progress_source_name = bstrdup(progress_source);
 	}
+	pthread_mutex_unlock(&context->progress_mutex);
 
+	pthread_mutex_lock(&context->text_mutex);
 	const char *text_source = obs_data_get_string(settings, SETTING_TEXT_SOURCE);
 	if(context->text_source_name)
 	{
@@ -773,6 +1480,10 @@ static void replay_source_update(void *data, obs_data_t *settings)
 		{
 			bfree(context->text_source_name);
 			context->text_source_name = bstrdup(text_source);
+			obs_weak_source_release(context->text_source);
+			context->text_source = NULL;
+			context->text_lookup_timestamp = 0;
+			context->text_update_timestamp = 0;
 		}
 	}else{
 		context->text_source_name = bstrdup(text_source);
@@ -785,10 +1496,14 @@ static void replay_source_update(void *data, obs_data_t *settings)
 		{
 			bfree(context->text_format);
 			context->text_format = bstrdup(text);
+			replay_compile_text(context);
+			context->text_update_timestamp = 0;
 		}
 	}else{
 		context->text_format = bstrdup(text);
+		replay_compile_text(context);
 	}
+	pthread_mutex_unlock(&context->text_mutex);
 
 	context->lossless = obs_data_get_bool(settings, SETTING_LOSSLESS);
 	const char *directory = obs_data_get_string(settings, SETTING_DIRECTORY);
@@ -809,13 +1524,17 @@ static void replay_source_defaults(obs_data_t *settings)
 {
 	obs_data_set_default_int(settings, SETTING_DURATION, 5000);
 	obs_data_set_default_int(settings, SETTING_REPLAYS, 1);
+	obs_data_set_default_int(settings, SETTING_RANGE_START, 5000);
 	obs_data_set_default_int(settings, SETTING_SPEED, 100);
+	obs_data_set_default_bool(settings, SETTING_PRESERVE_PITCH, false);
+	obs_data_set_default_bool(settings, SETTING_PLAYBACK_THREAD, false);
 	obs_data_set_default_int(settings, SETTING_VISIBILITY_ACTION, VISIBILITY_ACTION_CONTINUE);
 	obs_data_set_default_int(settings, SETTING_START_DELAY, 0);
 	obs_data_set_default_int(settings, SETTING_END_ACTION, END_ACTION_LOOP);
 	obs_data_set_default_bool(settings, SETTING_BACKWARD, false);
 	obs_data_set_default_string(settings, SETTING_FILE_FORMAT, "%CCYY-%MM-%DD %hh.%mm.%ss");
 	obs_data_set_default_bool(settings, SETTING_LOSSLESS, false);
+	obs_data_set_default_int(settings, SETTING_CAPTURE_FORMAT, VIDEO_FORMAT_BGRA);
 }
 
 static void replay_source_show(void *data)
@@ -970,19 +1689,8 @@ bool audio_input_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 	uint64_t i = 0;
 	uint64_t duration_start = start_ts_in - context->start_save_timestamp;
 	uint64_t duration_end = end_ts_in - context->start_save_timestamp; 
-	while(i < context->saving_replay.audio_frame_count && context->saving_replay.audio_frames[i].timestamp < context->saving_replay.first_frame_timestamp)
-	{
-		i++;
-	}
-	if(i == context->saving_replay.audio_frame_count){
-		pthread_mutex_unlock(&context->audio_mutex);
-		return true;
-	}
-	
-	while(i < context->saving_replay.audio_frame_count && context->saving_replay.audio_frames[i].timestamp - context->saving_replay.first_frame_timestamp < duration_start)
-	{
-		i++;
-	}
+	i = replay_lower_bound(context->saving_replay.audio_timestamps, context->saving_replay.audio_frame_count,
+			context->saving_replay.first_frame_timestamp + duration_start);
 	if(i == context->saving_replay.audio_frame_count){
 		pthread_mutex_unlock(&context->audio_mutex);
 		return true;
@@ -1052,7 +1760,9 @@ void replay_save(struct replay_source *context)
 
 	const uint32_t width = context->saving_replay.video_frames[0]->width;
 	const uint32_t height = context->saving_replay.video_frames[0]->height;
-	if (context->known_width != width || context->known_height != height) {
+	const enum video_format format = context->saving_replay.video_frames[0]->format;
+	if (context->known_width != width || context->known_height != height ||
+			context->known_format != format) {
 		video_t* t = obs_get_video();
 		const struct video_output_info* ovi = video_output_get_info(t);
 		
@@ -1081,6 +1791,7 @@ void replay_save(struct replay_source *context)
 
 		context->known_width = width;
 		context->known_height = height;
+		context->known_format = format;
 
 		if(context->scaler)
 		{
@@ -1155,6 +1866,7 @@ void replay_save(struct replay_source *context)
 	struct video_frame output_frame;
 	if (video_output_lock_frame(context->video_output, &output_frame, 1, context->start_save_timestamp))
 	{
+		frame = replay_frame_cache_get(&context->save_cache, frame);
 		video_scaler_scale(context->scaler, output_frame.data, output_frame.linesize, frame->data,frame->linesize);
 		video_output_unlock_frame(context->video_output);
 	}
@@ -1172,33 +1884,73 @@ void replay_save(struct replay_source *context)
 	context->saving_status = SAVING_STATUS_SAVING;
 }
 
-static void replay_retrieve(struct replay_source *c)
+/* Moves the frames of a filter ring with a timestamp from from to to into
+ * the replay, older frames are released. For a snapshot the frames are
+ * referenced instead and stay in the ring. Called with spill_mutex held so
+ * the worker thread can not release frames meanwhile. */
+static void replay_retrieve_frames(struct replay* replay, struct replay_filter *filter,
+		struct replay_ring *frames, uint64_t from, uint64_t to, bool snapshot, uint64_t max)
 {
+	const size_t key = offsetof(struct replay_video_entry, timestamp);
+	struct replay_video_entry entry;
+	unsigned long index;
 
-	obs_source_t *s = obs_get_source_by_name(c->source_name);
-	c->source_filter = NULL;
-	if(s){
-		obs_source_enum_filters(s, EnumFilter, c);
+	if(!replay_ring_peek_front(frames, &entry, &index))
+		return;
+	const unsigned long begin = from ? replay_ring_lower_bound(frames, key, from) : index;
+	const unsigned long end = to < UINT64_MAX ? replay_ring_lower_bound(frames, key, to + 1) :
+			index + (unsigned long)replay_ring_count(frames);
+	if(!snapshot)
+	{
+		for(; index != begin && replay_ring_peek(frames, index, &entry); index++)
+		{
+			replay_ring_take(frames, index);
+			replay_filter_frame_release(filter, entry.frame);
+		}
 	}
-	obs_source_t *as = obs_get_source_by_name(c->source_audio_name);
-	c->source_audio_filter = NULL;
-	if(as){
-		obs_source_enum_filters(as, EnumAudioVideoFilter, c);
+	for(index = begin; (long)(end - index) > 0 && replay->video_frame_count < max &&
+			replay_ring_peek(frames, index, &entry); index++)
+	{
+		if(snapshot)
+			os_atomic_inc_long(&entry.frame->refs);
+		else
+			replay_ring_take(frames, index);
+		if(!replay->video_frame_count)
+			replay->first_frame_timestamp = entry.timestamp;
+		replay->last_frame_timestamp = entry.timestamp;
+		replay->video_timestamps[replay->video_frame_count] = entry.timestamp;
+		replay->video_frames[replay->video_frame_count++] = entry.frame;
 	}
+}
 
-	struct replay_filter* vf = c->source_filter?c->source_filter->context.data:NULL;
-	struct replay_filter* af = c->source_audio_filter?c->source_audio_filter->context.data:vf;
-	if(vf && vf->video_frames.size == 0)
+/* Retrieves the frames with a timestamp from from to to, 0 and UINT64_MAX
+ * retrieve the whole buffer. */
+static bool replay_retrieve(struct replay_source *c, uint64_t from, uint64_t to)
+{
+	/* the names are replaced by update under video_mutex, the filters
+	 * are referenced so they stay valid when update removes them */
+	pthread_mutex_lock(&c->video_mutex);
+	char *source_name = bstrdup(c->source_name);
+	char *source_audio_name = bstrdup(c->source_audio_name);
+	pthread_mutex_unlock(&c->video_mutex);
+	obs_source_t *video_filter = replay_find_filter(c, source_name, false);
+	obs_source_t *audio_filter = replay_find_filter(c, source_audio_name, true);
+	bfree(source_name);
+	bfree(source_audio_name);
+
+	struct replay_filter* vf = video_filter?video_filter->context.data:NULL;
+	struct replay_filter* af = audio_filter?audio_filter->context.data:vf;
+	if(vf)
+		replay_filter_flush_video(vf);
+	if(vf && replay_ring_count(&vf->video_frames) == 0 && replay_ring_count(&vf->spilled_frames) == 0)
 		vf = NULL;
-	if(af && af->audio_frames.size == 0)
+	if(af && replay_ring_count(&af->audio_packets) == 0)
 		af = NULL;
 
 	if(!vf && !af){
-		if(s)
-			obs_source_release(s);
-		if(as)
-			obs_source_release(as);
-		return;
+		obs_source_release(video_filter);
+		obs_source_release(audio_filter);
+		return false;
 	}
 	
 	struct replay new_replay;
@@ -1207,66 +1959,53 @@ static void replay_retrieve(struct replay_source *c)
 	new_replay.trim_end = 0;
 	new_replay.trim_front = 0;
 	if(vf){
-		struct obs_source_frame *frame;
-		pthread_mutex_lock(&vf->mutex);
-		if(vf->video_frames.size){
-			circlebuf_peek_front(&vf->video_frames, &frame, sizeof(struct obs_source_frame*));
-			new_replay.first_frame_timestamp = frame->timestamp;
-			new_replay.last_frame_timestamp = frame->timestamp;
-		}
-		new_replay.video_frame_count = vf->video_frames.size/sizeof(struct obs_source_frame*);
-		new_replay.video_frames = bzalloc(new_replay.video_frame_count * sizeof(struct obs_source_frame*));
-		for(uint64_t i = 0; i < new_replay.video_frame_count; i++)
-		{
-			circlebuf_pop_front(&vf->video_frames, &frame, sizeof(struct obs_source_frame*));
-			new_replay.last_frame_timestamp = frame->timestamp;
-			*(new_replay.video_frames + i) = frame;
-		}
-		pthread_mutex_unlock(&vf->mutex);
+		/* capture keeps pushing while the frames are taken out, only
+		 * what was there when the retrieve started is taken */
+		pthread_mutex_lock(&vf->spill_mutex);
+		const uint64_t spilled_count = replay_ring_count(&vf->spilled_frames);
+		const uint64_t count = spilled_count + replay_ring_count(&vf->video_frames);
+		new_replay.video_frames = bzalloc(count * sizeof(struct obs_source_frame*));
+		new_replay.video_timestamps = bzalloc(count * sizeof(uint64_t));
+		new_replay.video_frame_count = 0;
+		/* with a snapshot the frames are shared with the filter and the
+		 * replays retrieved before, nothing is copied */
+		replay_retrieve_frames(&new_replay, vf, &vf->spilled_frames, from, to, c->snapshot, count);
+		replay_retrieve_frames(&new_replay, vf, &vf->video_frames, from, to, c->snapshot, count);
+		pthread_mutex_unlock(&vf->spill_mutex);
 	}
 	else
 	{
 		new_replay.video_frames = NULL;
+		new_replay.video_timestamps = NULL;
 		new_replay.video_frame_count = 0;
 	}
+	new_replay.audio_frames = NULL;
+	new_replay.audio_frame_count = 0;
+	memset(new_replay.audio_data, 0, sizeof(new_replay.audio_data));
 	if(af){
-		struct obs_audio_info info;
-		obs_get_audio_info(&info);
-		pthread_mutex_lock(&af->mutex);
-		struct obs_audio_data audio;
-		if (!vf && af->audio_frames.size)
-		{
-			circlebuf_peek_front(&af->audio_frames, &audio, sizeof(struct obs_audio_data));
-			new_replay.first_frame_timestamp = audio.timestamp;
-			new_replay.last_frame_timestamp = audio.timestamp;
-		}
-		new_replay.audio_frame_count = af->audio_frames.size/sizeof(struct obs_audio_data);
-		new_replay.audio_frames = bzalloc(new_replay.audio_frame_count * sizeof(struct obs_audio_data));
-		for(uint64_t i = 0; i < new_replay.audio_frame_count; i++)
-		{
-			circlebuf_pop_front(&af->audio_frames, &audio, sizeof(struct obs_audio_data));
-			if(!vf){
-				new_replay.last_frame_timestamp = audio.timestamp;
-			}
-			memcpy(&new_replay.audio_frames[i], &audio, sizeof(struct obs_audio_data));
-			for (size_t j = 0; j < MAX_AV_PLANES; j++) {
-				if (!audio.data[j])
-					break;
-
-				new_replay.audio_frames[i].data[j] = bmemdup(audio.data[j], new_replay.audio_frames[i].frames * sizeof(float));
-			}
-		}
-		pthread_mutex_unlock(&af->mutex);
-	}
-	else
-	{
-		new_replay.audio_frames = NULL;
-		new_replay.audio_frame_count = 0;
-	}
-	if(s)
-		obs_source_release(s);
-	if(as)
-		obs_source_release(as);
+		/* handing the whole buffer over is only possible when all of
+		 * it is taken */
+		if(c->snapshot || from || to < UINT64_MAX)
+			new_replay.audio_frame_count = replay_audio_copy(af, from, to, !c->snapshot,
+					&new_replay.audio_frames, new_replay.audio_data);
+		else
+			new_replay.audio_frame_count = replay_audio_take(af, &new_replay.audio_frames, new_replay.audio_data);
+		if(!new_replay.video_frame_count && new_replay.audio_frame_count){
+			new_replay.first_frame_timestamp = new_replay.audio_frames[0].timestamp;
+			new_replay.last_frame_timestamp = new_replay.audio_frames[new_replay.audio_frame_count - 1].timestamp;
+		}
+	}
+	obs_source_release(video_filter);
+	obs_source_release(audio_filter);
+	if(!new_replay.video_frame_count && !new_replay.audio_frame_count){
+		/* nothing in the requested window */
+		bfree(new_replay.video_frames);
+		bfree(new_replay.video_timestamps);
+		return false;
+	}
+	new_replay.audio_timestamps = bmalloc((new_replay.audio_frame_count + 1) * sizeof(uint64_t));
+	for(uint64_t i = 0; i < new_replay.audio_frame_count; i++)
+		new_replay.audio_timestamps[i] = new_replay.audio_frames[i].timestamp;
 	new_replay.duration = new_replay.last_frame_timestamp - new_replay.first_frame_timestamp;
 
 	if(c->start_delay>0){
@@ -1290,14 +2029,111 @@ static void replay_retrieve(struct replay_source *c)
 		new_replay.trim_front = c->start_delay*-1;
 	}
 
-	pthread_mutex_lock(&c->replay_mutex);
-	circlebuf_push_back(&c->replays, &new_replay, sizeof new_replay);
-	pthread_mutex_unlock(&c->replay_mutex);
-	if(c->replays.size == sizeof new_replay)
-	{
-		replay_update_position(c, true);
+	pthread_mutex_lock(&c->retrieve_mutex);
+	circlebuf_push_back(&c->retrieved_replays, &new_replay, sizeof new_replay);
+	pthread_mutex_unlock(&c->retrieve_mutex);
+	return true;
+}
+
+/* Adds the replays the retrieve thread loaded, on the tick so the current
+ * replay never changes under the tick. */
+static void replay_add_retrieved(struct replay_source *c)
+{
+	struct replay new_replay;
+	for(;;)
+	{
+		pthread_mutex_lock(&c->retrieve_mutex);
+		const bool retrieved = c->retrieved_replays.size != 0;
+		if(retrieved)
+			circlebuf_pop_front(&c->retrieved_replays, &new_replay, sizeof new_replay);
+		pthread_mutex_unlock(&c->retrieve_mutex);
+		if(!retrieved)
+			return;
+
+		pthread_mutex_lock(&c->replay_mutex);
+		circlebuf_push_back(&c->replays, &new_replay, sizeof new_replay);
+		const bool first = c->replays.size == sizeof new_replay;
+		pthread_mutex_unlock(&c->replay_mutex);
+		if(first)
+		{
+			replay_update_position(c, true);
+		}
+		replay_purge_replays(c);
+	}
+}
+
+/* Retrieving takes every buffered frame out of the filters, which must not
+ * happen on the audio thread of the sound trigger or on the thread of a
+ * hotkey, so all retrieves are done by one thread per replay source. */
+static void *replay_retrieve_thread(void *data)
+{
+	struct replay_source *context = data;
+	struct replay_retrieve_request request;
+
+	os_set_thread_name("replay_source: retrieve");
+
+	while (os_sem_wait(context->retrieve_sem) == 0) {
+		if (context->retrieve_stop)
+			break;
+
+		pthread_mutex_lock(&context->retrieve_mutex);
+		const bool queued = context->retrieve_requests.size != 0;
+		if (queued)
+			circlebuf_pop_front(&context->retrieve_requests, &request,
+					sizeof(request));
+		pthread_mutex_unlock(&context->retrieve_mutex);
+		if (!queued)
+			continue;
+
+		const bool loaded = replay_retrieve(context, request.from,
+				request.to);
+		if (request.done)
+			request.done(request.param, loaded);
+	}
+	return NULL;
+}
+
+static void replay_start_retrieve_thread(struct replay_source *context)
+{
+	context->retrieve_stop = false;
+	if (os_sem_init(&context->retrieve_sem, 0) != 0)
+		return;
+	if (pthread_create(&context->retrieve_thread, NULL,
+			replay_retrieve_thread, context) != 0)
+		return;
+	context->retrieve_active = true;
+}
+
+static void replay_stop_retrieve_thread(struct replay_source *context)
+{
+	if (context->retrieve_active) {
+		context->retrieve_stop = true;
+		os_sem_post(context->retrieve_sem);
+		pthread_join(context->retrieve_thread, NULL);
+		context->retrieve_active = false;
 	}
-	replay_purge_replays(c);
+	os_sem_destroy(context->retrieve_sem);
+	context->retrieve_sem = NULL;
+}
+
+/* Queues a retrieve, never blocks on the filters. Retrieves on the calling
+ * thread when the retrieve thread could not be started. */
+static void replay_queue_retrieve(struct replay_source *c, uint64_t from,
+		uint64_t to, void (*done)(void *param, bool loaded), void *param)
+{
+	struct replay_retrieve_request request = {from, to, done, param};
+
+	if (!c->retrieve_active) {
+		const bool loaded = replay_retrieve(c, from, to);
+		if (done)
+			done(param, loaded);
+		return;
+	}
+
+	pthread_mutex_lock(&c->retrieve_mutex);
+	circlebuf_push_back(&c->retrieve_requests, &request, sizeof(request));
+	pthread_mutex_unlock(&c->retrieve_mutex);
+	os_sem_post(c->retrieve_sem);
 }
 
 static void replay_hotkey(void *data, obs_hotkey_id id,
@@ -1314,10 +2150,27 @@ static void replay_hotkey(void *data, obs_hotkey_id id,
 	{
 		c->retrieve_timestamp = obs_get_video_frame_time() + c->retrieve_delay;
 	}else{
-		replay_retrieve(c);
+		replay_queue_retrieve(c, 0, UINT64_MAX, NULL, NULL);
 	}
 }
 
+static void replay_range_hotkey(void *data, obs_hotkey_id id,
+		obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+
+	struct replay_source *c = data;
+	if(!pressed || !c->source_name || c->range_start <= c->range_end)
+		return;
+
+	/* the window is relative to the moment the hotkey was pressed */
+	const uint64_t os_time = obs_get_video_frame_time();
+	const uint64_t from = os_time > c->range_start ? os_time - c->range_start : 0;
+	const uint64_t to = os_time > c->range_end ? os_time - c->range_end : 0;
+	replay_queue_retrieve(c, from, to, NULL, NULL);
+}
+
 static void replay_save_hotkey(void *data, obs_hotkey_id id,
 		obs_hotkey_t *hotkey, bool pressed)
 {
@@ -1530,11 +2383,11 @@ void update_speed(struct replay_source *c, float new_speed)
 		return;
 	if(c->current_replay.video_frame_count)
 	{
-		struct obs_source_frame *peek_frame = c->current_replay.video_frames[c->video_frame_position];
-		uint64_t duration = peek_frame->timestamp - c->current_replay.first_frame_timestamp;
+		const uint64_t timestamp = c->current_replay.video_timestamps[c->video_frame_position];
+		uint64_t duration = timestamp - c->current_replay.first_frame_timestamp;
 		if(c->backward)
 		{
-			duration = c->current_replay.last_frame_timestamp - peek_frame->timestamp;
+			duration = c->current_replay.last_frame_timestamp - timestamp;
 		}
 		const uint64_t old_duration = duration * 100.0 / c->speed_percent;
 		const uint64_t new_duration = duration * 100.0 / new_speed;
@@ -1787,8 +2640,22 @@ static void *replay_source_create(obs_data_t *settings, obs_source_t *source)
 	pthread_mutex_init(&context->video_mutex, NULL);
 	pthread_mutex_init(&context->audio_mutex, NULL);
 	pthread_mutex_init(&context->replay_mutex, NULL);
+	pthread_mutex_init(&context->retrieve_mutex, NULL);
+	pthread_mutex_init(&context->text_mutex, NULL);
+	pthread_mutex_init(&context->progress_mutex, NULL);
+	pthread_mutex_init(&context->play_cache.mutex, NULL);
+	pthread_cond_init(&context->play_cache.cond, NULL);
+	pthread_mutex_init(&context->save_cache.mutex, NULL);
+	pthread_cond_init(&context->save_cache.cond, NULL);
+	/* a new scene or a removed source can change the progress items */
+	signal_handler_connect(obs_get_signal_handler(), "source_create", replay_progress_scene_changed, context);
+	signal_handler_connect(obs_get_signal_handler(), "source_remove", replay_progress_scene_changed, context);
 
 	circlebuf_init(&context->replays);
+	circlebuf_init(&context->retrieve_requests);
+	circlebuf_init(&context->retrieved_replays);
+	context->stretch = replay_stretch_create();
+	replay_start_retrieve_thread(context);
 
 	replay_source_update(context, settings);
 
@@ -1796,6 +2663,11 @@ static void *replay_source_create(obs_data_t *settings, obs_source_t *source)
 			"ReplaySource.Replay",
 			"Load replay",
 			replay_hotkey, context);
+
+	context->range_hotkey = obs_hotkey_register_source(source,
+			"ReplaySource.ReplayRange",
+			"Load partial replay",
+			replay_range_hotkey, context);
 	
 	context->next_hotkey = obs_hotkey_register_source(source,
 			"ReplaySource.Next",
@@ -1944,6 +2816,19 @@ static void replay_source_destroy(void *data)
 {
 	struct replay_source *context = data;
 
+	/* requests still queued are dropped */
+	replay_stop_playback_thread(context);
+	replay_stop_retrieve_thread(context);
+	circlebuf_free(&context->retrieve_requests);
+	while(context->retrieved_replays.size)
+	{
+		struct replay replay;
+		circlebuf_pop_front(&context->retrieved_replays, &replay, sizeof replay);
+		replay_free_replay(&replay, context);
+	}
+	circlebuf_free(&context->retrieved_replays);
+	pthread_mutex_destroy(&context->retrieve_mutex);
+
 	pthread_mutex_lock(&context->video_mutex);
 	pthread_mutex_lock(&context->audio_mutex);
 	context->current_replay.video_frame_count = 0;
@@ -1971,12 +2856,23 @@ static void replay_source_destroy(void *data)
 	if (context->progress_source_name)
 		bfree(context->progress_source_name);
 
+	signal_handler_disconnect(obs_get_signal_handler(), "source_create", replay_progress_scene_changed, context);
+	signal_handler_disconnect(obs_get_signal_handler(), "source_remove", replay_progress_scene_changed, context);
+	replay_progress_free(context);
+	pthread_mutex_destroy(&context->progress_mutex);
+
 	if (context->text_source_name)
 		bfree(context->text_source_name);
 
 	if (context->text_format)
 		bfree(context->text_format);
 
+	bfree(context->text_tokens);
+	obs_weak_source_release(context->text_source);
+	dstr_free(&context->text_buffer);
+	dstr_free(&context->text_shown);
+	pthread_mutex_destroy(&context->text_mutex);
+
 	if(context->h264Recording)
 	{
 		obs_encoder_release(context->h264Recording);
@@ -2016,7 +2912,15 @@ static void replay_source_destroy(void *data)
 		video_scaler_destroy(context->scaler);
 		context->scaler = NULL;
 	}
-
+	replay_frame_cache_free(&context->play_cache, context);
+	replay_frame_cache_free(&context->save_cache, context);
+	pthread_mutex_destroy(&context->play_cache.mutex);
+	pthread_cond_destroy(&context->play_cache.cond);
+	pthread_mutex_destroy(&context->save_cache.mutex);
+	pthread_cond_destroy(&context->save_cache.cond);
+	replay_jitter_log(&context->jitter, context, "render tick");
+	replay_stretch_destroy(context->stretch);
+	replay_audio_reverse_free(&context->audio_reverse);
 
 	pthread_mutex_destroy(&context->video_mutex);
 	pthread_mutex_destroy(&context->audio_mutex);
@@ -2025,27 +2929,120 @@ static void replay_source_destroy(void *data)
 }
 
 
+static inline bool replay_stretch_audio(struct replay_source *context)
+{
+	return context->speed_percent != 100.0f && context->preserve_pitch;
+}
+
+/* audio is handed to the time stretch this much earlier than it plays */
+static int64_t replay_audio_lookahead(struct replay_source *context, const struct obs_audio_info *info)
+{
+	if(!replay_stretch_audio(context))
+		return 0;
+	return (int64_t)replay_stretch_latency(info->samples_per_sec, context->speed_percent);
+}
+
+/* Outputs a replay audio packet that starts at timestamp. At other speeds
+ * the packet goes to the time stretch when the pitch is kept, otherwise it
+ * is played at a scaled sample rate. */
+static void replay_output_audio(struct replay_source *context, const struct obs_audio_data *audio, uint64_t timestamp, const struct obs_audio_info *info)
+{
+	if(replay_stretch_audio(context)){
+		replay_stretch_push(context->stretch, audio, timestamp, info->samples_per_sec, context->speed_percent);
+		return;
+	}
+	replay_stretch_reset(context->stretch);
+
+	context->audio.frames = audio->frames;
+	context->audio.timestamp = timestamp;
+	if(context->speed_percent != 100.0f)
+		context->audio.samples_per_sec = info->samples_per_sec * context->speed_percent / 100.0;
+	else
+		context->audio.samples_per_sec = info->samples_per_sec;
+	for (size_t i = 0; i < MAX_AV_PLANES; i++) {
+		context->audio.data[i] = audio->data[i];
+	}
+	context->audio.speakers = info->speakers;
+	context->audio.format = AUDIO_FORMAT_FLOAT_PLANAR;
+
+	obs_source_output_audio(context->source, &context->audio);
+}
+
+/* outputs the time stretched audio up to until at the native sample rate */
+static void replay_output_stretched_audio(struct replay_source *context, uint64_t until, const struct obs_audio_info *info)
+{
+	struct obs_audio_data stretched;
+	if(!replay_stretch_audio(context) || !replay_stretch_pull(context->stretch, until, context->speed_percent, &stretched))
+		return;
+
+	context->audio.frames = stretched.frames;
+	context->audio.timestamp = stretched.timestamp;
+	context->audio.samples_per_sec = info->samples_per_sec;
+	for (size_t i = 0; i < MAX_AV_PLANES; i++) {
+		context->audio.data[i] = stretched.data[i];
+	}
+	context->audio.speakers = info->speakers;
+	context->audio.format = AUDIO_FORMAT_FLOAT_PLANAR;
+
+	obs_source_output_audio(context->source, &context->audio);
+}
+
+/* decompresses the frames that play next in the direction of playback */
+static void replay_prefetch_frames(struct replay_source* context)
+{
+	struct obs_source_frame *frames[REPLAY_DECODE_AHEAD];
+	size_t count = 0;
+	uint64_t position = context->video_frame_position;
+	while(count < REPLAY_DECODE_AHEAD && position < context->current_replay.video_frame_count)
+	{
+		frames[count++] = context->current_replay.video_frames[position];
+		if(context->backward && position == 0)
+			break;
+		position = context->backward ? position - 1 : position + 1;
+	}
+	replay_frame_cache_prefetch(&context->play_cache, frames, count);
+}
+
+/* The frames are shared with the filter and other replays, only a copy of
+ * the header gets the output timestamp. The data is copied by the source. */
+static void replay_output_video(struct replay_source* context,
+		const struct obs_source_frame* frame, uint64_t timestamp)
+{
+	struct obs_source_frame output = *frame;
+	output.timestamp = timestamp;
+	obs_source_output_video(context->source, &output);
+}
+
 static void replay_output_frame(struct replay_source* context, struct obs_source_frame* frame)
 {
-	uint64_t t = frame->timestamp;
+	const uint64_t t = frame->timestamp;
 	if(t < context->current_replay.first_frame_timestamp || t > context->current_replay.last_frame_timestamp)
 		return;
+	frame = replay_frame_cache_get(&context->play_cache, frame);
+	uint64_t timestamp;
 	if(context->backward)
 	{
-		frame->timestamp = context->current_replay.last_frame_timestamp - frame->timestamp;
+		timestamp = context->current_replay.last_frame_timestamp - t;
 	}else{
-		frame->timestamp -= context->current_replay.first_frame_timestamp;
+		timestamp = t - context->current_replay.first_frame_timestamp;
 	}
 	if(context->speed_percent != 100.0f)
 	{
-		frame->timestamp = frame->timestamp * 100.0 / context->speed_percent;
+		timestamp = timestamp * 100.0 / context->speed_percent;
 	}
-	frame->timestamp += context->start_timestamp;
-	if(context->previous_frame_timestamp <= frame->timestamp){
-		context->previous_frame_timestamp = frame->timestamp;
-		obs_source_output_video(context->source, frame);
+	timestamp += context->start_timestamp;
+	if(context->previous_frame_timestamp <= timestamp){
+		context->previous_frame_timestamp = timestamp;
+		replay_jitter_add(&context->jitter, os_gettime_ns(), timestamp);
+		replay_output_video(context, frame, timestamp);
+	}
+	replay_prefetch_frames(context);
+	if(context->playback_active)
+	{
+		context->progress_timestamp = t;
+		os_atomic_set_bool(&context->progress_pending, true);
+		return;
 	}
-	frame->timestamp = t;
 	replay_update_text(context);
 	replay_update_progress_crop(context, t);
 }
@@ -2128,147 +3125,150 @@ void replay_source_end_action(struct replay_source* context)
 	}
 }
 
-static void replay_source_tick(void *data, float seconds)
+/* The end action switches scenes and replays, which is done on the tick.
+ * The playback thread leaves it pending and pauses until the tick ran it. */
+static void replay_source_end(struct replay_source *context)
 {
-	struct replay_source *context = data;
-
-	const uint64_t os_timestamp = obs_get_video_frame_time();
+	if(context->playback_active)
+		os_atomic_set_bool(&context->end_pending, true);
+	else
+		replay_source_end_action(context);
+}
 
-	if(context->retrieve_timestamp && context->retrieve_timestamp < os_timestamp)
+static void replay_switch_next_scene(struct replay_source *context)
+{
+	obs_source_t *s = obs_get_source_by_name(context->next_scene_name);
+	if(s)
 	{
-		context->retrieve_timestamp = 0;
-		replay_retrieve(context);
+		obs_frontend_set_current_scene(s);
+		obs_source_release(s);
 	}
-	if(!context->filter_loaded)
-	{
-		if(context->source_name){
-			obs_source_t *s = obs_get_source_by_name(context->source_name);
-			if(s)
-			{
-				obs_data_t* settings = obs_source_get_settings(context->source);
-				replay_source_update(data, settings);
-				obs_data_release(settings);
-				obs_source_release(s);
-				return;
-			}
-		}
-		if(context->source_audio_name){
-			obs_source_t *s = obs_get_source_by_name(context->source_audio_name);
-			if(s)
-			{
-				obs_data_t* settings = obs_source_get_settings(context->source);
-				replay_source_update(data, settings);
-				obs_data_release(settings);
-				obs_source_release(s);
-				return;
+}
+
+static void replay_source_next_scene(struct replay_source *context)
+{
+	if(context->playback_active)
+		os_atomic_set_bool(&context->next_scene_pending, true);
+	else
+		replay_switch_next_scene(context);
+}
+
+/* Builds the reversed audio of the current replay unless it is cached
+ * already. The packets are in reverse order with their samples reversed and
+ * have the end of the original packet as timestamp, which is where they
+ * start when playing backward. Called with audio_mutex held. */
+static const struct replay_audio_reverse *replay_audio_reverse_get(struct replay_source *context, uint32_t sample_rate)
+{
+	struct replay_audio_reverse *reverse = &context->audio_reverse;
+	const struct replay *r = &context->current_replay;
+	if(reverse->source == r->audio_frames)
+		return reverse;
+	replay_audio_reverse_free(reverse);
+
+	const uint64_t count = r->audio_frame_count;
+	size_t channels = 0;
+	while(channels < MAX_AV_PLANES && r->audio_frames[0].data[channels])
+		channels++;
+	uint64_t samples = 0;
+	for(uint64_t i = 0; i < count; i++)
+		samples += r->audio_frames[i].frames;
+	for(size_t ch = 0; ch < channels; ch++)
+		reverse->data[ch] = bmalloc(samples * sizeof(float));
+	reverse->frames = bzalloc(count * sizeof(struct obs_audio_data));
+
+	uint64_t offset = 0;
+	for(uint64_t i = 0; i < count; i++){
+		const struct obs_audio_data *src = &r->audio_frames[count - 1 - i];
+		struct obs_audio_data *dst = &reverse->frames[i];
+		dst->frames = src->frames;
+		dst->timestamp = src->timestamp + audio_frames_to_ns(sample_rate, src->frames);
+		for(size_t ch = 0; ch < channels; ch++){
+			const float *in = (const float*)src->data[ch];
+			float *out = reverse->data[ch] + offset;
+			if(in){
+				for(uint32_t j = 0; j < src->frames; j++)
+					out[j] = in[src->frames - 1 - j];
+			}else{
+				memset(out, 0, src->frames * sizeof(float));
 			}
+			dst->data[ch] = (uint8_t*)out;
 		}
-		return;
+		offset += src->frames;
 	}
+	reverse->frame_count = count;
+	reverse->source = r->audio_frames;
+	return reverse;
+}
 
-	if(context->saving_status == SAVING_STATUS_STARTING){
-		replay_save(context);
-	}else if(context->saving_status == SAVING_STATUS_SAVING)
-	{
-		if(!obs_output_active(context->fileOutput))
-		{
-			const char* error = obs_output_get_last_error(context->fileOutput);
-			context->saving_status = SAVING_STATUS_NONE;
-			if(context->free_after_save)
-			{
-				replay_free_replay(&context->saving_replay, context);
-			}
-		}else if(context->video_save_position >= context->saving_replay.video_frame_count){
-			context->saving_status = SAVING_STATUS_STOPPING;
-			obs_output_stop(context->fileOutput);
-		}else{
-			pthread_mutex_lock(&context->video_mutex);
-			struct obs_source_frame* frame = context->saving_replay.video_frames[context->video_save_position];
-			while(frame->timestamp < context->saving_replay.first_frame_timestamp + context->saving_replay.trim_front)
-			{
-				context->video_save_position++;
-				if(context->video_save_position >= context->saving_replay.video_frame_count)
-				{
-					context->saving_status = SAVING_STATUS_STOPPING;
-					break;
-				}
-				frame = context->saving_replay.video_frames[context->video_save_position];
-			}
-			uint64_t timestamp = frame->timestamp;
-			if(context->start_save_timestamp > context->saving_replay.first_frame_timestamp)
-			{
-				timestamp += context->start_save_timestamp - context->saving_replay.first_frame_timestamp;
-			}
-			if(timestamp <= os_timestamp){
-				struct video_frame output_frame;
-				if (video_output_lock_frame(context->video_output, &output_frame, 1, timestamp))
-				{
-					video_scaler_scale(context->scaler, output_frame.data, output_frame.linesize, frame->data,frame->linesize);
-					video_output_unlock_frame(context->video_output);
-				}
-				context->video_save_position++;
-				if(context->video_save_position >= context->saving_replay.video_frame_count)
-				{
-					context->saving_status = SAVING_STATUS_STOPPING;
-					obs_output_stop(context->fileOutput);
-				}else
-				{
-					frame = context->saving_replay.video_frames[context->video_save_position];
-					if(frame->timestamp >= context->saving_replay.last_frame_timestamp - context->saving_replay.trim_end)
-					{
-						context->saving_status = SAVING_STATUS_STOPPING;
-						obs_output_stop(context->fileOutput);
-					}
-				}
-			}
-			pthread_mutex_unlock(&context->video_mutex);
-		}
-	}else if(context->saving_status == SAVING_STATUS_STOPPING)
-	{
-		if(!context->fileOutput || !obs_output_active(context->fileOutput)){
-			context->saving_status = SAVING_STATUS_NONE;
-			if(context->free_after_save)
-			{
-				replay_free_replay(&context->saving_replay, context);
-			}
-		}else{
+/* Moves the audio position to the packet that plays video_duration after
+ * start_timestamp in the current direction, so audio stays with the video
+ * when the direction flips in the middle of a replay. Called with
+ * audio_mutex held. */
+static void replay_seek_audio(struct replay_source *context, int64_t video_duration)
+{
+	const struct replay *r = &context->current_replay;
+	const uint64_t count = r->audio_frame_count;
+	const uint64_t played = video_duration > 0 ? (uint64_t)(video_duration * context->speed_percent / 100.0) : 0;
 
-			if (os_timestamp - context->start_save_timestamp > context->saving_replay.last_frame_timestamp - context->saving_replay.first_frame_timestamp)
-			{
-				obs_output_stop(context->fileOutput);
-				pthread_mutex_lock(&context->video_mutex);
-				if(context->video_save_position >= context->saving_replay.video_frame_count)
-				{
-					context->video_save_position = context->saving_replay.video_frame_count - 1;
-				}
-				struct obs_source_frame* frame = context->saving_replay.video_frames[context->video_save_position];
-				struct video_frame output_frame;
-				if (video_output_lock_frame(context->video_output, &output_frame, 1, os_timestamp))
-				{
-					video_scaler_scale(context->scaler, output_frame.data, output_frame.linesize, frame->data,frame->linesize);
-					video_output_unlock_frame(context->video_output);
-					
-				}
-				pthread_mutex_unlock(&context->video_mutex);
-			}
-		}
-	}else if(context->fileOutput)
+	if(context->backward){
+		/* the packet playing then is the last one that starts before it */
+		const uint64_t timestamp = played < r->last_frame_timestamp - r->first_frame_timestamp ?
+				r->last_frame_timestamp - played : r->first_frame_timestamp;
+		context->audio_frame_position = count - replay_lower_bound(r->audio_timestamps, count, timestamp);
+	}else{
+		context->audio_frame_position = replay_lower_bound(r->audio_timestamps, count, r->first_frame_timestamp + played);
+		if(context->audio_frame_position >= count)
+			context->audio_frame_position = count - 1;
+	}
+	context->audio_backward = context->backward;
+	context->audio_seek = false;
+	replay_stretch_reset(context->stretch);
+}
+
+/* plays the reversed audio of the current replay up to video_duration after
+ * start_timestamp */
+static void replay_source_audio_backward(struct replay_source *context, int64_t video_duration, uint64_t os_timestamp)
+{
+	const struct replay *r = &context->current_replay;
+	struct obs_audio_info info;
+	obs_get_audio_info(&info);
+
+	pthread_mutex_lock(&context->audio_mutex);
+	const struct replay_audio_reverse *reverse = replay_audio_reverse_get(context, info.samples_per_sec);
+	if(context->audio_seek || !context->audio_backward)
+		replay_seek_audio(context, video_duration);
+
+	const int64_t frame_duration = (r->last_frame_timestamp - r->first_frame_timestamp)/r->video_frame_count;
+	const int64_t lookahead = replay_audio_lookahead(context, &info);
+	while(context->play && context->audio_frame_position < reverse->frame_count)
 	{
-		obs_output_release(context->fileOutput);
-		context->fileOutput = NULL;
-		if(context->h264Recording)
-		{
-			obs_encoder_release(context->h264Recording);
-			context->h264Recording = NULL;
-		}
-		if(context->aac)
-		{
-			obs_encoder_release(context->aac);
-			context->aac = NULL;
+		const struct obs_audio_data *audio = &reverse->frames[context->audio_frame_position];
+		const int64_t audio_duration = ((int64_t)r->last_frame_timestamp - (int64_t)audio->timestamp) * 100.0 / context->speed_percent;
+		if(video_duration + frame_duration + lookahead <= audio_duration)
+			break;
+		if(audio->timestamp > r->first_frame_timestamp - frame_duration && audio->timestamp < r->last_frame_timestamp + frame_duration){
+			replay_output_audio(context, audio, context->start_timestamp + audio_duration, &info);
 		}
+		context->audio_frame_position++;
 	}
-	
+	if(context->play)
+		replay_output_stretched_audio(context, os_timestamp + frame_duration, &info);
+	pthread_mutex_unlock(&context->audio_mutex);
+}
+
+/* Outputs the video and audio of the current replay that is due at
+ * os_timestamp. Returns when the next frame or packet is due, 0 when that is
+ * not known. */
+static uint64_t replay_source_play(struct replay_source *context, uint64_t os_timestamp)
+{
+	uint64_t next = 0;
+
 	pthread_mutex_lock(&context->video_mutex);
+	if(os_atomic_load_bool(&context->end_pending))
+	{
+		pthread_mutex_unlock(&context->video_mutex);
+		return 0;
+	}
 	if(!context->current_replay.video_frame_count && !context->current_replay.audio_frame_count){
 		context->play = false;
 	}else if(context->disabled)
@@ -2283,7 +3283,7 @@ static void replay_source_tick(void *data, float seconds)
 			obs_source_output_video(context->source, NULL);
 		}
 		pthread_mutex_unlock(&context->video_mutex);
-		return;
+		return 0;
 	}
 	context->end = false;
 
@@ -2292,6 +3292,7 @@ static void replay_source_tick(void *data, float seconds)
 		if(context->video_frame_position >= context->current_replay.video_frame_count)
 			context->video_frame_position = context->current_replay.video_frame_count - 1;
 		struct obs_source_frame * frame = context->current_replay.video_frames[context->video_frame_position];
+		const uint64_t *timestamps = context->current_replay.video_timestamps;
 		if(context->backward)
 		{
 			if(context->restart)
@@ -2301,6 +3302,7 @@ static void replay_source_tick(void *data, float seconds)
 				frame = context->current_replay.video_frames[context->video_frame_position];
 				context->start_timestamp = os_timestamp;
 				context->restart = false;
+				context->audio_seek = true;
 				if(context->current_replay.trim_end != 0)
 				{
 					if(context->speed_percent == 100.0f){
@@ -2310,53 +3312,49 @@ static void replay_source_tick(void *data, float seconds)
 					}
 				
 					if(context->current_replay.trim_end < 0){
-						uint64_t t = frame->timestamp;
-						frame->timestamp = os_timestamp;
-						context->previous_frame_timestamp = frame->timestamp;
-						obs_source_output_video(context->source, frame);
-						frame->timestamp = t;
+						frame = replay_frame_cache_get(&context->play_cache, frame);
+						context->previous_frame_timestamp = os_timestamp;
+						replay_output_video(context, frame, os_timestamp);
 						pthread_mutex_unlock(&context->video_mutex);
-						return;
-					}
-					while(frame->timestamp > context->current_replay.last_frame_timestamp - context->current_replay.trim_end)
-					{
-						if(context->video_frame_position == 0)
-						{
-							context->video_frame_position = context->current_replay.video_frame_count;
-						}
-						context->video_frame_position--;
-						frame = context->current_replay.video_frames[context->video_frame_position];
+						return 0;
 					}
+					/* last frame not after the trimmed end */
+					const uint64_t end = replay_lower_bound(timestamps, context->current_replay.video_frame_count,
+							context->current_replay.last_frame_timestamp - context->current_replay.trim_end + 1);
+					context->video_frame_position = end ? end - 1 : context->current_replay.video_frame_count - 1;
+					frame = context->current_replay.video_frames[context->video_frame_position];
 				}
 			}
 			
 			const int64_t video_duration = os_timestamp - (int64_t)context->start_timestamp;
-			//TODO audio backwards
-			int64_t source_duration = (context->current_replay.last_frame_timestamp - frame->timestamp) * 100.0 / context->speed_percent;
+			if(context->current_replay.audio_frame_count > 1)
+				replay_source_audio_backward(context, video_duration, os_timestamp);
+			int64_t source_duration = (context->current_replay.last_frame_timestamp - timestamps[context->video_frame_position]) * 100.0 / context->speed_percent;
 
 			struct obs_source_frame* output_frame = NULL;
 			while(context->play && video_duration >= source_duration)
 			{
 				output_frame = frame;
-				if(frame->timestamp <= context->current_replay.first_frame_timestamp + context->current_replay.trim_front)
+				if(timestamps[context->video_frame_position] <= context->current_replay.first_frame_timestamp + context->current_replay.trim_front)
 				{
-					replay_source_end_action(context);
+					replay_source_end(context);
 					break;
 				}
 				if(context->video_frame_position == 0){
-					replay_source_end_action(context);
+					replay_source_end(context);
 					break;
 				}
 				context->video_frame_position--;
 				
 				frame = context->current_replay.video_frames[context->video_frame_position];
 
-				source_duration = (context->current_replay.last_frame_timestamp - frame->timestamp) * 100.0 / context->speed_percent;
+				source_duration = (context->current_replay.last_frame_timestamp - timestamps[context->video_frame_position]) * 100.0 / context->speed_percent;
 			}
+			next = context->start_timestamp + source_duration;
 			if(output_frame){
 				replay_output_frame(context, output_frame);
 			}else if(context->video_frame_position == 0){
-				replay_source_end_action(context);
+				replay_source_end(context);
 			}
 		}else{
 			if(context->restart)
@@ -2365,6 +3363,8 @@ static void replay_source_tick(void *data, float seconds)
 				context->restart = false;
 				context->start_timestamp = os_timestamp;
 				context->audio_frame_position = 0;
+				context->audio_backward = false;
+				context->audio_seek = false;
 				frame = context->current_replay.video_frames[context->video_frame_position];			
 				if(context->current_replay.trim_front != 0){
 					if(context->speed_percent == 100.0f){
@@ -2373,62 +3373,50 @@ static void replay_source_tick(void *data, float seconds)
 						context->start_timestamp -= context->current_replay.trim_front * 100.0 / context->speed_percent;
 					}
 					if(context->current_replay.trim_front < 0){
-						uint64_t t = frame->timestamp;
-						frame->timestamp = os_timestamp;
-						context->previous_frame_timestamp = frame->timestamp;
-						obs_source_output_video(context->source, frame);
-						frame->timestamp = t;
+						frame = replay_frame_cache_get(&context->play_cache, frame);
+						context->previous_frame_timestamp = os_timestamp;
+						replay_output_video(context, frame, os_timestamp);
 						pthread_mutex_unlock(&context->video_mutex);
-						return;
-					}
-					while(frame->timestamp < context->current_replay.first_frame_timestamp + context->current_replay.trim_front)
-					{
-						context->video_frame_position++;
-						if(context->video_frame_position >= context->current_replay.video_frame_count)
-						{
-							context->video_frame_position = 0;
-						}
-						frame = context->current_replay.video_frames[context->video_frame_position];
+						return 0;
 					}
+					/* first frame not before the trimmed start */
+					context->video_frame_position = replay_lower_bound(timestamps, context->current_replay.video_frame_count,
+							context->current_replay.first_frame_timestamp + context->current_replay.trim_front);
+					if(context->video_frame_position >= context->current_replay.video_frame_count)
+						context->video_frame_position = 0;
+					frame = context->current_replay.video_frames[context->video_frame_position];
 				}
 			}
 			if(context->start_timestamp > os_timestamp){
 				pthread_mutex_unlock(&context->video_mutex);
-				return;
+				return context->start_timestamp;
 			}
 			const int64_t video_duration = (int64_t)os_timestamp - (int64_t)context->start_timestamp;
 
 			if(context->current_replay.audio_frame_count > 1){
 				pthread_mutex_lock(&context->audio_mutex);
+				if(context->audio_seek || context->audio_backward)
+					replay_seek_audio(context, video_duration);
+				const uint64_t *audio_timestamps = context->current_replay.audio_timestamps;
 				struct obs_audio_data peek_audio = context->current_replay.audio_frames[context->audio_frame_position];
 				struct obs_audio_info info;
 				obs_get_audio_info(&info);
 				const int64_t frame_duration = (context->current_replay.last_frame_timestamp - context->current_replay.first_frame_timestamp)/context->current_replay.video_frame_count;
 				//const uint64_t duration = audio_frames_to_ns(info.samples_per_sec, peek_audio.frames);
-				int64_t audio_duration = ((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
-				while(context->play && video_duration + frame_duration > audio_duration)
+				int64_t audio_duration = ((int64_t)audio_timestamps[context->audio_frame_position] - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
+				const int64_t lookahead = replay_audio_lookahead(context, &info);
+				while(context->play && video_duration + frame_duration + lookahead > audio_duration)
 				{
 					if(peek_audio.timestamp > context->current_replay.first_frame_timestamp - frame_duration && peek_audio.timestamp < context->current_replay.last_frame_timestamp + frame_duration){
-						context->audio.frames = peek_audio.frames;
-
+						uint64_t timestamp;
 						if(context->speed_percent != 100.0f)
 						{
-							context->audio.timestamp = context->start_timestamp + (((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent);
-							context->audio.samples_per_sec = info.samples_per_sec * context->speed_percent / 100.0;
+							timestamp = context->start_timestamp + (((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent);
 						}else
 						{
-							context->audio.timestamp = peek_audio.timestamp + context->start_timestamp - context->current_replay.first_frame_timestamp;
-							context->audio.samples_per_sec = info.samples_per_sec;
+							timestamp = peek_audio.timestamp + context->start_timestamp - context->current_replay.first_frame_timestamp;
 						}
-						for (size_t i = 0; i < MAX_AV_PLANES; i++) {
-							context->audio.data[i] = peek_audio.data[i];
-						}
-
-
-						context->audio.speakers = info.speakers;
-						context->audio.format = AUDIO_FORMAT_FLOAT_PLANAR;
-
-						obs_source_output_audio(context->source, &context->audio);
+						replay_output_audio(context, &peek_audio, timestamp, &info);
 					}
 					context->audio_frame_position++;
 					if(context->audio_frame_position >= context->current_replay.audio_frame_count){
@@ -2436,34 +3424,37 @@ static void replay_source_tick(void *data, float seconds)
 						break;
 					}
 					peek_audio = context->current_replay.audio_frames[context->audio_frame_position];
-					audio_duration = ((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
+					audio_duration = ((int64_t)audio_timestamps[context->audio_frame_position] - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
 				}
+				if(context->play)
+					replay_output_stretched_audio(context, os_timestamp + frame_duration, &info);
 				pthread_mutex_unlock(&context->audio_mutex);
 			}
-			int64_t source_duration = (frame->timestamp - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
+			int64_t source_duration = (timestamps[context->video_frame_position] - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
 			struct obs_source_frame* output_frame = NULL;
 			while(context->play && video_duration >= source_duration){
 				output_frame = frame;
-				if(frame->timestamp >= context->current_replay.last_frame_timestamp - context->current_replay.trim_end)
+				if(timestamps[context->video_frame_position] >= context->current_replay.last_frame_timestamp - context->current_replay.trim_end)
 				{
-					replay_source_end_action(context);
+					replay_source_end(context);
 					break;
 				}
 				context->video_frame_position++;
 				if(context->video_frame_position >= context->current_replay.video_frame_count)
 				{
 					context->video_frame_position = context->current_replay.video_frame_count - 1;
-					replay_source_end_action(context);
+					replay_source_end(context);
 					break;
 				}
 				frame = context->current_replay.video_frames[context->video_frame_position];
-				source_duration = (frame->timestamp - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
+				source_duration = (timestamps[context->video_frame_position] - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
 			}
+			next = context->start_timestamp + source_duration;
 			if(output_frame){
 				replay_output_frame(context, output_frame);
 			}else if(context->video_frame_position >= context->current_replay.video_frame_count -1){
 				context->video_frame_position = context->current_replay.video_frame_count - 1;
-				replay_source_end_action(context);
+				replay_source_end(context);
 			}
 		}
 	}else if(context->current_replay.audio_frame_count)
@@ -2493,21 +3484,17 @@ static void replay_source_tick(void *data, float seconds)
 			}
 			if(context->current_replay.trim_front < 0){
 				pthread_mutex_unlock(&context->video_mutex);
-				return;
-			}
-			while(peek_audio.timestamp < context->current_replay.first_frame_timestamp + context->current_replay.trim_front)
-			{
-					context->audio_frame_position++;
-					if(context->audio_frame_position >= context->current_replay.audio_frame_count){
-						context->audio_frame_position = 0;
-						break;
-					}
-					peek_audio = context->current_replay.audio_frames[context->audio_frame_position];
+				return 0;
 			}
+			context->audio_frame_position = replay_lower_bound(context->current_replay.audio_timestamps, context->current_replay.audio_frame_count,
+					context->current_replay.first_frame_timestamp + context->current_replay.trim_front);
+			if(context->audio_frame_position >= context->current_replay.audio_frame_count)
+				context->audio_frame_position = 0;
+			peek_audio = context->current_replay.audio_frames[context->audio_frame_position];
 		}
 		if(context->start_timestamp > os_timestamp){
 			pthread_mutex_unlock(&context->video_mutex);
-			return;
+			return context->start_timestamp;
 		}
 
 		const int64_t video_duration = os_timestamp - context->start_timestamp;
@@ -2515,8 +3502,9 @@ static void replay_source_tick(void *data, float seconds)
 		obs_get_audio_info(&info);
 		
 		int64_t audio_duration = ((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
+		const int64_t lookahead = replay_audio_lookahead(context, &info);
 
-		while(context->play && context->current_replay.audio_frame_count > 1 && video_duration >= audio_duration)
+		while(context->play && context->current_replay.audio_frame_count > 1 && video_duration + lookahead >= audio_duration)
 		{
 			if(peek_audio.timestamp >= context->current_replay.last_frame_timestamp - context->current_replay.trim_end)
 			{
@@ -2530,36 +3518,18 @@ static void replay_source_tick(void *data, float seconds)
 					context->restart = true;
 				}
 				if(context->next_scene_name && context->active)
-				{
-					obs_source_t *s = obs_get_source_by_name(context->next_scene_name);
-					if(s)
-					{
-						obs_frontend_set_current_scene(s);
-						obs_source_release(s);
-					}
-				}
+					replay_source_next_scene(context);
 			}
 
-			context->audio.frames = peek_audio.frames;
-
+			uint64_t timestamp;
 			if(context->speed_percent != 100.0f)
 			{
-				context->audio.timestamp = context->start_timestamp + (peek_audio.timestamp - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
-				context->audio.samples_per_sec = info.samples_per_sec * context->speed_percent / 100.0;
+				timestamp = context->start_timestamp + (peek_audio.timestamp - context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
 			}else
 			{
-				context->audio.timestamp = peek_audio.timestamp + context->start_timestamp - context->current_replay.first_frame_timestamp;
-				context->audio.samples_per_sec = info.samples_per_sec;
+				timestamp = peek_audio.timestamp + context->start_timestamp - context->current_replay.first_frame_timestamp;
 			}
-			for (size_t i = 0; i < MAX_AV_PLANES; i++) {
-				context->audio.data[i] = peek_audio.data[i];
-			}
-
-
-			context->audio.speakers = info.speakers;
-			context->audio.format = AUDIO_FORMAT_FLOAT_PLANAR;
-
-			obs_source_output_audio(context->source, &context->audio);
+			replay_output_audio(context, &peek_audio, timestamp, &info);
 			context->audio_frame_position++;
 			if(context->audio_frame_position >= context->current_replay.audio_frame_count){
 				context->audio_frame_position = 0;
@@ -2568,9 +3538,224 @@ static void replay_source_tick(void *data, float seconds)
 			peek_audio = context->current_replay.audio_frames[context->audio_frame_position];
 			audio_duration = ((int64_t)peek_audio.timestamp - (int64_t)context->current_replay.first_frame_timestamp) * 100.0 / context->speed_percent;
 		}
+		if(context->play)
+			replay_output_stretched_audio(context, os_timestamp, &info);
+		next = context->start_timestamp + audio_duration - lookahead;
+	}
+	pthread_mutex_unlock(&context->video_mutex);
+	return next;
+}
+
+/* longest sleep of the playback thread, so control changes apply soon */
+#define REPLAY_PLAYBACK_MAX_SLEEP 10000000ULL
+
+static void *replay_playback_thread(void *data)
+{
+	struct replay_source *context = data;
+
+	os_set_thread_name("replay_source: playback");
+
+	while (!os_atomic_load_bool(&context->playback_stop)) {
+		const uint64_t now = os_gettime_ns();
+		const uint64_t next = replay_source_play(context, now);
+		uint64_t target = now + REPLAY_PLAYBACK_MAX_SLEEP;
+		if (next > now && next < target)
+			target = next;
+		os_sleepto_ns(target);
 	}
+	return NULL;
+}
+
+static void replay_start_playback_thread(struct replay_source *context)
+{
+	pthread_mutex_lock(&context->video_mutex);
+	replay_jitter_log(&context->jitter, context, "render tick");
+	pthread_mutex_unlock(&context->video_mutex);
+
+	/* set first, the thread already leaves end actions to the tick */
+	os_atomic_set_bool(&context->playback_stop, false);
+	context->playback_active = true;
+	if (pthread_create(&context->playback_thread, NULL,
+			replay_playback_thread, context) != 0)
+		context->playback_active = false;
+}
+
+static void replay_stop_playback_thread(struct replay_source *context)
+{
+	if (!context->playback_active)
+		return;
+	os_atomic_set_bool(&context->playback_stop, true);
+	pthread_join(context->playback_thread, NULL);
+	context->playback_active = false;
+
+	pthread_mutex_lock(&context->video_mutex);
+	replay_jitter_log(&context->jitter, context, "playback thread");
 	pthread_mutex_unlock(&context->video_mutex);
 }
+
+static void replay_source_tick(void *data, float seconds)
+{
+	struct replay_source *context = data;
+
+	const uint64_t os_timestamp = obs_get_video_frame_time();
+
+	if(context->retrieve_timestamp && context->retrieve_timestamp < os_timestamp)
+	{
+		context->retrieve_timestamp = 0;
+		replay_queue_retrieve(context, 0, UINT64_MAX, NULL, NULL);
+	}
+	replay_add_retrieved(context);
+	if(!context->filter_loaded)
+	{
+		if(context->source_name){
+			obs_source_t *s = obs_get_source_by_name(context->source_name);
+			if(s)
+			{
+				obs_data_t* settings = obs_source_get_settings(context->source);
+				replay_source_update(data, settings);
+				obs_data_release(settings);
+				obs_source_release(s);
+				return;
+			}
+		}
+		if(context->source_audio_name){
+			obs_source_t *s = obs_get_source_by_name(context->source_audio_name);
+			if(s)
+			{
+				obs_data_t* settings = obs_source_get_settings(context->source);
+				replay_source_update(data, settings);
+				obs_data_release(settings);
+				obs_source_release(s);
+				return;
+			}
+		}
+		return;
+	}
+
+	if(context->saving_status == SAVING_STATUS_STARTING){
+		replay_save(context);
+	}else if(context->saving_status == SAVING_STATUS_SAVING)
+	{
+		if(!obs_output_active(context->fileOutput))
+		{
+			const char* error = obs_output_get_last_error(context->fileOutput);
+			context->saving_status = SAVING_STATUS_NONE;
+			if(context->free_after_save)
+			{
+				replay_free_replay(&context->saving_replay, context);
+			}
+		}else if(context->video_save_position >= context->saving_replay.video_frame_count){
+			context->saving_status = SAVING_STATUS_STOPPING;
+			obs_output_stop(context->fileOutput);
+		}else{
+			pthread_mutex_lock(&context->video_mutex);
+			const uint64_t *timestamps = context->saving_replay.video_timestamps;
+			if(timestamps[context->video_save_position] < context->saving_replay.first_frame_timestamp + context->saving_replay.trim_front)
+			{
+				context->video_save_position = replay_lower_bound(timestamps, context->saving_replay.video_frame_count,
+						context->saving_replay.first_frame_timestamp + context->saving_replay.trim_front);
+				if(context->video_save_position >= context->saving_replay.video_frame_count)
+					context->saving_status = SAVING_STATUS_STOPPING;
+			}
+			const uint64_t position = context->video_save_position < context->saving_replay.video_frame_count ?
+					context->video_save_position : context->saving_replay.video_frame_count - 1;
+			struct obs_source_frame* frame = context->saving_replay.video_frames[position];
+			uint64_t timestamp = timestamps[position];
+			if(context->start_save_timestamp > context->saving_replay.first_frame_timestamp)
+			{
+				timestamp += context->start_save_timestamp - context->saving_replay.first_frame_timestamp;
+			}
+			if(timestamp <= os_timestamp){
+				struct video_frame output_frame;
+				if (video_output_lock_frame(context->video_output, &output_frame, 1, timestamp))
+				{
+					frame = replay_frame_cache_get(&context->save_cache, frame);
+					video_scaler_scale(context->scaler, output_frame.data, output_frame.linesize, frame->data,frame->linesize);
+					video_output_unlock_frame(context->video_output);
+				}
+				context->video_save_position++;
+				if(context->video_save_position >= context->saving_replay.video_frame_count)
+				{
+					context->saving_status = SAVING_STATUS_STOPPING;
+					obs_output_stop(context->fileOutput);
+				}else
+				{
+					if(timestamps[context->video_save_position] >= context->saving_replay.last_frame_timestamp - context->saving_replay.trim_end)
+					{
+						context->saving_status = SAVING_STATUS_STOPPING;
+						obs_output_stop(context->fileOutput);
+					}
+				}
+			}
+			pthread_mutex_unlock(&context->video_mutex);
+		}
+	}else if(context->saving_status == SAVING_STATUS_STOPPING)
+	{
+		if(!context->fileOutput || !obs_output_active(context->fileOutput)){
+			context->saving_status = SAVING_STATUS_NONE;
+			if(context->free_after_save)
+			{
+				replay_free_replay(&context->saving_replay, context);
+			}
+		}else{
+
+			if (os_timestamp - context->start_save_timestamp > context->saving_replay.last_frame_timestamp - context->saving_replay.first_frame_timestamp)
+			{
+				obs_output_stop(context->fileOutput);
+				pthread_mutex_lock(&context->video_mutex);
+				if(context->video_save_position >= context->saving_replay.video_frame_count)
+				{
+					context->video_save_position = context->saving_replay.video_frame_count - 1;
+				}
+				struct obs_source_frame* frame = context->saving_replay.video_frames[context->video_save_position];
+				struct video_frame output_frame;
+				if (video_output_lock_frame(context->video_output, &output_frame, 1, os_timestamp))
+				{
+					frame = replay_frame_cache_get(&context->save_cache, frame);
+					video_scaler_scale(context->scaler, output_frame.data, output_frame.linesize, frame->data,frame->linesize);
+					video_output_unlock_frame(context->video_output);
+					
+				}
+				pthread_mutex_unlock(&context->video_mutex);
+			}
+		}
+	}else if(context->fileOutput)
+	{
+		obs_output_release(context->fileOutput);
+		context->fileOutput = NULL;
+		if(context->h264Recording)
+		{
+			obs_encoder_release(context->h264Recording);
+			context->h264Recording = NULL;
+		}
+		if(context->aac)
+		{
+			obs_encoder_release(context->aac);
+			context->aac = NULL;
+		}
+	}
+	
+	if(context->text_pending)
+		replay_update_text(context);
+	if(os_atomic_load_bool(&context->end_pending))
+	{
+		pthread_mutex_lock(&context->video_mutex);
+		replay_source_end_action(context);
+		os_atomic_set_bool(&context->end_pending, false);
+		pthread_mutex_unlock(&context->video_mutex);
+	}
+	if(os_atomic_set_bool(&context->next_scene_pending, false) && context->next_scene_name)
+		replay_switch_next_scene(context);
+	if(os_atomic_set_bool(&context->progress_pending, false))
+	{
+		pthread_mutex_lock(&context->video_mutex);
+		replay_update_text(context);
+		replay_update_progress_crop(context, context->progress_timestamp);
+		pthread_mutex_unlock(&context->video_mutex);
+	}
+	if(!context->playback_active)
+		replay_source_play(context, os_timestamp);
+}
 static bool EnumVideoSources(void *data, obs_source_t *source)
 {
 	obs_property_t *prop = data;
@@ -2595,7 +3780,7 @@ static bool EnumScenes(void *data, obs_source_t *source)
 static bool replay_button(obs_properties_t *props, obs_property_t *property, void *data)
 {
 	struct replay_source *s = data;
-	replay_retrieve(s);
+	replay_queue_retrieve(s, 0, UINT64_MAX, NULL, NULL);
 	return false; // no properties changed
 }
 
@@ -2620,6 +3805,12 @@ static bool replay_video_source_modified(obs_properties_t *props, obs_property_t
 	}
 	obs_property_t* prop = obs_properties_get(props, SETTING_INTERNAL_FRAMES);
 	obs_property_set_visible(prop,async_source);
+	prop = obs_properties_get(props, SETTING_ZERO_COPY);
+	obs_property_set_visible(prop,async_source);
+	prop = obs_properties_get(props, SETTING_PARALLEL_COPY);
+	obs_property_set_visible(prop,async_source);
+	prop = obs_properties_get(props, SETTING_CAPTURE_FORMAT);
+	obs_property_set_visible(prop,!async_source);
 	return true;
 }
 
@@ -2644,6 +3835,16 @@ static bool replay_sound_trigger_modified(obs_properties_t *props, obs_property_
 	const bool sound_trigger = obs_data_get_bool(data, SETTING_SOUND_TRIGGER);
 	obs_property_t* prop = obs_properties_get(props, SETTING_AUDIO_THRESHOLD);
 	obs_property_set_visible(prop, sound_trigger);
+	prop = obs_properties_get(props, SETTING_AUDIO_THRESHOLD_TYPE);
+	obs_property_set_visible(prop, sound_trigger);
+	return true;
+}
+
+static bool replay_compress_modified(obs_properties_t *props, obs_property_t *property, obs_data_t *data)
+{
+	const bool compress = obs_data_get_bool(data, SETTING_COMPRESS);
+	obs_property_t* prop = obs_properties_get(props, SETTING_COMPRESS_NEAR);
+	obs_property_set_visible(prop, compress);
 	return true;
 }
 
@@ -2657,12 +3858,30 @@ static obs_properties_t *replay_source_properties(void *data)
 	obs_enum_scenes(EnumVideoSources, prop);
 	obs_property_set_modified_callback(prop, replay_video_source_modified);
 	obs_properties_add_bool(props, SETTING_INTERNAL_FRAMES, "Capture internal frames");
+	obs_properties_add_bool(props, SETTING_ZERO_COPY, TEXT_ZERO_COPY);
+	obs_properties_add_bool(props, SETTING_PARALLEL_COPY, TEXT_PARALLEL_COPY);
 
 	prop = obs_properties_add_list(props,SETTING_SOURCE_AUDIO,TEXT_SOURCE_AUDIO, OBS_COMBO_TYPE_EDITABLE,OBS_COMBO_FORMAT_STRING);
 	obs_enum_sources(EnumAudioSources, prop);
 
 	obs_properties_add_int(props,SETTING_DURATION,TEXT_DURATION,SETTING_DURATION_MIN,SETTING_DURATION_MAX,1000);
+	obs_properties_add_bool(props, SETTING_PREALLOCATE, TEXT_PREALLOCATE);
+	prop = obs_properties_add_list(props, SETTING_CAPTURE_FORMAT, TEXT_CAPTURE_FORMAT,
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "BGRA", VIDEO_FORMAT_BGRA);
+	obs_property_list_add_int(prop, "NV12", VIDEO_FORMAT_NV12);
+	obs_property_list_add_int(prop, "I420", VIDEO_FORMAT_I420);
+	obs_properties_add_int(props, SETTING_CAPTURE_HEIGHT, TEXT_CAPTURE_HEIGHT, 0, 4320, 1);
+	obs_properties_add_int(props, SETTING_CAPTURE_FPS, TEXT_CAPTURE_FPS, 0, 240, 1);
+	prop = obs_properties_add_bool(props, SETTING_COMPRESS, TEXT_COMPRESS);
+	obs_property_set_modified_callback(prop, replay_compress_modified);
+	obs_properties_add_int_slider(props, SETTING_COMPRESS_NEAR, TEXT_COMPRESS_NEAR, SETTING_COMPRESS_NEAR_MIN, SETTING_COMPRESS_NEAR_MAX, 1);
+	obs_properties_add_int(props, SETTING_MEMORY_DURATION, TEXT_MEMORY_DURATION, 0, SETTING_DURATION_MAX, 1000);
+	obs_properties_add_path(props, SETTING_SCRATCH_DIRECTORY, TEXT_SCRATCH_DIRECTORY, OBS_PATH_DIRECTORY, NULL, NULL);
 	obs_properties_add_int(props, SETTING_RETRIEVE_DELAY,TEXT_RETRIEVE_DELAY,0,100000,1000);
+	obs_properties_add_bool(props, SETTING_SNAPSHOT, TEXT_SNAPSHOT);
+	obs_properties_add_int(props, SETTING_RANGE_START, TEXT_RANGE_START, 0, SETTING_DURATION_MAX, 1000);
+	obs_properties_add_int(props, SETTING_RANGE_END, TEXT_RANGE_END, 0, SETTING_DURATION_MAX, 1000);
 	obs_properties_add_int(props,SETTING_REPLAYS,TEXT_REPLAYS,1,10,1);
 
 	prop = obs_properties_add_list(props, SETTING_VISIBILITY_ACTION, "Visibility Action",
@@ -2689,6 +3908,8 @@ static obs_properties_t *replay_source_properties(void *data)
 	obs_enum_scenes(EnumScenes, prop);
 
 	obs_properties_add_float_slider(props, SETTING_SPEED,"Speed percentage", SETTING_SPEED_MIN, SETTING_SPEED_MAX, 1.0);
+	obs_properties_add_bool(props, SETTING_PRESERVE_PITCH, TEXT_PRESERVE_PITCH);
+	obs_properties_add_bool(props, SETTING_PLAYBACK_THREAD, TEXT_PLAYBACK_THREAD);
 	obs_properties_add_bool(props, SETTING_BACKWARD,"Backwards");
 
 	obs_properties_add_path(props,SETTING_DIRECTORY,"Directory",OBS_PATH_DIRECTORY,NULL,NULL);
@@ -2708,6 +3929,10 @@ static obs_properties_t *replay_source_properties(void *data)
 	obs_property_set_modified_callback(prop, replay_sound_trigger_modified);
 
 	obs_properties_add_float_slider(props, SETTING_AUDIO_THRESHOLD,"Threshold db",SETTING_AUDIO_THRESHOLD_MIN, SETTING_AUDIO_THRESHOLD_MAX,0.1);
+	prop = obs_properties_add_list(props, SETTING_AUDIO_THRESHOLD_TYPE, TEXT_AUDIO_THRESHOLD_TYPE,
+			OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "Peak", THRESHOLD_PEAK);
+	obs_property_list_add_int(prop, "RMS", THRESHOLD_RMS);
 
 	obs_properties_add_button(props,"replay_button","Load replay", replay_button);
 
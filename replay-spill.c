@@ -0,0 +1,216 @@
+#include <obs-module.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include "replay.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SPILL_ALIGN(size) (((size) + 63) & ~(size_t)63)
+
+static volatile long segment_counter = 0;
+
+/* The file is deleted as soon as it is mapped (or when it is closed on
+ * windows), so nothing is left behind in the scratch directory when obs
+ * exits or crashes. */
+static bool replay_spill_segment_map(struct replay_spill_segment *segment,
+		const char *path)
+{
+#ifdef _WIN32
+	wchar_t *wpath = NULL;
+	if (!os_utf8_to_wcs_ptr(path, 0, &wpath))
+		return false;
+	HANDLE file = CreateFileW(wpath, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY |
+			FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	bfree(wpath);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE,
+			(DWORD)((uint64_t)segment->size >> 32),
+			(DWORD)segment->size, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	segment->data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0,
+			segment->size);
+	if (!segment->data) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	segment->file = file;
+	segment->mapping = mapping;
+	return true;
+#else
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return false;
+	unlink(path);
+
+	void *data = MAP_FAILED;
+	if (ftruncate(fd, (off_t)segment->size) == 0)
+		data = mmap(NULL, segment->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	segment->data = data;
+	return true;
+#endif
+}
+
+static void replay_spill_segment_unmap(struct replay_spill_segment *segment)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(segment->data);
+	CloseHandle(segment->mapping);
+	CloseHandle(segment->file);
+#else
+	munmap(segment->data, segment->size);
+#endif
+}
+
+static struct replay_spill_segment *replay_spill_segment_create(
+		struct replay_filter *filter, size_t size)
+{
+	struct replay_spill_segment *segment =
+			bzalloc(sizeof(struct replay_spill_segment));
+	segment->size = size;
+	segment->refs = 1;
+
+	struct dstr path = {0};
+	dstr_printf(&path, "%s/obs-replay-%lu-%ld.tmp", filter->spill_directory,
+#ifdef _WIN32
+			(unsigned long)GetCurrentProcessId(),
+#else
+			(unsigned long)getpid(),
+#endif
+			os_atomic_inc_long(&segment_counter));
+
+	if (!replay_spill_segment_map(segment, path.array)) {
+		blog(LOG_WARNING, "[replay_filter: '%s'] could not map spill "
+				"segment '%s', keeping frames in memory",
+				obs_source_get_name(filter->src), path.array);
+		dstr_free(&path);
+		bfree(segment);
+		return NULL;
+	}
+	dstr_free(&path);
+	return segment;
+}
+
+void replay_spill_segment_release(struct replay_spill_segment *segment)
+{
+	if (!segment || os_atomic_dec_long(&segment->refs) > 0)
+		return;
+	replay_spill_segment_unmap(segment);
+	bfree(segment);
+}
+
+bool replay_spill_reclaim(struct obs_source_frame *frame)
+{
+	struct replay_spill_segment *segment = (struct replay_spill_segment*)
+			frame->data[REPLAY_SPILL_PLANE];
+	if (!segment)
+		return false;
+	/* the planes live in the mapping, only the frame itself is ours */
+	bfree(frame);
+	replay_spill_segment_release(segment);
+	return true;
+}
+
+static uint32_t spill_plane_lines(enum video_format format, size_t plane,
+		uint32_t height)
+{
+	if (plane && (format == VIDEO_FORMAT_I420 || format == VIDEO_FORMAT_NV12))
+		return height / 2;
+	return height;
+}
+
+/* Copies the frame to the current spill segment of the filter and returns a
+ * frame whose planes point into the mapping, or NULL if the frame can not
+ * be spilled. Only called from the worker thread. */
+struct obs_source_frame *replay_spill_frame(struct replay_filter *filter,
+		const struct obs_source_frame *frame)
+{
+	uint32_t linesize[MAX_AV_PLANES];
+	size_t offset[MAX_AV_PLANES];
+	size_t size;
+
+	if (filter->spill_failed)
+		return NULL;
+
+	const bool compressed = replay_frame_is_compressed(frame);
+	if (compressed)
+		size = replay_frame_compressed_size(frame);
+	else
+		size = replay_frame_layout(frame->format, frame->width,
+				frame->height, linesize, offset);
+	if (!size)
+		return NULL;
+
+	struct replay_spill_segment *segment = filter->spill_segment;
+	if (!segment || segment->used + size > segment->size) {
+		replay_spill_segment_release(segment);
+		filter->spill_segment = segment = replay_spill_segment_create(
+				filter, size > REPLAY_SPILL_SEGMENT_SIZE ?
+				size : REPLAY_SPILL_SEGMENT_SIZE);
+		if (!segment) {
+			filter->spill_failed = true;
+			return NULL;
+		}
+	}
+
+	struct obs_source_frame *spilled = bzalloc(sizeof(struct obs_source_frame));
+	uint8_t *data = segment->data + segment->used;
+	if (compressed) {
+		memcpy(data, frame->data[0], size);
+		spilled->data[0] = data;
+	} else {
+		for (size_t i = 0; i < MAX_AV_PLANES && linesize[i]; i++) {
+			const uint32_t lines = spill_plane_lines(frame->format,
+					i, frame->height);
+			const uint32_t bytes = linesize[i] < frame->linesize[i] ?
+					linesize[i] : frame->linesize[i];
+
+			spilled->data[i] = data + offset[i];
+			spilled->linesize[i] = linesize[i];
+			if (linesize[i] == frame->linesize[i]) {
+				memcpy(spilled->data[i], frame->data[i],
+						(size_t)linesize[i] * lines);
+				continue;
+			}
+			for (uint32_t y = 0; y < lines; y++)
+				memcpy(spilled->data[i] + (size_t)y * linesize[i],
+						frame->data[i] + (size_t)y *
+						frame->linesize[i], bytes);
+		}
+	}
+
+	spilled->format       = frame->format;
+	spilled->width        = frame->width;
+	spilled->height       = frame->height;
+	spilled->timestamp    = frame->timestamp;
+	spilled->flip         = frame->flip;
+	spilled->full_range   = frame->full_range;
+	memcpy(spilled->color_matrix, frame->color_matrix, sizeof(float) * 16);
+	memcpy(spilled->color_range_min, frame->color_range_min, sizeof(float) * 3);
+	memcpy(spilled->color_range_max, frame->color_range_max, sizeof(float) * 3);
+	spilled->data[REPLAY_SPILL_PLANE] = (uint8_t*)segment;
+	spilled->refs = 1;
+
+	segment->used += SPILL_ALIGN(size);
+	os_atomic_inc_long(&segment->refs);
+	filter->spill_frames++;
+	filter->spill_bytes += size;
+	return spilled;
+}
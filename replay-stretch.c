@@ -0,0 +1,335 @@
+#include <obs-module.h>
+#include <math.h>
+#include "replay.h"
+
+/* Time stretch for replay audio that is played at another speed, so slow
+ * motion keeps its pitch and is output at the native sample rate. It is a
+ * WSOLA: frames of 20 ms with a Hann window are overlap added every half
+ * frame, the input position moves half a frame times the speed per frame
+ * and every frame starts within 5 ms of that position where it matches the
+ * natural continuation of the previous frame best. The match is the
+ * normalized cross correlation of the channel average, using the vector dot
+ * product kernel.
+ *
+ * Packets are pushed with their timestamp on the playback timeline and the
+ * output is pulled per tick up to a timestamp, so the output never runs
+ * ahead of playback. The input needs one frame plus the search range ahead
+ * of the output, replay_stretch_latency is that time at a speed. */
+
+/* a packet that is off by more than this from the previous one starts over */
+#define REPLAY_STRETCH_MAX_GAP 50000000ULL
+
+struct replay_stretch {
+	uint32_t sample_rate;
+	size_t channels;
+	size_t frame;
+	size_t hop;
+	size_t search;
+	float *window;
+	float *overlap[MAX_AV_PLANES];
+
+	/* input samples from the absolute sample input_start on */
+	float *input[MAX_AV_PLANES];
+	float *mix;
+	size_t input_count;
+	size_t input_capacity;
+	uint64_t input_start;
+	uint64_t input_timestamp;
+
+	double position;
+	uint64_t previous;
+	bool started;
+	bool reset;
+
+	float *output[MAX_AV_PLANES];
+	size_t output_capacity;
+	uint64_t output_timestamp;
+	uint64_t output_frames;
+};
+
+static inline size_t stretch_frame_size(uint32_t sample_rate)
+{
+	return (size_t)(sample_rate / 100) * 2;
+}
+
+static inline size_t stretch_search_size(uint32_t sample_rate)
+{
+	return sample_rate / 200;
+}
+
+uint64_t replay_stretch_latency(uint32_t sample_rate, float speed_percent)
+{
+	if (!sample_rate || speed_percent <= 0.0f)
+		return 0;
+	const size_t samples = stretch_frame_size(sample_rate) +
+			stretch_search_size(sample_rate);
+	return (uint64_t)((double)samples * 1000000000.0 / sample_rate *
+			100.0 / speed_percent);
+}
+
+struct replay_stretch *replay_stretch_create(void)
+{
+	struct replay_stretch *stretch = bzalloc(sizeof(struct replay_stretch));
+	stretch->reset = true;
+	return stretch;
+}
+
+static void stretch_free_buffers(struct replay_stretch *stretch)
+{
+	for (size_t ch = 0; ch < MAX_AV_PLANES; ch++) {
+		bfree(stretch->overlap[ch]);
+		bfree(stretch->input[ch]);
+		bfree(stretch->output[ch]);
+		stretch->overlap[ch] = NULL;
+		stretch->input[ch] = NULL;
+		stretch->output[ch] = NULL;
+	}
+	bfree(stretch->mix);
+	bfree(stretch->window);
+	stretch->mix = NULL;
+	stretch->window = NULL;
+	stretch->input_capacity = 0;
+	stretch->output_capacity = 0;
+}
+
+void replay_stretch_destroy(struct replay_stretch *stretch)
+{
+	if (!stretch)
+		return;
+	stretch_free_buffers(stretch);
+	bfree(stretch);
+}
+
+/* the next pushed packet starts a new stream */
+void replay_stretch_reset(struct replay_stretch *stretch)
+{
+	stretch->reset = true;
+}
+
+static void stretch_configure(struct replay_stretch *stretch,
+		uint32_t sample_rate, size_t channels)
+{
+	stretch_free_buffers(stretch);
+	stretch->sample_rate = sample_rate;
+	stretch->channels = channels;
+	stretch->frame = stretch_frame_size(sample_rate);
+	stretch->hop = stretch->frame / 2;
+	stretch->search = stretch_search_size(sample_rate);
+
+	/* a periodic Hann window adds up to one at half frame overlap */
+	stretch->window = bmalloc(stretch->frame * sizeof(float));
+	for (size_t i = 0; i < stretch->frame; i++)
+		stretch->window[i] = 0.5f - 0.5f * cosf(6.2831853f *
+				(float)i / (float)stretch->frame);
+	for (size_t ch = 0; ch < channels; ch++)
+		stretch->overlap[ch] = bmalloc(stretch->frame * sizeof(float));
+}
+
+static void stretch_restart(struct replay_stretch *stretch, uint64_t timestamp)
+{
+	for (size_t ch = 0; ch < stretch->channels; ch++)
+		memset(stretch->overlap[ch], 0, stretch->frame * sizeof(float));
+	stretch->input_count = 0;
+	stretch->input_start = 0;
+	stretch->position = 0.0;
+	stretch->previous = 0;
+	stretch->started = false;
+	stretch->reset = false;
+	stretch->output_timestamp = timestamp;
+	stretch->output_frames = 0;
+}
+
+/* Adds a packet that starts at timestamp on the playback timeline, which
+ * plays at speed_percent. */
+void replay_stretch_push(struct replay_stretch *stretch,
+		const struct obs_audio_data *audio, uint64_t timestamp,
+		uint32_t sample_rate, float speed_percent)
+{
+	size_t channels = 0;
+	while (channels < MAX_AV_PLANES && audio->data[channels])
+		channels++;
+	if (!channels || !audio->frames || !sample_rate)
+		return;
+
+	if (stretch->sample_rate != sample_rate || stretch->channels != channels) {
+		stretch_configure(stretch, sample_rate, channels);
+		stretch->reset = true;
+	}
+	const int64_t gap = (int64_t)(timestamp - stretch->input_timestamp);
+	if (stretch->reset || gap > (int64_t)REPLAY_STRETCH_MAX_GAP ||
+			gap < -(int64_t)REPLAY_STRETCH_MAX_GAP)
+		stretch_restart(stretch, timestamp);
+
+	const size_t needed = stretch->input_count + audio->frames;
+	if (needed > stretch->input_capacity) {
+		size_t capacity = stretch->input_capacity ?
+				stretch->input_capacity : stretch->frame * 2;
+		while (capacity < needed)
+			capacity *= 2;
+		for (size_t ch = 0; ch < channels; ch++)
+			stretch->input[ch] = brealloc(stretch->input[ch],
+					capacity * sizeof(float));
+		stretch->mix = brealloc(stretch->mix, capacity * sizeof(float));
+		stretch->input_capacity = capacity;
+	}
+
+	float *mix = stretch->mix + stretch->input_count;
+	const float scale = 1.0f / (float)channels;
+	for (size_t ch = 0; ch < channels; ch++) {
+		const float *src = (const float*)audio->data[ch];
+		memcpy(stretch->input[ch] + stretch->input_count, src,
+				audio->frames * sizeof(float));
+		if (ch == 0) {
+			for (size_t i = 0; i < audio->frames; i++)
+				mix[i] = src[i] * scale;
+		} else {
+			for (size_t i = 0; i < audio->frames; i++)
+				mix[i] += src[i] * scale;
+		}
+	}
+	stretch->input_count += audio->frames;
+	stretch->input_timestamp = timestamp + (uint64_t)((double)audio_frames_to_ns(
+			sample_rate, audio->frames) * 100.0 / speed_percent);
+}
+
+/* start of the frame between low and high that matches the samples at
+ * natural best */
+static uint64_t stretch_search(struct replay_stretch *stretch,
+		uint64_t natural, uint64_t low, uint64_t high)
+{
+	const float *target = stretch->mix + (natural - stretch->input_start);
+	const float *candidate = stretch->mix + (low - stretch->input_start);
+	const size_t length = stretch->hop;
+	float energy = replay_audio_energy(candidate, length);
+	float best_score = 0.0f;
+	uint64_t best = natural >= low && natural <= high ? natural : low;
+
+	for (size_t i = 0; low + i <= high; i++) {
+		if (energy > 1e-9f) {
+			const float score = replay_audio_dot(target, candidate + i,
+					length) / sqrtf(energy);
+			if (score > best_score) {
+				best_score = score;
+				best = low + i;
+			}
+		}
+		energy += candidate[i + length] * candidate[i + length] -
+				candidate[i] * candidate[i];
+	}
+	return best;
+}
+
+static void stretch_output_reserve(struct replay_stretch *stretch,
+		size_t frames)
+{
+	if (frames <= stretch->output_capacity)
+		return;
+	size_t capacity = stretch->output_capacity ?
+			stretch->output_capacity : stretch->hop * 4;
+	while (capacity < frames)
+		capacity *= 2;
+	for (size_t ch = 0; ch < stretch->channels; ch++)
+		stretch->output[ch] = brealloc(stretch->output[ch],
+				capacity * sizeof(float));
+	stretch->output_capacity = capacity;
+}
+
+/* Adds the next frame and writes the finished half frame to the output at
+ * offset. Returns false when there is not enough input yet. */
+static bool stretch_frame(struct replay_stretch *stretch, size_t offset,
+		float speed_percent)
+{
+	const uint64_t position = (uint64_t)stretch->position;
+	const uint64_t input_end = stretch->input_start + stretch->input_count;
+	if (position + stretch->search + stretch->frame > input_end)
+		return false;
+
+	uint64_t start = position;
+	if (stretch->started) {
+		uint64_t low = position > stretch->search ?
+				position - stretch->search : 0;
+		if (low < stretch->input_start)
+			low = stretch->input_start;
+		start = stretch_search(stretch, stretch->previous + stretch->hop,
+				low, position + stretch->search);
+	}
+
+	const size_t keep = stretch->frame - stretch->hop;
+	for (size_t ch = 0; ch < stretch->channels; ch++) {
+		const float *src = stretch->input[ch] + (start - stretch->input_start);
+		float *overlap = stretch->overlap[ch];
+		for (size_t i = 0; i < stretch->frame; i++)
+			overlap[i] += stretch->window[i] * src[i];
+		memcpy(stretch->output[ch] + offset, overlap,
+				stretch->hop * sizeof(float));
+		memmove(overlap, overlap + stretch->hop, keep * sizeof(float));
+		memset(overlap + keep, 0, stretch->hop * sizeof(float));
+	}
+
+	stretch->previous = start;
+	stretch->started = true;
+	stretch->position += (double)stretch->hop * speed_percent / 100.0;
+	return true;
+}
+
+/* drops the input that no later frame or match can start in */
+static void stretch_trim_input(struct replay_stretch *stretch)
+{
+	const uint64_t position = (uint64_t)stretch->position;
+	uint64_t keep = position > stretch->search ?
+			position - stretch->search : 0;
+	if (stretch->started && stretch->previous + stretch->hop < keep)
+		keep = stretch->previous + stretch->hop;
+	if (keep > stretch->input_start + stretch->input_count)
+		keep = stretch->input_start + stretch->input_count;
+	if (keep <= stretch->input_start)
+		return;
+
+	const size_t drop = (size_t)(keep - stretch->input_start);
+	const size_t count = stretch->input_count - drop;
+	for (size_t ch = 0; ch < stretch->channels; ch++)
+		memmove(stretch->input[ch], stretch->input[ch] + drop,
+				count * sizeof(float));
+	memmove(stretch->mix, stretch->mix + drop, count * sizeof(float));
+	stretch->input_count = count;
+	stretch->input_start = keep;
+}
+
+/* Stretches the pushed input into out, at most up to the timestamp until.
+ * The data of out stays valid until the next call. Returns false when no
+ * output is ready. */
+bool replay_stretch_pull(struct replay_stretch *stretch, uint64_t until,
+		float speed_percent, struct obs_audio_data *out)
+{
+	memset(out, 0, sizeof(struct obs_audio_data));
+	if (stretch->reset || !stretch->channels || speed_percent <= 0.0f)
+		return false;
+
+	const uint64_t timestamp = stretch->output_timestamp +
+			audio_frames_to_ns(stretch->sample_rate, stretch->output_frames);
+	if (until <= timestamp)
+		return false;
+	/* whole half frames up to until, at most a second per call */
+	uint64_t wanted = until - timestamp;
+	if (wanted > 1000000000ULL)
+		wanted = 1000000000ULL;
+	wanted = wanted * stretch->sample_rate / 1000000000ULL;
+	const size_t frames = (size_t)((wanted + stretch->hop - 1) / stretch->hop);
+
+	size_t count = 0;
+	for (; count < frames; count++) {
+		stretch_output_reserve(stretch, (count + 1) * stretch->hop);
+		if (!stretch_frame(stretch, count * stretch->hop, speed_percent))
+			break;
+	}
+	stretch_trim_input(stretch);
+	if (!count)
+		return false;
+
+	out->frames = (uint32_t)(count * stretch->hop);
+	out->timestamp = timestamp;
+	for (size_t ch = 0; ch < stretch->channels; ch++)
+		out->data[ch] = (uint8_t*)stretch->output[ch];
+	stretch->output_frames += out->frames;
+	return true;
+}
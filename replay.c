@@ -1,62 +1,776 @@
 #include "replay.h"
 #include "obs-internal.h"
+#include <util/platform.h>
 #include "../../UI/obs-frontend-api/obs-frontend-api.h"
 #include <math.h>
 
 void free_audio_data(struct replay_filter *filter)
 {
-	while (filter->audio_frames.size) {
-		struct obs_audio_data audio;
+	struct replay_audio_packet packet;
 
-		circlebuf_pop_front(&filter->audio_frames, &audio,
-				sizeof(struct obs_audio_data));
-		free_audio_packet(&audio);
-	}
+	replay_audio_lock(filter);
+	while (replay_ring_pop(&filter->audio_packets, &packet))
+		continue;
+	replay_audio_unlock(filter);
+}
+
+static void free_frames(struct replay_filter *filter, struct replay_ring *frames)
+{
+	struct replay_video_entry entry;
+
+	while (replay_ring_pop(frames, &entry))
+		replay_filter_frame_release(filter, entry.frame);
 }
 
 void free_video_data(struct replay_filter *filter)
 {
-	while (filter->video_frames.size) {
-		struct obs_source_frame *frame;
+	struct obs_source_frame *frame;
+
+	pthread_mutex_lock(&filter->spill_mutex);
+	free_frames(filter, &filter->spilled_frames);
+	free_frames(filter, &filter->video_frames);
+	pthread_mutex_unlock(&filter->spill_mutex);
+	while (replay_ring_pop(&filter->worker_queue, &frame)) {
+		replay_filter_frame_release(filter, frame);
+		os_atomic_inc_long(&filter->worker_done);
+	}
+}
+
+#define REPLAY_ALIGN(size) (((size) + 31) & ~(size_t)31)
+
+size_t replay_frame_layout(enum video_format format, uint32_t width,
+		uint32_t height, uint32_t linesize[MAX_AV_PLANES],
+		size_t offset[MAX_AV_PLANES])
+{
+	uint32_t lines[MAX_AV_PLANES] = {0};
+	size_t size = 0;
+
+	memset(linesize, 0, sizeof(uint32_t) * MAX_AV_PLANES);
+	memset(offset, 0, sizeof(size_t) * MAX_AV_PLANES);
+
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+		linesize[0] = width;     lines[0] = height;
+		linesize[1] = width / 2; lines[1] = height / 2;
+		linesize[2] = width / 2; lines[2] = height / 2;
+		break;
+
+	case VIDEO_FORMAT_NV12:
+		linesize[0] = width;     lines[0] = height;
+		linesize[1] = width;     lines[1] = height / 2;
+		break;
+
+	case VIDEO_FORMAT_I444:
+		linesize[0] = width;     lines[0] = height;
+		linesize[1] = width;     lines[1] = height;
+		linesize[2] = width;     lines[2] = height;
+		break;
+
+	case VIDEO_FORMAT_YVYU:
+	case VIDEO_FORMAT_YUY2:
+	case VIDEO_FORMAT_UYVY:
+		linesize[0] = width * 2; lines[0] = height;
+		break;
+
+	case VIDEO_FORMAT_RGBA:
+	case VIDEO_FORMAT_BGRA:
+	case VIDEO_FORMAT_BGRX:
+		linesize[0] = width * 4; lines[0] = height;
+		break;
+
+	default:
+		return 0;
+	}
 
-		circlebuf_pop_front(&filter->video_frames, &frame,
+	for (size_t i = 0; i < MAX_AV_PLANES && linesize[i]; i++) {
+		offset[i] = size;
+		size += REPLAY_ALIGN((size_t)linesize[i] * lines[i]);
+	}
+	return size;
+}
+
+/* guards the free slots and the use count of every arena */
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void replay_frame_arena_free(struct replay_frame_arena *arena)
+{
+	circlebuf_free(&arena->free_slots);
+	/* allocated with malloc, bmalloc would abort obs when it fails */
+	free(arena->block);
+	bfree(arena->slots);
+	bfree(arena);
+}
+
+/* Returns NULL when the block can not be allocated, the capture then keeps
+ * using pooled frames. Only called from the worker thread. */
+static struct replay_frame_arena *replay_frame_arena_create(
+		struct replay_filter *filter, enum video_format format,
+		uint32_t width, uint32_t height, size_t slot_count)
+{
+	uint32_t linesize[MAX_AV_PLANES];
+	size_t offset[MAX_AV_PLANES];
+	const size_t slot_size = replay_frame_layout(format, width, height,
+			linesize, offset);
+	if (!slot_size || !slot_count)
+		return NULL;
+
+	const size_t wanted = slot_count;
+	if ((uint64_t)slot_count * slot_size > REPLAY_FRAME_ARENA_MAX)
+		slot_count = (size_t)(REPLAY_FRAME_ARENA_MAX / slot_size);
+	uint8_t *block = slot_count ? malloc(slot_size * slot_count) : NULL;
+	if (!block) {
+		blog(LOG_WARNING, "[replay_filter: '%s'] could not preallocate %llu frame slots of %ux%u (%.1f MB)",
+				obs_source_get_name(filter->src),
+				(unsigned long long)slot_count, width, height,
+				(double)slot_size * slot_count / (1024.0 * 1024.0));
+		return NULL;
+	}
+
+	struct replay_frame_arena *arena = bzalloc(sizeof(struct replay_frame_arena));
+	arena->block = block;
+	arena->slots = bzalloc(sizeof(struct obs_source_frame) * slot_count);
+	arena->slot_count = slot_count;
+	arena->slot_size = slot_size;
+	arena->format = format;
+	arena->width = width;
+	arena->height = height;
+	circlebuf_reserve(&arena->free_slots,
+			slot_count * sizeof(struct obs_source_frame*));
+
+	for (size_t i = 0; i < slot_count; i++) {
+		struct obs_source_frame *slot = arena->slots + i;
+		slot->format = format;
+		slot->width = width;
+		slot->height = height;
+		for (size_t j = 0; j < MAX_AV_PLANES && linesize[j]; j++) {
+			slot->linesize[j] = linesize[j];
+			slot->data[j] = arena->block + i * slot_size + offset[j];
+		}
+		slot->data[REPLAY_ARENA_PLANE] = (uint8_t*)arena;
+		circlebuf_push_back(&arena->free_slots, &slot,
 				sizeof(struct obs_source_frame*));
+	}
+
+	blog(LOG_INFO, "[replay_filter: '%s'] preallocated %llu of %llu frame slots of %ux%u (%.1f MB)",
+			obs_source_get_name(filter->src),
+			(unsigned long long)slot_count,
+			(unsigned long long)wanted, width, height,
+			(double)slot_size * slot_count / (1024.0 * 1024.0));
+	return arena;
+}
 
-		if (os_atomic_dec_long(&frame->refs) <= 0) {
-			obs_source_frame_destroy(frame);
-			frame = NULL;
+/* slots still referenced by replays keep the arena alive until released */
+static void replay_frame_arena_retire(struct replay_frame_arena *arena)
+{
+	if (!arena)
+		return;
+	pthread_mutex_lock(&arena_mutex);
+	arena->retired = true;
+	const bool unused = !arena->used;
+	pthread_mutex_unlock(&arena_mutex);
+	if (unused)
+		replay_frame_arena_free(arena);
+}
+
+static struct obs_source_frame *replay_frame_arena_acquire(
+		struct replay_frame_arena *arena)
+{
+	struct obs_source_frame *frame = NULL;
+
+	pthread_mutex_lock(&arena_mutex);
+	if (arena->free_slots.size) {
+		circlebuf_pop_front(&arena->free_slots, &frame,
+				sizeof(struct obs_source_frame*));
+		arena->used++;
+	}
+	pthread_mutex_unlock(&arena_mutex);
+	return frame;
+}
+
+static bool replay_frame_arena_reclaim(struct obs_source_frame *frame)
+{
+	struct replay_frame_arena *arena = (struct replay_frame_arena*)
+			frame->data[REPLAY_ARENA_PLANE];
+	if (!arena)
+		return false;
+
+	pthread_mutex_lock(&arena_mutex);
+	arena->used--;
+	if (!arena->retired) {
+		circlebuf_push_back(&arena->free_slots, &frame,
+				sizeof(struct obs_source_frame*));
+		arena = NULL;
+	} else if (arena->used) {
+		arena = NULL;
+	}
+	pthread_mutex_unlock(&arena_mutex);
+	if (arena)
+		replay_frame_arena_free(arena);
+	return true;
+}
+
+void replay_frame_release(struct obs_source_frame *frame)
+{
+	if (!frame || os_atomic_dec_long(&frame->refs) > 0)
+		return;
+	if (!replay_frame_arena_reclaim(frame) && !replay_spill_reclaim(frame))
+		obs_source_frame_destroy(frame);
+}
+
+size_t replay_filter_arena_slot_count(struct replay_filter *filter,
+		bool preallocate, uint32_t replays)
+{
+	if (!preallocate || !filter->ovi.fps_den)
+		return 0;
+	/* one slot per frame in the duration plus the frame being captured
+	 * before the oldest one is evicted */
+	const uint64_t frame_interval = (uint64_t)filter->ovi.fps_den *
+			SEC_TO_NSEC / filter->ovi.fps_num;
+	size_t slots;
+	if (filter->capture_interval > frame_interval)
+		slots = (size_t)(filter->duration / filter->capture_interval) + 2;
+	else
+		slots = (size_t)(filter->duration * filter->ovi.fps_num /
+				((uint64_t)filter->ovi.fps_den * SEC_TO_NSEC)) + 2;
+	/* the frames of loaded replays keep their slots until the replays
+	 * are removed, while the capture fills the buffer again */
+	return slots * ((size_t)(replays ? replays : 1) + 1);
+}
+
+/* The arena is built again by the worker thread for the next captured
+ * frame, the capture never allocates it. */
+void replay_filter_set_arena_slots(struct replay_filter *filter, size_t slots)
+{
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	if (filter->frame_arena_slots != slots) {
+		replay_frame_arena_retire(filter->frame_arena);
+		filter->frame_arena = NULL;
+		filter->frame_arena_slots = slots;
+		filter->frame_arena_format = VIDEO_FORMAT_NONE;
+		filter->frame_arena_width = 0;
+		filter->frame_arena_height = 0;
+		filter->frame_arena_wanted = false;
+	}
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+}
+
+/* Builds the arena the capture asked for. The capture takes pooled frames
+ * until it is there, and keeps doing so when it could not be allocated. */
+static void replay_filter_build_arena(struct replay_filter *filter)
+{
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	const bool wanted = filter->frame_arena_wanted;
+	const enum video_format format = filter->frame_arena_format;
+	const uint32_t width = filter->frame_arena_width;
+	const uint32_t height = filter->frame_arena_height;
+	const size_t slots = filter->frame_arena_slots;
+	filter->frame_arena_wanted = false;
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+	if (!wanted)
+		return;
+
+	struct replay_frame_arena *arena = replay_frame_arena_create(filter,
+			format, width, height, slots);
+
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	/* the capture size or the duration may have changed meanwhile */
+	if (filter->frame_arena_slots == slots &&
+			filter->frame_arena_format == format &&
+			filter->frame_arena_width == width &&
+			filter->frame_arena_height == height) {
+		struct replay_frame_arena *old = filter->frame_arena;
+		filter->frame_arena = arena;
+		arena = old;
+	}
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+	replay_frame_arena_retire(arena);
+}
+
+/* must be called with frame_pool_mutex locked */
+static struct obs_source_frame *replay_frame_pool_pop(struct replay_filter *filter,
+		enum video_format format, uint32_t width, uint32_t height)
+{
+	struct obs_source_frame *frame = NULL;
+
+	while (filter->frame_pool.size) {
+		circlebuf_pop_back(&filter->frame_pool, &frame,
+				sizeof(struct obs_source_frame*));
+
+		if (frame->format == format && frame->width == width &&
+				frame->height == height)
+			return frame;
+
+		/* pooled frames of an old format will never match again */
+		obs_source_frame_destroy(frame);
+		frame = NULL;
+	}
+	return NULL;
+}
+
+struct obs_source_frame *replay_filter_frame_create(struct replay_filter *filter,
+		enum video_format format, uint32_t width, uint32_t height)
+{
+	struct obs_source_frame *frame = NULL;
+	struct replay_frame_arena *retired = NULL;
+	bool request = false;
+
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	if (filter->frame_arena_slots) {
+		struct replay_frame_arena *arena = filter->frame_arena;
+		if (arena && (arena->format != format || arena->width != width ||
+				arena->height != height)) {
+			retired = arena;
+			arena = NULL;
+			filter->frame_arena = NULL;
+		}
+		if (arena) {
+			frame = replay_frame_arena_acquire(arena);
+			if (!frame)
+				filter->frame_arena_exhausted++;
+		} else if (filter->frame_arena_format != format ||
+				filter->frame_arena_width != width ||
+				filter->frame_arena_height != height) {
+			/* asked once per size, also when it could not be built */
+			filter->frame_arena_format = format;
+			filter->frame_arena_width = width;
+			filter->frame_arena_height = height;
+			filter->frame_arena_wanted = true;
+			request = true;
 		}
 	}
+	if (!frame)
+		frame = replay_frame_pool_pop(filter, format, width, height);
+	if (frame)
+		filter->frame_pool_hits++;
+	else
+		filter->frame_pool_misses++;
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+
+	replay_frame_arena_retire(retired);
+	if (request && filter->worker_sem)
+		os_sem_post(filter->worker_sem);
+	if (!frame)
+		frame = obs_source_frame_create(format, width, height);
+	frame->refs = 1;
+	return frame;
 }
-static inline uint64_t uint64_diff(uint64_t ts1, uint64_t ts2)
+
+struct obs_source_frame *replay_filter_pool_frame_create(
+		struct replay_filter *filter, enum video_format format,
+		uint32_t width, uint32_t height)
 {
-	return (ts1 < ts2) ?  (ts2 - ts1) : (ts1 - ts2);
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	struct obs_source_frame *frame = replay_frame_pool_pop(filter, format,
+			width, height);
+	if (frame)
+		filter->frame_pool_hits++;
+	else
+		filter->frame_pool_misses++;
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+
+	if (!frame)
+		frame = obs_source_frame_create(format, width, height);
+	frame->refs = 1;
+	return frame;
 }
 
-struct obs_audio_data *replay_filter_audio(void *data,
-		struct obs_audio_data *audio)
+void replay_filter_frame_release(struct replay_filter *filter,
+		struct obs_source_frame *frame)
 {
-	struct replay_filter *filter = data;
-	struct obs_audio_data cached = *audio;
-	bool threshold = !filter->trigger_threshold;
+	if (!frame || os_atomic_dec_long(&frame->refs) > 0)
+		return;
+	if (replay_frame_arena_reclaim(frame) || replay_spill_reclaim(frame))
+		return;
+	if (replay_frame_is_compressed(frame)) {
+		obs_source_frame_destroy(frame);
+		return;
+	}
+
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	if (filter->frame_pool.size <
+			REPLAY_FRAME_POOL_MAX * sizeof(struct obs_source_frame*)) {
+		circlebuf_push_back(&filter->frame_pool, &frame,
+				sizeof(struct obs_source_frame*));
+		frame = NULL;
+	}
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+
+	if (frame)
+		obs_source_frame_destroy(frame);
+}
+
+void free_frame_pool(struct replay_filter *filter)
+{
+	pthread_mutex_lock(&filter->frame_pool_mutex);
+	while (filter->frame_pool.size) {
+		struct obs_source_frame *frame;
+
+		circlebuf_pop_front(&filter->frame_pool, &frame,
+				sizeof(struct obs_source_frame*));
+		obs_source_frame_destroy(frame);
+	}
+	circlebuf_free(&filter->frame_pool);
+	struct replay_frame_arena *arena = filter->frame_arena;
+	filter->frame_arena = NULL;
+	pthread_mutex_unlock(&filter->frame_pool_mutex);
+	replay_frame_arena_retire(arena);
+
+	if (filter->frame_pool_hits || filter->frame_pool_misses)
+		blog(LOG_INFO, "[replay_filter: '%s'] frame pool hits: %llu, misses: %llu",
+				obs_source_get_name(filter->src),
+				(unsigned long long)filter->frame_pool_hits,
+				(unsigned long long)filter->frame_pool_misses);
+	if (filter->frame_arena_exhausted)
+		blog(LOG_INFO, "[replay_filter: '%s'] %llu frames did not fit in the preallocated capture buffer",
+				obs_source_get_name(filter->src),
+				(unsigned long long)filter->frame_arena_exhausted);
+}
+void replay_filter_init(struct replay_filter *filter)
+{
+	replay_ring_init(&filter->video_frames, sizeof(struct replay_video_entry));
+	replay_ring_init(&filter->spilled_frames, sizeof(struct replay_video_entry));
+	replay_ring_init(&filter->worker_queue, sizeof(struct obs_source_frame*));
+	replay_ring_init(&filter->audio_packets, sizeof(struct replay_audio_packet));
+	pthread_mutex_init(&filter->frame_pool_mutex, NULL);
+	pthread_mutex_init(&filter->spill_mutex, NULL);
+	pthread_mutex_init(&filter->audio_mutex, NULL);
+	obs_get_audio_info(&filter->oai);
+}
+
+void replay_filter_set_capture(struct replay_filter *filter, uint32_t height,
+		uint32_t fps)
+{
+	filter->capture_height = height;
+	const uint64_t interval = fps ? SEC_TO_NSEC / fps : 0;
+	if (interval != filter->capture_interval) {
+		filter->capture_interval = interval;
+		filter->capture_next = 0;
+	}
+}
+
+/* size frames are captured at, the capture height keeps the aspect ratio
+ * and only ever scales down */
+void replay_filter_capture_size(struct replay_filter *filter, uint32_t width,
+		uint32_t height, uint32_t *capture_width, uint32_t *capture_height)
+{
+	*capture_width = width;
+	*capture_height = height;
+	if (!filter->capture_height || filter->capture_height >= height)
+		return;
+
+	const uint32_t h = filter->capture_height & ~1u;
+	const uint32_t w = (uint32_t)(((uint64_t)width * h / height + 1) & ~1u);
+	if (!w || !h)
+		return;
+	*capture_width = w;
+	*capture_height = h;
+}
+
+/* Decimates the capture to the capture fps, returns true for a frame that
+ * should be skipped. A frame up to a quarter interval early is still taken
+ * so jitter in the timestamps does not drop frames that belong in, and a
+ * timestamp that jumps back restarts the decimation. */
+bool replay_filter_skip_frame(struct replay_filter *filter, uint64_t timestamp)
+{
+	const uint64_t interval = filter->capture_interval;
+	const uint64_t next = filter->capture_next;
+
+	if (!interval)
+		return false;
+	if (next && timestamp + interval / 4 < next &&
+			timestamp + interval * 2 > next)
+		return true;
+	if (!next || timestamp > next + interval || timestamp + interval < next)
+		filter->capture_next = timestamp + interval;
+	else
+		filter->capture_next = next + interval;
+	return false;
+}
+
+static bool trim_frames(struct replay_filter *filter, struct replay_ring *frames,
+		uint64_t last_timestamp)
+{
+	struct replay_video_entry entry;
+	unsigned long index;
+
+	while (replay_ring_peek_front(frames, &entry, &index)) {
+		if (last_timestamp <= entry.timestamp ||
+				last_timestamp - entry.timestamp <= filter->duration)
+			return false;
+
+		/* a retrieve may have taken it in the meantime */
+		if (replay_ring_take(frames, index))
+			replay_filter_frame_release(filter, entry.frame);
+	}
+	return true;
+}
+
+/* spill_mutex keeps a snapshot from referencing a frame that is being
+ * released */
+static void replay_filter_trim_video(struct replay_filter *filter,
+		uint64_t last_timestamp)
+{
+	pthread_mutex_lock(&filter->spill_mutex);
+	if (trim_frames(filter, &filter->spilled_frames, last_timestamp))
+		trim_frames(filter, &filter->video_frames, last_timestamp);
+	pthread_mutex_unlock(&filter->spill_mutex);
+}
+
+/* Adds the frame to video_frames and drops the frames that are older than
+ * the duration. Only the worker thread stores frames, trimming can wait on
+ * spill_mutex while a retrieve holds it. */
+static void replay_filter_store_video(struct replay_filter *filter,
+		struct obs_source_frame *frame)
+{
+	struct replay_video_entry entry;
+
+	entry.frame = frame;
+	entry.timestamp = frame->timestamp;
+	if (!replay_ring_push(&filter->video_frames, &entry)) {
+		replay_filter_frame_release(filter, frame);
+		return;
+	}
+	replay_filter_trim_video(filter, entry.timestamp);
+}
 
-	for (size_t i = 0; i < MAX_AV_PLANES; i++) {
-		if (!audio->data[i])
+/* only called from the capture thread, never blocks */
+void replay_filter_push_video(struct replay_filter *filter,
+		struct obs_source_frame *frame)
+{
+	if (!replay_ring_push(&filter->worker_queue, &frame)) {
+		replay_filter_frame_release(filter, frame);
+		return;
+	}
+	os_atomic_inc_long(&filter->worker_queued);
+	os_sem_post(filter->worker_sem);
+}
+
+/* Waits until the worker thread stored the frames that were queued when
+ * it was called, so a retrieve gets the newest frames. */
+void replay_filter_flush_video(struct replay_filter *filter)
+{
+	const unsigned long queued =
+			(unsigned long)os_atomic_load_long(&filter->worker_queued);
+	const uint64_t start = os_gettime_ns();
+
+	while (filter->worker_active &&
+			(long)(queued - (unsigned long)os_atomic_load_long(
+			&filter->worker_done)) > 0) {
+		if (os_gettime_ns() - start > REPLAY_FLUSH_TIMEOUT)
 			break;
+		os_sleep_ms(1);
+	}
+}
 
-		cached.data[i] = bmemdup(audio->data[i],
-				audio->frames * sizeof(float));
+static void replay_filter_compress_frame(struct replay_filter *filter,
+		struct obs_source_frame **frame, size_t backlog,
+		uint8_t **scratch, size_t *scratch_size)
+{
+	struct obs_source_frame *compressed = NULL;
+	size_t raw_size = 0;
+	size_t size = 0;
+
+	if (backlog <= REPLAY_COMPRESS_BACKLOG_MAX) {
+		const uint64_t start = os_gettime_ns();
+		compressed = replay_frame_compress(*frame,
+				filter->compress_near, scratch, scratch_size,
+				&raw_size, &size);
+		filter->compress_time += os_gettime_ns() - start;
+	}
+	if (!compressed) {
+		filter->compress_skipped++;
+		return;
+	}
+	filter->compress_frames++;
+	filter->compress_raw_bytes += raw_size;
+	filter->compress_bytes += size;
+	replay_filter_frame_release(filter, *frame);
+	*frame = compressed;
+}
 
-		for (size_t j = 0; !threshold && j < audio->frames; j++) {
-			if(fabsf(((float*)audio->data[i])[j]) > filter->threshold)
-				threshold = true;
+/* Moves the frames that are older than spill_duration from the front of
+ * video_frames to spilled_frames. spill_mutex keeps a retrieve from running
+ * while a frame is in neither ring. */
+static void replay_filter_spill_video(struct replay_filter *filter,
+		uint64_t last_timestamp)
+{
+	struct replay_video_entry entry;
+	unsigned long index;
+
+	pthread_mutex_lock(&filter->spill_mutex);
+	while (replay_ring_peek_front(&filter->video_frames, &entry, &index)) {
+		if (last_timestamp <= entry.timestamp ||
+				last_timestamp - entry.timestamp <=
+				filter->spill_duration)
+			break;
+		if (!replay_ring_take(&filter->video_frames, index))
+			continue;
+
+		/* frames that can not be spilled stay in memory but still
+		 * move to the older tier to keep the order */
+		struct obs_source_frame *spilled = replay_spill_frame(filter,
+				entry.frame);
+		if (spilled) {
+			/* a snapshot may be playing the frame with its
+			 * timestamp changed */
+			spilled->timestamp = entry.timestamp;
+			replay_filter_frame_release(filter, entry.frame);
+			entry.frame = spilled;
 		}
+		if (!replay_ring_push(&filter->spilled_frames, &entry))
+			replay_filter_frame_release(filter, entry.frame);
+	}
+	pthread_mutex_unlock(&filter->spill_mutex);
+}
+
+static void *replay_filter_worker_thread(void *data)
+{
+	struct replay_filter *filter = data;
+	uint8_t *scratch = NULL;
+	size_t scratch_size = 0;
+
+	os_set_thread_name("replay_filter: worker");
+
+	while (os_sem_wait(filter->worker_sem) == 0) {
+		struct obs_source_frame *frame;
+
+		if (filter->worker_stop)
+			break;
+		replay_filter_build_arena(filter);
+		if (!replay_ring_pop(&filter->worker_queue, &frame))
+			continue;
+
+		if (filter->compress)
+			replay_filter_compress_frame(filter, &frame,
+					replay_ring_count(&filter->worker_queue),
+					&scratch, &scratch_size);
+
+		const uint64_t timestamp = frame->timestamp;
+		replay_filter_store_video(filter, frame);
+		if (filter->spill_duration && filter->spill_directory)
+			replay_filter_spill_video(filter, timestamp);
+		os_atomic_inc_long(&filter->worker_done);
 	}
-	if(filter->trigger_threshold && threshold)
+
+	bfree(scratch);
+	return NULL;
+}
+
+static void replay_filter_stop_worker(struct replay_filter *filter)
+{
+	if (!filter->worker_active)
+		return;
+	filter->worker_active = false;
+
+	filter->worker_stop = true;
+	os_sem_post(filter->worker_sem);
+	pthread_join(filter->worker_thread, NULL);
+
+	replay_spill_segment_release(filter->spill_segment);
+	filter->spill_segment = NULL;
+}
+
+/* Captured video always goes through the worker thread, it is the only
+ * thread that pushes to video_frames and spilled_frames, so capture never
+ * waits for a retrieve. */
+void replay_filter_start(struct replay_filter *filter)
+{
+	if (filter->worker_active)
+		return;
+
+	filter->worker_stop = false;
+	if (!filter->worker_sem && os_sem_init(&filter->worker_sem, 0) != 0)
+		return;
+	if (pthread_create(&filter->worker_thread, NULL,
+			replay_filter_worker_thread, filter) != 0)
+		return;
+	filter->worker_active = true;
+
+	/* frames queued while the thread was stopped */
+	for (size_t i = replay_ring_count(&filter->worker_queue); i > 0; i--)
+		os_sem_post(filter->worker_sem);
+}
+
+void replay_filter_set_compress(struct replay_filter *filter, bool compress,
+		uint32_t near)
+{
+	/* the stripes of a frame are coded on the copy pool */
+	if (compress != filter->compress) {
+		if (compress)
+			replay_copy_pool_acquire();
+		else
+			replay_copy_pool_release();
+	}
+	filter->compress_near = near;
+	filter->compress = compress;
+}
+
+void replay_filter_set_spill(struct replay_filter *filter, uint64_t duration,
+		const char *directory)
+{
+	if (directory && !*directory)
+		directory = NULL;
+
+	if (!directory != !filter->spill_directory || (directory &&
+			strcmp(directory, filter->spill_directory) != 0)) {
+		/* the worker owns the current segment */
+		const bool active = filter->worker_active;
+		replay_filter_stop_worker(filter);
+		bfree(filter->spill_directory);
+		filter->spill_directory = directory ? bstrdup(directory) : NULL;
+		filter->spill_failed = false;
+		if (active)
+			replay_filter_start(filter);
+	}
+	filter->spill_duration = duration;
+}
+
+void replay_filter_stop(struct replay_filter *filter)
+{
+	replay_filter_stop_worker(filter);
+	os_sem_destroy(filter->worker_sem);
+	filter->worker_sem = NULL;
+	bfree(filter->spill_directory);
+	filter->spill_directory = NULL;
+	if (filter->compress) {
+		replay_copy_pool_release();
+		filter->compress = false;
+	}
+
+	if (filter->compress_frames)
+		blog(LOG_INFO, "[replay_filter: '%s'] compressed %llu frames "
+				"to %.1f%% in %.2f ms per frame, %llu frames stored "
+				"uncompressed",
+				obs_source_get_name(filter->src),
+				(unsigned long long)filter->compress_frames,
+				filter->compress_bytes * 100.0 /
+						filter->compress_raw_bytes,
+				filter->compress_time / 1000000.0 /
+						filter->compress_frames,
+				(unsigned long long)filter->compress_skipped);
+	if (filter->spill_frames)
+		blog(LOG_INFO, "[replay_filter: '%s'] spilled %llu frames "
+				"(%.1f MB) to disk",
+				obs_source_get_name(filter->src),
+				(unsigned long long)filter->spill_frames,
+				filter->spill_bytes / (1024.0 * 1024.0));
+}
+
+static inline uint64_t uint64_diff(uint64_t ts1, uint64_t ts2)
+{
+	return (ts1 < ts2) ?  (ts2 - ts1) : (ts1 - ts2);
+}
+
+struct obs_audio_data *replay_filter_audio(void *data,
+		struct obs_audio_data *audio)
+{
+	struct replay_filter *filter = data;
+	if(filter->trigger_threshold && replay_audio_level(audio,
+			filter->threshold_rms, filter->threshold) > filter->threshold)
 	{
 		filter->trigger_threshold(filter->threshold_data);
 	}
-	const uint64_t timestamp = cached.timestamp;
+	const uint64_t timestamp = audio->timestamp;
 	uint64_t adjusted_time = timestamp + filter->timing_adjust;
 	const uint64_t os_time = os_gettime_ns();
 	if(filter->timing_adjust && uint64_diff(os_time, timestamp) < MAX_TS_VAR)
@@ -68,115 +782,63 @@ struct obs_audio_data *replay_filter_audio(void *data,
 		filter->timing_adjust = os_time - timestamp;
 		adjusted_time = os_time;
 	}
-	cached.timestamp = adjusted_time;
-
-	pthread_mutex_lock(&filter->mutex);
-
-	circlebuf_push_back(&filter->audio_frames, &cached, sizeof(cached));
-	
-	circlebuf_peek_front(&filter->audio_frames, &cached, sizeof(cached));
 
-	uint64_t cur_duration = adjusted_time - cached.timestamp;
-	while (filter->audio_frames.size > sizeof(cached) && cur_duration >= filter->duration + MAX_TS_VAR){
-
-		circlebuf_pop_front(&filter->audio_frames, NULL, sizeof(cached));
-
-		free_audio_packet(&cached);
-		circlebuf_peek_front(&filter->audio_frames, &cached, sizeof(cached));
-		cur_duration = adjusted_time - cached.timestamp;
-	}
-	pthread_mutex_unlock(&filter->mutex);
+	replay_audio_push(filter, audio, adjusted_time);
 	replay_filter_check(filter);
 	return audio;
 }
 
-static inline void copy_frame_data_line(struct obs_source_frame *dst,
-		const struct obs_source_frame *src, uint32_t plane, uint32_t y)
-{
-	const uint32_t pos_src = y * src->linesize[plane];
-	const uint32_t pos_dst = y * dst->linesize[plane];
-	const uint32_t bytes = dst->linesize[plane] < src->linesize[plane] ?
-		dst->linesize[plane] : src->linesize[plane];
-
-	memcpy(dst->data[plane] + pos_dst, src->data[plane] + pos_src, bytes);
-}
-
 static inline void copy_frame_data_plane(struct obs_source_frame *dst,
 		const struct obs_source_frame *src,
-		uint32_t plane, uint32_t lines)
-{
-	if (dst->linesize[plane] != src->linesize[plane])
-		for (uint32_t y = 0; y < lines; y++)
-			copy_frame_data_line(dst, src, plane, y);
-	else
-		memcpy(dst->data[plane], src->data[plane],
-				dst->linesize[plane] * lines);
-}
-
-static void copy_frame_data_line_y800(uint32_t *dst, uint8_t *src, uint8_t *end)
+		uint32_t plane, uint32_t first, uint32_t lines)
 {
-	while (src < end) {
-		register uint32_t val = *(src++);
-		val |= (val << 8);
-		val |= (val << 16);
-		*(dst++) = val;
-	}
+	replay_copy_plane(dst->data[plane] + (size_t)first * dst->linesize[plane],
+			dst->linesize[plane],
+			src->data[plane] + (size_t)first * src->linesize[plane],
+			src->linesize[plane], lines);
 }
 
 static inline void copy_frame_data_y800(struct obs_source_frame *dst,
-		const struct obs_source_frame *src)
+		const struct obs_source_frame *src, uint32_t first, uint32_t lines)
 {
-	uint32_t *ptr_dst;
-	uint8_t  *ptr_src;
-	uint8_t  *src_end;
+	uint8_t *ptr_dst = dst->data[0] + (size_t)first * dst->linesize[0];
+	const uint8_t *ptr_src = src->data[0] + (size_t)first * src->linesize[0];
 
 	if ((src->linesize[0] * 4) != dst->linesize[0]) {
-		for (uint32_t cy = 0; cy < src->height; cy++) {
-			ptr_dst = (uint32_t*)
-				(dst->data[0] + cy * dst->linesize[0]);
-			ptr_src = (src->data[0] + cy * src->linesize[0]);
-			src_end = ptr_src + src->width;
-
-			copy_frame_data_line_y800(ptr_dst, ptr_src, src_end);
-		}
+		for (uint32_t cy = 0; cy < lines; cy++)
+			replay_expand_y800((uint32_t*)
+					(ptr_dst + cy * dst->linesize[0]),
+					ptr_src + cy * src->linesize[0],
+					src->width);
 	} else {
-		ptr_dst = (uint32_t*)dst->data[0];
-		ptr_src = (uint8_t *)src->data[0];
-		src_end = ptr_src + src->height * src->linesize[0];
-
-		copy_frame_data_line_y800(ptr_dst, ptr_src, src_end);
+		replay_expand_y800((uint32_t*)ptr_dst, ptr_src,
+				(size_t)lines * src->linesize[0]);
 	}
 }
 
-void copy_frame_data(struct obs_source_frame *dst,
-		const struct obs_source_frame *src)
+/* lines of every plane of the frame, returns the bytes to write */
+static size_t copy_frame_data_lines(const struct obs_source_frame *frame,
+		uint32_t lines[MAX_AV_PLANES])
 {
-	dst->flip         = src->flip;
-	dst->full_range   = src->full_range;
-	dst->timestamp    = src->timestamp;
-	memcpy(dst->color_matrix, src->color_matrix, sizeof(float) * 16);
-	if (!dst->full_range) {
-		size_t const size = sizeof(float) * 3;
-		memcpy(dst->color_range_min, src->color_range_min, size);
-		memcpy(dst->color_range_max, src->color_range_max, size);
-	}
+	size_t size = 0;
 
-	switch (src->format) {
+	memset(lines, 0, sizeof(uint32_t) * MAX_AV_PLANES);
+	switch (frame->format) {
 	case VIDEO_FORMAT_I420:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height/2);
-		copy_frame_data_plane(dst, src, 2, dst->height/2);
+		lines[0] = frame->height;
+		lines[1] = frame->height/2;
+		lines[2] = frame->height/2;
 		break;
 
 	case VIDEO_FORMAT_NV12:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height/2);
+		lines[0] = frame->height;
+		lines[1] = frame->height/2;
 		break;
 
 	case VIDEO_FORMAT_I444:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height);
-		copy_frame_data_plane(dst, src, 2, dst->height);
+		lines[0] = frame->height;
+		lines[1] = frame->height;
+		lines[2] = frame->height;
 		break;
 
 	case VIDEO_FORMAT_YVYU:
@@ -186,18 +848,73 @@ void copy_frame_data(struct obs_source_frame *dst,
 	case VIDEO_FORMAT_RGBA:
 	case VIDEO_FORMAT_BGRA:
 	case VIDEO_FORMAT_BGRX:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		break;
-
 	case VIDEO_FORMAT_Y800:
-		copy_frame_data_y800(dst, src);
+		lines[0] = frame->height;
 		break;
 	}
+	for (size_t i = 0; i < MAX_AV_PLANES && lines[i]; i++)
+		size += (size_t)frame->linesize[i] * lines[i];
+	return size;
+}
+
+struct copy_frame_job {
+	struct obs_source_frame *dst;
+	const struct obs_source_frame *src;
+	const uint32_t *lines;
+	size_t stripes;
+};
+
+/* copies the horizontal stripe of every plane */
+static void copy_frame_data_stripe(void *param, size_t stripe)
+{
+	struct copy_frame_job *job = param;
+
+	for (size_t i = 0; i < MAX_AV_PLANES && job->lines[i]; i++) {
+		const uint32_t first = (uint32_t)(
+				(uint64_t)job->lines[i] * stripe / job->stripes);
+		const uint32_t last = (uint32_t)(
+				(uint64_t)job->lines[i] * (stripe + 1) / job->stripes);
+		if (job->src->format == VIDEO_FORMAT_Y800)
+			copy_frame_data_y800(job->dst, job->src, first, last - first);
+		else
+			copy_frame_data_plane(job->dst, job->src, (uint32_t)i,
+					first, last - first);
+	}
+}
+
+/* With parallel set, frames of at least REPLAY_PARALLEL_COPY_MIN bytes are
+ * copied in stripes on the shared copy pool, smaller frames and frames that
+ * find the pool busy are copied on the calling thread. */
+void copy_frame_data(struct obs_source_frame *dst,
+		const struct obs_source_frame *src, bool parallel)
+{
+	uint32_t lines[MAX_AV_PLANES];
+
+	dst->flip         = src->flip;
+	dst->full_range   = src->full_range;
+	dst->timestamp    = src->timestamp;
+	memcpy(dst->color_matrix, src->color_matrix, sizeof(float) * 16);
+	if (!dst->full_range) {
+		size_t const size = sizeof(float) * 3;
+		memcpy(dst->color_range_min, src->color_range_min, size);
+		memcpy(dst->color_range_max, src->color_range_max, size);
+	}
+
+	struct copy_frame_job job = {dst, src, lines, 1};
+	if (copy_frame_data_lines(dst, lines) >= REPLAY_PARALLEL_COPY_MIN &&
+			parallel) {
+		job.stripes = replay_copy_pool_stripes();
+		if (job.stripes > 1 && replay_copy_pool_run(
+				copy_frame_data_stripe, &job, job.stripes))
+			return;
+		job.stripes = 1;
+	}
+	copy_frame_data_stripe(&job, 0);
 }
 
 void obs_source_frame_copy(struct obs_source_frame * dst,const struct obs_source_frame *src)
 {
-	copy_frame_data(dst, src);
+	copy_frame_data(dst, src, false);
 }
 
 void obs_enum_scenes(bool (*enum_proc)(void*, obs_source_t*), void *param)
@@ -222,6 +939,7 @@ extern struct obs_source_info replay_source_info;
 
 bool obs_module_load(void)
 {
+	replay_simd_init();
 	obs_register_source(&replay_source_info);
 	obs_register_source(&replay_filter_info);
 	obs_register_source(&replay_filter_audio_info);
@@ -3,33 +3,160 @@
 #include <util/circlebuf.h>
 #include <util/threading.h>
 
+struct replay_frame_arena {
+	/* slot_count frames whose planes live in one contiguous block */
+	struct obs_source_frame        *slots;
+	uint8_t                        *block;
+	size_t                         slot_count;
+	size_t                         slot_size;
+	enum video_format              format;
+	uint32_t                       width;
+	uint32_t                       height;
+
+	/* contains struct obs_source_frame* of unused slots */
+	struct circlebuf               free_slots;
+	size_t                         used;
+	bool                           retired;
+};
+
+/* file backed memory mapping that spilled frames point into, unmapped when
+ * the last frame in it is released */
+struct replay_spill_segment {
+	uint8_t                        *data;
+	size_t                         size;
+	size_t                         used;
+	volatile long                  refs;
+#ifdef _WIN32
+	void                           *file;
+	void                           *mapping;
+#endif
+};
+
+#define REPLAY_RING_BUFFERS 24
+#define REPLAY_STAGE_SURFACES 3
+
+struct replay_ring_buffer {
+	uint8_t                        *data;
+	unsigned long                  mask;
+};
+
+/* lock free ring, one thread pushes and any thread can take from the front */
+struct replay_ring {
+	volatile long                  head;
+	volatile long                  tail;
+	volatile long                  buffer;
+	size_t                         element_size;
+	struct replay_ring_buffer      buffers[REPLAY_RING_BUFFERS];
+};
+
+struct replay_audio_packet {
+	uint64_t                       timestamp;
+	uint64_t                       offset;
+	uint32_t                       frames;
+};
+
+/* one ring of samples per channel, mask + 1 samples long */
+struct replay_audio_buffer {
+	float                          *data[MAX_AV_PLANES];
+	uint64_t                       mask;
+	size_t                         channels;
+};
+
+struct replay_video_entry {
+	struct obs_source_frame        *frame;
+	uint64_t                       timestamp;
+};
+
 struct replay_filter {
 
-	/* contains struct obs_source_frame* */
-	struct circlebuf               video_frames;
+	/* contains struct replay_video_entry, pushed by the worker thread */
+	struct replay_ring             video_frames;
 
-	/* stores the audio data */
-	struct circlebuf               audio_frames;
+	/* contains struct replay_audio_packet, pushed by the audio thread,
+	 * the samples are in audio_buffer */
+	struct replay_ring             audio_packets;
+	struct replay_audio_buffer     audio_buffer;
+	uint64_t                       audio_position;
+	/* held by retrieves, the audio thread only takes it while
+	 * audio_locked is set and marks its pushes with audio_pushing */
+	pthread_mutex_t                audio_mutex;
+	volatile bool                  audio_locked;
+	volatile bool                  audio_pushing;
+	/* a snapshot copies the samples after releasing the lock, buffers a
+	 * grow replaces meanwhile are kept until it is done */
+	bool                           audio_copying;
+	float                          *audio_retired[MAX_AV_PLANES];
+
+	/* contains struct obs_source_frame* evicted frames ready for reuse */
+	struct circlebuf               frame_pool;
+	pthread_mutex_t                frame_pool_mutex;
+	uint64_t                       frame_pool_hits;
+	uint64_t                       frame_pool_misses;
+	struct replay_frame_arena      *frame_arena;
+	size_t                         frame_arena_slots;
+	/* size the capture asked the worker thread to build the arena for */
+	enum video_format              frame_arena_format;
+	uint32_t                       frame_arena_width;
+	uint32_t                       frame_arena_height;
+	bool                           frame_arena_wanted;
+	uint64_t                       frame_arena_exhausted;
+
+	/* contains struct obs_source_frame* captured frames waiting for the
+	 * worker thread, pushed by the capture thread. worker_queued and
+	 * worker_done count the frames that went in and came out. */
+	struct replay_ring             worker_queue;
+	volatile long                  worker_queued;
+	volatile long                  worker_done;
+	pthread_t                      worker_thread;
+	os_sem_t                       *worker_sem;
+	bool                           worker_active;
+	volatile bool                  worker_stop;
+	bool                           compress;
+	uint32_t                       compress_near;
+	uint64_t                       compress_frames;
+	uint64_t                       compress_skipped;
+	uint64_t                       compress_raw_bytes;
+	uint64_t                       compress_bytes;
+	uint64_t                       compress_time;
+
+	/* contains struct replay_video_entry frames older than video_frames
+	 * that the worker thread moved to spill segments, spill_mutex is held
+	 * while a frame is moved and while the frames are taken out */
+	struct replay_ring             spilled_frames;
+	pthread_mutex_t                spill_mutex;
+	uint64_t                       spill_duration;
+	char                           *spill_directory;
+	struct replay_spill_segment    *spill_segment;
+	uint64_t                       spill_frames;
+	uint64_t                       spill_bytes;
+	bool                           spill_failed;
 
 	struct obs_video_info ovi;
 	struct obs_audio_info oai;
 
 	gs_texrender_t* texrender;
-	gs_stagesurf_t* stagesurface;
+	gs_stagesurf_t* stagesurfaces[REPLAY_STAGE_SURFACES];
+	uint64_t stage_timestamps[REPLAY_STAGE_SURFACES];
+	size_t stage_index;
 
 	uint32_t known_width;
 	uint32_t known_height;
 
-	uint8_t* video_data;
-	uint32_t video_linesize;
-	video_t* video_output;
-
 	uint64_t duration;
 	obs_source_t *src;
-	pthread_mutex_t    mutex;
+	uint64_t capture_timestamp;
 	int64_t timing_adjust;
 	bool internal_frames;
+	bool zero_copy;
+	bool parallel_copy;
+	enum video_format capture_format;
+	uint32_t capture_height;
+	uint64_t capture_interval;
+	uint64_t capture_next;
+	uint8_t *scale_scratch;
+	size_t scale_scratch_size;
 	float threshold;
+	bool threshold_rms;
 	void (*trigger_threshold)(void *data);
 	void *threshold_data;
 	uint64_t last_check;
@@ -39,7 +166,74 @@ void obs_source_frame_copy(struct obs_source_frame * dst,const struct obs_source
 void free_audio_packet(struct obs_audio_data *audio);
 struct obs_audio_data *replay_filter_audio(void *data,struct obs_audio_data *audio);
 void free_video_data(struct replay_filter *filter);
+struct obs_source_frame *replay_filter_frame_create(struct replay_filter *filter, enum video_format format, uint32_t width, uint32_t height);
+struct obs_source_frame *replay_filter_pool_frame_create(struct replay_filter *filter, enum video_format format, uint32_t width, uint32_t height);
+void replay_filter_frame_release(struct replay_filter *filter, struct obs_source_frame *frame);
+void free_frame_pool(struct replay_filter *filter);
+void replay_filter_set_arena_slots(struct replay_filter *filter, size_t slots);
+size_t replay_filter_arena_slot_count(struct replay_filter *filter, bool preallocate, uint32_t replays);
+void replay_frame_release(struct obs_source_frame *frame);
+void replay_ring_init(struct replay_ring *ring, size_t element_size);
+void replay_ring_free(struct replay_ring *ring);
+size_t replay_ring_count(struct replay_ring *ring);
+bool replay_ring_push(struct replay_ring *ring, const void *element);
+bool replay_ring_peek_front(struct replay_ring *ring, void *element, unsigned long *index);
+bool replay_ring_peek(struct replay_ring *ring, unsigned long index, void *element);
+unsigned long replay_ring_lower_bound(struct replay_ring *ring, size_t key_offset, uint64_t key);
+bool replay_ring_peek_back(struct replay_ring *ring, void *element);
+bool replay_ring_take(struct replay_ring *ring, unsigned long index);
+bool replay_ring_take_range(struct replay_ring *ring, unsigned long index, size_t count);
+bool replay_ring_pop(struct replay_ring *ring, void *element);
+void replay_filter_init(struct replay_filter *filter);
+void replay_filter_set_capture(struct replay_filter *filter, uint32_t height, uint32_t fps);
+void replay_filter_capture_size(struct replay_filter *filter, uint32_t width, uint32_t height, uint32_t *capture_width, uint32_t *capture_height);
+bool replay_filter_skip_frame(struct replay_filter *filter, uint64_t timestamp);
+void replay_filter_push_video(struct replay_filter *filter, struct obs_source_frame *frame);
+void replay_filter_flush_video(struct replay_filter *filter);
+void replay_filter_set_compress(struct replay_filter *filter, bool compress, uint32_t near);
+void replay_filter_start(struct replay_filter *filter);
+void replay_filter_stop(struct replay_filter *filter);
+void replay_filter_set_spill(struct replay_filter *filter, uint64_t duration, const char *directory);
+struct obs_source_frame *replay_spill_frame(struct replay_filter *filter, const struct obs_source_frame *frame);
+bool replay_spill_reclaim(struct obs_source_frame *frame);
+void replay_spill_segment_release(struct replay_spill_segment *segment);
+size_t replay_frame_compressed_size(const struct obs_source_frame *frame);
+bool replay_frame_is_compressed(const struct obs_source_frame *frame);
+struct obs_source_frame *replay_frame_compress(const struct obs_source_frame *frame, uint32_t near, uint8_t **scratch, size_t *scratch_size, size_t *raw_size, size_t *size);
+bool replay_frame_decompress(struct obs_source_frame *dst, const struct obs_source_frame *src);
+void copy_frame_data(struct obs_source_frame *dst, const struct obs_source_frame *src, bool parallel);
+void replay_copy_pool_acquire(void);
+void replay_copy_pool_release(void);
+size_t replay_copy_pool_stripes(void);
+bool replay_copy_pool_run(void (*task)(void *param, size_t index), void *param, size_t count);
+void replay_simd_init(void);
+void replay_copy_plane(uint8_t *dst, uint32_t dst_linesize, const uint8_t *src, uint32_t src_linesize, uint32_t lines);
+void replay_convert_bgra(struct obs_source_frame *dst, const uint8_t *src, uint32_t linesize, enum video_colorspace colorspace, enum video_range_type range);
+float replay_audio_level(const struct obs_audio_data *audio, bool rms, float limit);
+float replay_audio_dot(const float *a, const float *b, size_t count);
+float replay_audio_energy(const float *src, size_t count);
+void replay_codec_residuals(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, size_t count);
+void replay_codec_rebuild4(uint8_t *cur, const uint8_t *prev, const uint8_t *res, size_t stride, size_t count, uint32_t near);
+void replay_codec_quantize4(uint8_t *res, size_t stride, uint8_t *rec, const uint8_t *cur, const uint8_t *prev, size_t count, uint32_t near);
+void replay_lerp_row(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t count, uint32_t weight);
+bool replay_frame_can_scale(enum video_format format);
+void replay_frame_scale(struct obs_source_frame *dst, const struct obs_source_frame *src, uint8_t **scratch, size_t *scratch_size);
+void replay_expand_y800(uint32_t *dst, const uint8_t *src, size_t count);
+size_t replay_frame_layout(enum video_format format, uint32_t width, uint32_t height, uint32_t linesize[MAX_AV_PLANES], size_t offset[MAX_AV_PLANES]);
 void free_audio_data(struct replay_filter *filter);
+void replay_audio_lock(struct replay_filter *filter);
+void replay_audio_unlock(struct replay_filter *filter);
+bool replay_audio_push(struct replay_filter *filter, const struct obs_audio_data *audio, uint64_t timestamp);
+size_t replay_audio_take(struct replay_filter *filter, struct obs_audio_data **packets, float *data[MAX_AV_PLANES]);
+size_t replay_audio_copy(struct replay_filter *filter, uint64_t from, uint64_t to, bool take, struct obs_audio_data **packets, float *data[MAX_AV_PLANES]);
+void replay_audio_free(struct replay_filter *filter);
+struct replay_stretch;
+struct replay_stretch *replay_stretch_create(void);
+void replay_stretch_destroy(struct replay_stretch *stretch);
+void replay_stretch_reset(struct replay_stretch *stretch);
+uint64_t replay_stretch_latency(uint32_t sample_rate, float speed_percent);
+void replay_stretch_push(struct replay_stretch *stretch, const struct obs_audio_data *audio, uint64_t timestamp, uint32_t sample_rate, float speed_percent);
+bool replay_stretch_pull(struct replay_stretch *stretch, uint64_t until, float speed_percent, struct obs_audio_data *out);
 void obs_enum_scenes(bool (*enum_proc)(void*, obs_source_t*),void *param);
 obs_properties_t *replay_filter_properties(void *unused);
 void replay_trigger_threshold(void *data);
@@ -58,11 +252,21 @@ void replay_filter_check(struct replay_filter* filter);
 #define TEXT_DURATION                  "Duration (ms)"
 #define SETTING_RETRIEVE_DELAY         "retrieve_delay"
 #define TEXT_RETRIEVE_DELAY            "Load delay (ms)"
+#define SETTING_SNAPSHOT               "snapshot"
+#define TEXT_SNAPSHOT                  "Keep the buffer when loading a replay"
+#define SETTING_RANGE_START            "range_start"
+#define TEXT_RANGE_START               "Partial load from (ms ago)"
+#define SETTING_RANGE_END              "range_end"
+#define TEXT_RANGE_END                 "Partial load to (ms ago)"
 #define SETTING_REPLAYS                "replays"
 #define TEXT_REPLAYS                   "Maximum replays"
 #define SETTING_SPEED                  "speed_percent"
 #define SETTING_SPEED_MIN              0.01f
 #define SETTING_SPEED_MAX              400.0f
+#define SETTING_PRESERVE_PITCH         "preserve_pitch"
+#define TEXT_PRESERVE_PITCH            "Keep the audio pitch at other speeds"
+#define SETTING_PLAYBACK_THREAD        "playback_thread"
+#define TEXT_PLAYBACK_THREAD           "Play on a separate thread"
 #define SETTING_BACKWARD               "backward"
 #define SETTING_VISIBILITY_ACTION      "visibility_action"
 #define SETTING_START_DELAY            "start_delay"
@@ -85,6 +289,48 @@ void replay_filter_check(struct replay_filter* filter);
 #define SETTING_AUDIO_THRESHOLD        "threshold"
 #define SETTING_AUDIO_THRESHOLD_MIN    -60.0
 #define SETTING_AUDIO_THRESHOLD_MAX    0.0f
+#define SETTING_AUDIO_THRESHOLD_TYPE   "threshold_type"
+#define TEXT_AUDIO_THRESHOLD_TYPE      "Threshold on"
+#define THRESHOLD_PEAK                 0
+#define THRESHOLD_RMS                  1
+#define SETTING_ZERO_COPY              "zero_copy"
+#define TEXT_ZERO_COPY                 "Zero-copy capture"
+#define SETTING_CAPTURE_FORMAT         "capture_format"
+#define TEXT_CAPTURE_FORMAT            "Capture format"
+#define SETTING_CAPTURE_HEIGHT         "capture_height"
+#define TEXT_CAPTURE_HEIGHT            "Capture height (0 = source)"
+#define SETTING_CAPTURE_FPS            "capture_fps"
+#define TEXT_CAPTURE_FPS               "Capture fps (0 = all frames)"
+#define SETTING_PARALLEL_COPY          "parallel_copy"
+#define TEXT_PARALLEL_COPY             "Copy large frames on multiple threads"
+#define SETTING_PREALLOCATE            "preallocate"
+#define TEXT_PREALLOCATE               "Preallocate capture buffer"
+#define SETTING_COMPRESS               "compress"
+#define TEXT_COMPRESS                  "Compress buffered frames"
+#define SETTING_COMPRESS_NEAR          "compress_near"
+#define SETTING_COMPRESS_NEAR_MIN      0
+#define SETTING_COMPRESS_NEAR_MAX      8
+#define TEXT_COMPRESS_NEAR             "Compression loss (0 = lossless)"
+#define SETTING_MEMORY_DURATION        "memory_duration"
+#define TEXT_MEMORY_DURATION           "Duration in memory (ms, 0 = all)"
+#define SETTING_SCRATCH_DIRECTORY      "scratch_directory"
+#define TEXT_SCRATCH_DIRECTORY         "Scratch directory"
+
+#define REPLAY_FRAME_POOL_MAX          16
+/* largest preallocated capture buffer, longer durations capture the rest
+ * into pooled frames */
+#define REPLAY_FRAME_ARENA_MAX         (4096ULL * 1024 * 1024)
+/* arena slots keep their arena in this plane pointer, no format uses it */
+#define REPLAY_ARENA_PLANE             (MAX_AV_PLANES - 1)
+/* spilled frames keep their segment in this plane pointer */
+#define REPLAY_SPILL_PLANE             (MAX_AV_PLANES - 2)
+#define REPLAY_INTERNAL_FRAMES_MAX     16
+#define REPLAY_PARALLEL_COPY_MIN       (12 * 1024 * 1024)
+/* queued frames above this are stored uncompressed to catch up */
+#define REPLAY_COMPRESS_BACKLOG_MAX    8
+/* longest a retrieve waits for the worker thread to store queued frames */
+#define REPLAY_FLUSH_TIMEOUT           500000000ULL
+#define REPLAY_SPILL_SEGMENT_SIZE      (256 * 1024 * 1024)
 
 #ifndef SEC_TO_NSEC
 #define SEC_TO_NSEC 1000000000ULL